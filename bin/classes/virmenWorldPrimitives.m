@@ -8,6 +8,9 @@ classdef virmenWorldPrimitives
     end
     properties (Hidden = true)
         walls = struct;
+        grid = struct;
+        lod = struct;
+        dirty = struct('vertices',zeros(0,1),'colors',zeros(0,1),'visible',zeros(0,1));
         changed = false;
     end
 end
\ No newline at end of file
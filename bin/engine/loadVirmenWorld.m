@@ -1,8 +1,44 @@
-function vrWorld = loadVirmenWorld(world)
+function vrWorld = loadVirmenWorld(world, cacheDir)
+% vrWorld = loadVirmenWorld(world, cacheDir)
+%   Triangulates a world for the engine. The geometry is cached in cacheDir (by default
+%   virmenWorldCache in prefdir, '' to disable) under a hash of the world definition, so that
+%   it is only computed again once the world has been edited; see virmenWorldCache.
+
+if nargin < 2
+    cacheDir = fullfile(prefdir, 'virmenWorldCache');
+end
 
 vrWorld = virmenWorldPrimitives;
 vrWorld.changed = true;
 
+vrWorld.objects.indices = [];
+for obj = 1:length(world.objects)
+    vrWorld.objects.indices.(world.objects{obj}.name) = obj;
+    
+end
+vrWorld.backgroundColor = world.backgroundColor;
+vrWorld.startLocation = world.startLocation;
+
+cacheFile = '';
+if ~isempty(cacheDir)
+    cacheFile = virmenWorldCache('file', world, cacheDir);
+end
+cached = [];
+if ~isempty(cacheFile)
+    cached = virmenWorldCache('read', cacheFile, vrWorld);
+end
+if ~isempty(cached)
+    vrWorld = cached;
+else
+    vrWorld = worldGeometry(world, vrWorld);
+    if ~isempty(cacheFile)
+        virmenWorldCache('write', cacheFile, vrWorld);
+    end
+end
+
+
+function vrWorld = worldGeometry(world, vrWorld)
+
 [objSurface, objVertices, objTriangles] = world.coords3D;
 vrWorld.surface.vertices = objSurface.vertices';
 vrWorld.surface.triangulation = int32(flipud(objSurface.triangulation')-1);
@@ -22,11 +58,6 @@ switch world.transparency
         end
 end
 
-vrWorld.objects.indices = [];
-for obj = 1:length(world.objects)
-    vrWorld.objects.indices.(world.objects{obj}.name) = obj;
-    
-end
 vrWorld.objects.vertices = objVertices;
 vrWorld.objects.triangles = objTriangles;
 edges = zeros(0,4);
@@ -49,8 +80,6 @@ for obj = 1:length(world.objects)
 end
 vrWorld.edges.endpoints = edges;
 vrWorld.edges.radius = radius;
-vrWorld.backgroundColor = world.backgroundColor;
-vrWorld.startLocation = world.startLocation;
 
 % Cached quantities used for collision detection
 hasBorder               = ~isnan(vrWorld.edges.radius);
@@ -65,4 +94,10 @@ vrWorld.walls.vector    = [ vrWorld.walls.radius .* cos(vrWorld.walls.angle + pi
                           ];
 vector                  = repmat(vrWorld.walls.vector, 1, 2);
 vrWorld.walls.border1   = vrWorld.walls.endpoints + vector;
-vrWorld.walls.border2   = vrWorld.walls.endpoints - vector;
\ No newline at end of file
+vrWorld.walls.border2   = vrWorld.walls.endpoints - vector;
+
+% Spatial index used to only process triangles near the animal
+vrWorld.grid            = virmenWorldGrid(vrWorld);
+
+% Coarser versions of the objects are only built by the engine once used, see virmenWorldLOD
+vrWorld.lod             = struct;
\ No newline at end of file
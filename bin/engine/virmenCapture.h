@@ -0,0 +1,210 @@
+#ifndef VIRMENCAPTURE_H
+#define VIRMENCAPTURE_H
+
+#include <vector>
+#include <deque>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <mex.h>
+
+
+/**
+  Records every frame presented in a window into a ring of pixel buffer objects, as RGB with 8
+  bits per channel. The transfer from the framebuffer is asynchronous and is only waited for
+  (using fences) once the ring has wrapped around, i.e. frames are delivered a few frames late
+  but without stalling rendering. Completed frames are either streamed to a raw file or queued
+  to be returned to Matlab, so that no frames are dropped.
+
+  The raw file starts with the 8 characters "VRMNRGB8" followed by the width and height as
+  int32, and then contains width x height x 3 bytes per frame, with rows from the bottom up as
+  in glReadPixels().
+*/
+class FrameCapture
+{
+protected:
+  struct Slot {
+    GLuint                    pixelBufferID;
+    GLsync                    gSync;
+    double                    frameNumber;
+  };
+
+  std::vector<Slot>           slots;
+  int                         oldest;
+  int                         numPending;
+  GLsizei                     width;
+  GLsizei                     height;
+  double                      numFrames;
+  FILE*                       stream;
+  std::deque< std::vector<GLubyte> >  completed;
+  std::deque<double>          completedNumbers;
+
+
+public:
+  FrameCapture()
+    : oldest(0), numPending(0), width(0), height(0), numFrames(0), stream(0)
+  { }
+
+  bool isActive() const       { return !slots.empty(); }
+  bool isStreaming() const    { return stream != 0; }
+  double count() const        { return numFrames; }
+  size_t frameSize() const    { return 3 * static_cast<size_t>(width) * height; }
+
+
+  /**
+    Allocates the ring of buffers, which must be done with the context of the window current.
+    If fileName is non-empty, frames are written to that file instead of being queued.
+  */
+  void start(GLsizei frameWidth, GLsizei frameHeight, int numBuffers, const char* fileName)
+  {
+    stop();
+
+    if (fileName && fileName[0]) {
+      stream                  = fopen(fileName, "wb");
+      if (!stream)
+        mexErrMsgIdAndTxt("virmenOpenGLRoutines:capture", "Could not open '%s' for writing.", fileName);
+      const int               size[]        = { frameWidth, frameHeight };
+      fwrite("VRMNRGB8", 1, 8, stream);
+      fwrite(size, sizeof(int), 2, stream);
+    }
+
+    completed.clear();
+    completedNumbers.clear();
+    width                     = frameWidth;
+    height                    = frameHeight;
+    numFrames                 = 0;
+    oldest                    = 0;
+    numPending                = 0;
+    slots.resize(numBuffers < 1 ? 1 : numBuffers);
+    for (size_t iSlot = 0; iSlot < slots.size(); ++iSlot) {
+      Slot&                   slot          = slots[iSlot];
+      glGenBuffers(1, &slot.pixelBufferID);
+      glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBufferID);
+      glBufferData(GL_PIXEL_PACK_BUFFER, frameSize(), NULL, GL_STREAM_READ);
+      slot.gSync              = 0;
+      slot.frameNumber        = 0;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  }
+
+  /**
+    Starts the transfer of the framebuffer that is currently bound for reading. If all buffers
+    are in use, the oldest frame is waited for first.
+  */
+  void record()
+  {
+    if (numPending == static_cast<int>(slots.size()))
+      retire(true);
+
+    Slot&                     slot          = slots[(oldest + numPending) % slots.size()];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBufferID);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, 0);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    slot.gSync                = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.frameNumber          = ++numFrames;
+    ++numPending;
+
+    // Opportunistically deliver frames that are already done, to keep the ring free
+    while (numPending > 0 && retire(false))
+      ;
+  }
+
+  /**
+    Delivers all frames that have completed, or all pending frames if wait is set.
+  */
+  void collect(bool wait)
+  {
+    while (numPending > 0 && retire(wait))
+      ;
+  }
+
+  /**
+    Returns queued frames as a 3 x width x height x nFrames uint8 array, with the frame numbers
+    (counted from the start of capture) optionally as a 1 x nFrames vector.
+  */
+  mxArray* takeFrames(mxArray** frameNumbers)
+  {
+    const mwSize              dims[]        = { 3, static_cast<mwSize>(width), static_cast<mwSize>(height), static_cast<mwSize>(completed.size()) };
+    mxArray*                  frames        = mxCreateNumericArray(4, dims, mxUINT8_CLASS, mxREAL);
+    GLubyte*                  target        = static_cast<GLubyte*>(mxGetData(frames));
+    if (frameNumbers) {
+      *frameNumbers           = mxCreateDoubleMatrix(1, completed.size(), mxREAL);
+      std::copy(completedNumbers.begin(), completedNumbers.end(), mxGetPr(*frameNumbers));
+    }
+
+    for (; !completed.empty(); completed.pop_front(), completedNumbers.pop_front(), target += frameSize())
+      memcpy(target, &completed.front()[0], frameSize());
+    return frames;
+  }
+
+  /**
+    Delivers all pending frames, closes the output file if any, and releases the buffers.
+  */
+  void stop()
+  {
+    if (!isActive())
+      return;
+
+    collect(true);
+    for (size_t iSlot = 0; iSlot < slots.size(); ++iSlot)
+      glDeleteBuffers(1, &slots[iSlot].pixelBufferID);
+    slots.clear();
+    if (stream)
+      fclose(stream);
+    stream                    = 0;
+  }
+
+  /**
+    For when the context no longer exists.
+  */
+  void release()
+  {
+    slots.clear();
+    completed.clear();
+    completedNumbers.clear();
+    if (stream)
+      fclose(stream);
+    stream                    = 0;
+  }
+
+
+protected:
+  /**
+    Copies the oldest pending frame to the file or queue, if its transfer has completed or if
+    wait is set. Returns true if a frame was delivered.
+  */
+  bool retire(bool wait)
+  {
+    Slot&                     slot          = slots[oldest];
+    while (true) {
+      const GLenum            waitReturn    = glClientWaitSync(slot.gSync, GL_SYNC_FLUSH_COMMANDS_BIT, wait ? 1000000 : 0);
+      if (waitReturn == GL_ALREADY_SIGNALED || waitReturn == GL_CONDITION_SATISFIED || waitReturn == GL_WAIT_FAILED)
+        break;                // mapping will synchronize if waiting failed
+      if (!wait)
+        return false;
+    }
+    glDeleteSync(slot.gSync);
+    slot.gSync                = 0;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, slot.pixelBufferID);
+    const GLubyte*            pixels        = static_cast<const GLubyte*>(glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, frameSize(), GL_MAP_READ_BIT));
+    if (pixels) {
+      if (stream)
+        fwrite(pixels, 1, frameSize(), stream);
+      else {
+        completed.push_back(std::vector<GLubyte>(pixels, pixels + frameSize()));
+        completedNumbers.push_back(slot.frameNumber);
+      }
+      glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    oldest                    = (oldest + 1) % slots.size();
+    --numPending;
+    return true;
+  }
+};
+
+
+#endif //VIRMENCAPTURE_H
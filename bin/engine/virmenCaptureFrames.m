@@ -0,0 +1,37 @@
+function varargout = virmenCaptureFrames(action, w, varargin)
+% virmenCaptureFrames('start', w, [fileName], [numBuffers])
+% [frames, frameNumbers] = virmenCaptureFrames('poll', w)
+% [frames, frameNumbers, numCaptured] = virmenCaptureFrames('stop', w)
+%   Records every frame presented in ViRMEn window w, without stalling rendering as
+%   virmenGetFrame() does. Pixels are transferred asynchronously into a ring of numBuffers
+%   (default 3) pixel buffers and delivered a few frames later, as uint8 RGB.
+%
+%   If fileName is given, frames are streamed to that raw file, which can be read with
+%   virmenReadCapture(). Otherwise 'poll' returns the frames that have completed since the
+%   previous call, and 'stop' all remaining ones. Frames are returned as a
+%   height x width x 3 x nFrames array with the same orientation as virmenGetFrame(), and
+%   frameNumbers counts presented frames from the start of capture.
+
+switch action
+  case 'start'
+    fileName    = '';
+    numBuffers  = [];
+    if numel(varargin) > 0
+      fileName  = varargin{1};
+    end
+    if numel(varargin) > 1
+      numBuffers= varargin{2};
+    end
+    virmenOpenGLRoutines(10, w, numBuffers, fileName);
+
+  case 'poll'
+    [frames, varargout{2}] = virmenOpenGLRoutines(11, w);
+    varargout{1}  = permute(frames, [3 2 1 4]);
+
+  case 'stop'
+    [frames, varargout{2}, varargout{3}] = virmenOpenGLRoutines(12, w);
+    varargout{1}  = permute(frames, [3 2 1 4]);
+
+  otherwise
+    error('virmenCaptureFrames:action', 'Unknown action ''%s'', must be start, poll or stop.', action);
+end
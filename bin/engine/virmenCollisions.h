@@ -0,0 +1,997 @@
+#ifndef VIRMENCOLLISIONS_H
+#define VIRMENCOLLISIONS_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <functional>
+#include "virmenSIMD.h"
+
+
+/**
+  Continuous collision detection of the animal, a point swept along its displacement dp, with
+  walls inflated by their radius (vrWorld.walls, see loadVirmenWorld). Walls are packed into a
+  WallTable with a uniform grid that restricts tests to those near the swept segment, and the
+  intersection tests are vectorised with AVX2 if available, with identical results. The part of
+  dp that runs into walls is projected along them in steps of dpResolution. resolveFootprint
+  extends this to an animal of some length that also turns.
+
+  This does not depend on Matlab, so that it can be used outside of virmenResolveCollisions.
+*/
+namespace collisions {
+
+  static const double  EPSILON   = 1e-10;
+
+
+  //=============================================================================
+  //  Quick and dirty math functions
+  //=============================================================================
+
+  inline void copyTo(int n, double* a, const double* b, const double bScale = 1) {
+    for (int i = 0; i < n; ++i) a[i]  = b[i] * bScale;
+  }
+  inline void copyTo(int n, double* a, const double b) {
+    for (int i = 0; i < n; ++i) a[i]  = b;
+  }
+  inline void addTo(int n, double* a, const double* b, const double bScale = 1) {
+    for (int i = 0; i < n; ++i) a[i] += b[i] * bScale;
+  }
+  inline void multiplyTo(int n, double* a, const double* b, const double bScale = 1) {
+    for (int i = 0; i < n; ++i) a[i] *= b[i] * bScale;
+  }
+  inline void multiplyTo(int n, double* a, const double b) {
+    for (int i = 0; i < n; ++i) a[i] *= b;
+  }
+  inline double norm2(int n, const double* a) {
+    double sum2 = 0;
+    for (int i = 0; i < n; ++i) sum2 += a[i] * a[i];
+    return sum2;
+  }
+  inline double norm(int n, const double* a) {
+    return sqrt(norm2(n, a));
+  }
+  inline double dot(int n, const double* a, const double* b) {
+    double sumAB = 0;
+    for (int i = 0; i < n; ++i) sumAB += a[i] * b[i];
+    return sumAB;
+  }
+  inline double sqr(double x) { return x*x; }
+
+
+  //=============================================================================
+  //  Wall tables
+  //=============================================================================
+
+  /**
+    Wall packed from the columns of vrWorld.walls (see loadVirmenWorld), so that everything the
+    intersection tests need is in two adjacent cache lines instead of thirteen columns.
+  */
+  struct Wall
+  {
+    double            border[2][4];               // border1 and border2, [x1 y1 x2 y2]
+    double            endpoints[4];               // [x1 y1 x2 y2]
+    double            radius2;
+    double            angle;
+  };
+
+
+  //=============================================================================
+  //  Intersection of primitives
+  //=============================================================================
+
+  /**
+    Nearest intersection found so far. The slope of the wall at that point is only computed once
+    the nearest of all is known, since that costs an atan for the circles around endpoints.
+  */
+  struct Hit
+  {
+    double          crossingPt;
+    int             iWall;
+    int             type;                         // 0/1 for border1/border2, 2/3 for the circle around endpoint 1/2
+
+    Hit() : crossingPt(1e308), iWall(-9), type(0) { }
+
+    double slope(const double* pos, const double* dp, const Wall* wall) const
+    {
+      if (type < 2)
+        return wall[iWall].angle;
+      const double* e         = wall[iWall].endpoints + 2*(type - 2);
+      const double  newpt[]   = { pos[0] + crossingPt * dp[0] - e[0]
+                                , pos[1] + crossingPt * dp[1] - e[1]
+                                };
+      return atan(newpt[1] / newpt[0]) + 1.5707963267949;                 // pi/2
+    }
+  };
+
+
+  inline bool isInSegment(double t) {
+    return ( t >= 0 && t <= 1 );
+  }
+
+  inline void  lineLineIntersection( const double*       pos
+                                   , const double*       dp
+                                   , const Wall*         wall
+                                   , const int           side
+                                   , const std::vector<int>& walls
+                                   ,       Hit&          nearest
+                                   , const size_t        first = 0
+                                   )
+  {
+    for (size_t iCand = first; iCand < walls.size(); ++iCand) 
+    {
+      const int     iWall     = walls[iCand];
+      const double* e         = wall[iWall].border[side];
+      const double  x31[]     = { e[0] - pos[0], e[1] - pos[1] };
+      const double  x34[]     = { e[0] - e[2]  , e[1] - e[3]   };
+      const double  detM      = dp[0] * x34[1] - dp[1] * x34[0];
+
+      const double  t         = ( x31[0] * x34[1] - x31[1] * x34[0] ) / detM;
+      const double  s         = ( x31[1] * dp[0]  - x31[0] * dp[1]  ) / detM;
+      
+      if ( isInSegment(t) && isInSegment(s) && t < nearest.crossingPt ) {
+        nearest.crossingPt    = t;
+        nearest.iWall         = iWall;
+        nearest.type          = side;
+      }
+    }
+  }
+
+
+  inline void lineCircleIntersection( const double*       pos
+                                    , const double*       dp
+                                    , const Wall*         wall
+                                    , const std::vector<int>& walls
+                                    ,       Hit&          nearest
+                                    , const size_t        first = 0
+                                    )
+  {
+    for (size_t iCand = first; iCand < walls.size(); ++iCand) {
+      const int       iWall     = walls[iCand];
+      for (int iPt = 0; iPt < 2; ++iPt)
+      {
+        const double* e         = wall[iWall].endpoints + 2*iPt;
+        const double  x31[]     = { e[0] - pos[0], e[1] - pos[1] };
+        const double  x31d31    = dot(2, x31, x31);
+        const double  x21d21    = dot(2, dp , dp );
+        const double  x31d21    = dot(2, x31, dp );
+        const double  discr     = 4*sqr(x31d21) - 4*x21d21*(x31d31 - wall[iWall].radius2);
+        if (discr < 0)          continue;
+
+        const double  sqDiscr   = sqrt(discr);
+        const double  root1     = (2*x31d21 - sqDiscr) / (2*x21d21);
+        const double  root2     = (2*x31d21 + sqDiscr) / (2*x21d21);
+      
+        double        root;
+        if (isInSegment(root1))             root  = root1;
+        else if (isInSegment(root2))        root  = root2;
+        else                                continue;
+        if (root < nearest.crossingPt) {
+          nearest.crossingPt    = root;
+          nearest.iWall         = iWall;
+          nearest.type          = 2 + iPt;
+        }
+      }
+    }
+  }
+
+
+#ifdef VIRMEN_AVX2
+
+  /**
+    The same tests for 4 walls at a time, with the same operations in the same order so that
+    results are identical. Each lane keeps the first of its smallest crossing points, and lanes
+    are reduced by crossing point and then position in the list of candidates, which is the
+    wall that the scalar loop finds first. Remaining candidates are left to the scalar loop.
+  */
+  namespace avx2 {
+
+    /// Whether the AVX2 kernels are used, by default if supported; can be cleared to compare with the scalar ones
+    inline bool& enabled()
+    {
+      static bool             isEnabled     = has_avx2();
+      return isEnabled;
+    }
+
+    /// Rows [x1 y1 x2 y2] of 4 walls, transposed to x1, y1, x2, y2 of each
+    VIRMEN_TARGET_AVX2 static inline void load_segments(const double* row[4], __m256d& x1, __m256d& y1, __m256d& x2, __m256d& y2)
+    {
+      const __m256d           r0            = _mm256_loadu_pd(row[0]);
+      const __m256d           r1            = _mm256_loadu_pd(row[1]);
+      const __m256d           r2            = _mm256_loadu_pd(row[2]);
+      const __m256d           r3            = _mm256_loadu_pd(row[3]);
+      const __m256d           x01           = _mm256_unpacklo_pd(r0, r1);                 // x1 x1 x2 x2 of walls 0, 1
+      const __m256d           y01           = _mm256_unpackhi_pd(r0, r1);
+      const __m256d           x23           = _mm256_unpacklo_pd(r2, r3);
+      const __m256d           y23           = _mm256_unpackhi_pd(r2, r3);
+      x1                      = _mm256_permute2f128_pd(x01, x23, 0x20);
+      x2                      = _mm256_permute2f128_pd(x01, x23, 0x31);
+      y1                      = _mm256_permute2f128_pd(y01, y23, 0x20);
+      y2                      = _mm256_permute2f128_pd(y01, y23, 0x31);
+    }
+
+    VIRMEN_TARGET_AVX2 static inline __m256d is_in_segment(__m256d t)
+    {
+      return _mm256_and_pd( _mm256_cmp_pd(t, _mm256_setzero_pd(), _CMP_GE_OQ)
+                          , _mm256_cmp_pd(t, _mm256_set1_pd(1)  , _CMP_LE_OQ)
+                          );
+    }
+
+    /// Smallest crossing point over lanes, and among equal ones the first in sequence
+    VIRMEN_TARGET_AVX2 static inline bool reduce(__m256d best, __m256d bestSeq, double& crossingPt, int& seq)
+    {
+      double                  lane[4], laneSeq[4];
+      _mm256_storeu_pd(lane, best);
+      _mm256_storeu_pd(laneSeq, bestSeq);
+      int                     iBest         = 0;
+      for (int iLane = 1; iLane < 4; ++iLane)
+        if (lane[iLane] < lane[iBest] || (lane[iLane] == lane[iBest] && laneSeq[iLane] < laneSeq[iBest]))
+          iBest               = iLane;
+      if (!(lane[iBest] < crossingPt))
+        return false;
+      crossingPt              = lane[iBest];
+      seq                     = static_cast<int>( laneSeq[iBest] );
+      return true;
+    }
+
+    VIRMEN_TARGET_AVX2 inline void lineLineIntersection( const double*       pos
+                                                       , const double*       dp
+                                                       , const Wall*         wall
+                                                       , const int           side
+                                                       , const std::vector<int>& walls
+                                                       ,       Hit&          nearest
+                                                       )
+    {
+      const __m256d           px            = _mm256_set1_pd(pos[0]);
+      const __m256d           py            = _mm256_set1_pd(pos[1]);
+      const __m256d           dx            = _mm256_set1_pd(dp[0]);
+      const __m256d           dy            = _mm256_set1_pd(dp[1]);
+      __m256d                 best          = _mm256_set1_pd(HUGE_VAL);
+      __m256d                 bestSeq       = _mm256_setzero_pd();
+      __m256d                 seq           = _mm256_setr_pd(0, 1, 2, 3);
+
+      size_t                  iCand         = 0;
+      for (; iCand + 4 <= walls.size(); iCand += 4, seq = _mm256_add_pd(seq, _mm256_set1_pd(4))) {
+        const double*         row[]         = { wall[walls[iCand  ]].border[side], wall[walls[iCand+1]].border[side]
+                                              , wall[walls[iCand+2]].border[side], wall[walls[iCand+3]].border[side]
+                                              };
+        __m256d               e1, e2, e3, e4;
+        load_segments(row, e1, e2, e3, e4);
+
+        const __m256d         x31x          = _mm256_sub_pd(e1, px);
+        const __m256d         x31y          = _mm256_sub_pd(e2, py);
+        const __m256d         x34x          = _mm256_sub_pd(e1, e3);
+        const __m256d         x34y          = _mm256_sub_pd(e2, e4);
+        const __m256d         detM          = _mm256_sub_pd(_mm256_mul_pd(dx, x34y), _mm256_mul_pd(dy, x34x));
+        const __m256d         t             = _mm256_div_pd(_mm256_sub_pd(_mm256_mul_pd(x31x, x34y), _mm256_mul_pd(x31y, x34x)), detM);
+        const __m256d         s             = _mm256_div_pd(_mm256_sub_pd(_mm256_mul_pd(x31y, dx), _mm256_mul_pd(x31x, dy)), detM);
+
+        const __m256d         isNearer      = _mm256_and_pd( _mm256_and_pd(is_in_segment(t), is_in_segment(s))
+                                                           , _mm256_cmp_pd(t, best, _CMP_LT_OQ)
+                                                           );
+        best                  = _mm256_blendv_pd(best, t, isNearer);
+        bestSeq               = _mm256_blendv_pd(bestSeq, seq, isNearer);
+      }
+
+      int                     iSeq;
+      if (reduce(best, bestSeq, nearest.crossingPt, iSeq)) {
+        nearest.iWall         = walls[iSeq];
+        nearest.type          = side;
+      }
+      _mm256_zeroupper();                         // not inserted by all compilers for target attributes
+      collisions::lineLineIntersection(pos, dp, wall, side, walls, nearest, iCand);
+    }
+
+    VIRMEN_TARGET_AVX2 inline void lineCircleIntersection( const double*       pos
+                                                         , const double*       dp
+                                                         , const Wall*         wall
+                                                         , const std::vector<int>& walls
+                                                         ,       Hit&          nearest
+                                                         )
+    {
+      const __m256d           zero          = _mm256_setzero_pd();
+      const __m256d           two           = _mm256_set1_pd(2);
+      const __m256d           px            = _mm256_set1_pd(pos[0]);
+      const __m256d           py            = _mm256_set1_pd(pos[1]);
+      const __m256d           dx            = _mm256_set1_pd(dp[0]);
+      const __m256d           dy            = _mm256_set1_pd(dp[1]);
+      const __m256d           x21d21        = _mm256_set1_pd(dot(2, dp, dp));
+      const __m256d           denominator   = _mm256_mul_pd(two, x21d21);
+      const __m256d           fourX21d21    = _mm256_mul_pd(_mm256_set1_pd(4), x21d21);
+      __m256d                 best          = _mm256_set1_pd(HUGE_VAL);
+      __m256d                 bestSeq       = _mm256_setzero_pd();
+      __m256d                 seq           = _mm256_setr_pd(0, 2, 4, 6);       // 2*candidate + endpoint
+
+      size_t                  iCand         = 0;
+      for (; iCand + 4 <= walls.size(); iCand += 4, seq = _mm256_add_pd(seq, _mm256_set1_pd(8))) {
+        const Wall*           w[]           = { &wall[walls[iCand]], &wall[walls[iCand+1]], &wall[walls[iCand+2]], &wall[walls[iCand+3]] };
+        const double*         row[]         = { w[0]->endpoints, w[1]->endpoints, w[2]->endpoints, w[3]->endpoints };
+        __m256d               ex[2], ey[2];
+        load_segments(row, ex[0], ey[0], ex[1], ey[1]);
+        const __m256d         radius2       = _mm256_setr_pd(w[0]->radius2, w[1]->radius2, w[2]->radius2, w[3]->radius2);
+
+        for (int iPt = 0; iPt < 2; ++iPt) {
+          const __m256d       x31x          = _mm256_sub_pd(ex[iPt], px);
+          const __m256d       x31y          = _mm256_sub_pd(ey[iPt], py);
+          const __m256d       x31d31        = _mm256_add_pd(_mm256_add_pd(zero, _mm256_mul_pd(x31x, x31x)), _mm256_mul_pd(x31y, x31y));
+          const __m256d       x31d21        = _mm256_add_pd(_mm256_add_pd(zero, _mm256_mul_pd(x31x, dx  )), _mm256_mul_pd(x31y, dy  ));
+          const __m256d       discr         = _mm256_sub_pd( _mm256_mul_pd(_mm256_set1_pd(4), _mm256_mul_pd(x31d21, x31d21))
+                                                           , _mm256_mul_pd(fourX21d21, _mm256_sub_pd(x31d31, radius2))
+                                                           );
+          const __m256d       sqDiscr       = _mm256_sqrt_pd(discr);        // NaN and not in segment if discr < 0
+          const __m256d       root1         = _mm256_div_pd(_mm256_sub_pd(_mm256_mul_pd(two, x31d21), sqDiscr), denominator);
+          const __m256d       root2         = _mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(two, x31d21), sqDiscr), denominator);
+
+          const __m256d       root          = _mm256_blendv_pd( _mm256_blendv_pd(_mm256_set1_pd(HUGE_VAL), root2, is_in_segment(root2))
+                                                              , root1, is_in_segment(root1)
+                                                              );
+          const __m256d       isNearer      = _mm256_cmp_pd(root, best, _CMP_LT_OQ);
+          best                = _mm256_blendv_pd(best, root, isNearer);
+          bestSeq             = _mm256_blendv_pd(bestSeq, _mm256_add_pd(seq, _mm256_set1_pd(iPt)), isNearer);
+        }
+      }
+
+      int                     iSeq;
+      if (reduce(best, bestSeq, nearest.crossingPt, iSeq)) {
+        nearest.iWall         = walls[iSeq / 2];
+        nearest.type          = 2 + iSeq % 2;
+      }
+      _mm256_zeroupper();
+      collisions::lineCircleIntersection(pos, dp, wall, walls, nearest, iCand);
+    }
+
+  }
+
+#endif //VIRMEN_AVX2
+
+
+
+  //=============================================================================
+  //  Broad phase
+  //=============================================================================
+
+  /**
+    Uniform grid over the walls of a world, in which each wall is listed in all cells overlapped
+    by its bounding box, i.e. that of its endpoints inflated by its radius and of its borders.
+    Since every point at which a wall can be hit lies in that box, a segment from pos to pos + dp
+    can only hit walls listed in the cells overlapped by its own bounding box. Candidates are
+    returned in increasing order, so that ties are resolved as when testing all walls. Queries
+    do not modify the grid and can be made concurrently.
+  */
+  class WallGrid
+  {
+  protected:
+    double                    origin[2];
+    double                    cellSize;
+    int                       numCells[2];        // 0 if all walls are tested
+    std::vector<int>          cellStart;          // walls of cell c are cellWalls[cellStart[c] ...]
+    std::vector<int>          cellWalls;
+    std::vector<int>          allWalls;
+
+    static const size_t       MIN_WALLS         = 16;     // brute force is faster below this
+    static const int          WALLS_PER_CELL    = 2;
+
+    int cell(double coord, int axis) const
+    {
+      const double            index             = floor((coord - origin[axis]) / cellSize);
+      return static_cast<int>( std::max(0.0, std::min(numCells[axis] - 1.0, index)) );
+    }
+
+  public:
+    WallGrid() : cellSize(0) { numCells[0] = numCells[1] = 0; }
+
+    void build(const std::vector<Wall>& wall)
+    {
+      const size_t            numWalls          = wall.size();
+      allWalls.resize(numWalls);
+      for (size_t iWall = 0; iWall < numWalls; ++iWall)
+        allWalls[iWall]       = static_cast<int>(iWall);
+      numCells[0]             = numCells[1]     = 0;
+      if (numWalls < MIN_WALLS)
+        return;
+
+      // Bounding boxes [xmin ymin xmax ymax] of walls, with a margin for rounding errors
+      std::vector<double>     bounds(4*numWalls);
+      double                  lo[]              = {  HUGE_VAL,  HUGE_VAL };
+      double                  hi[]              = { -HUGE_VAL, -HUGE_VAL };
+      double                  sumSize           = 0;
+      for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+        const double          radius            = sqrt(wall[iWall].radius2);
+        double*               box               = &bounds[4*iWall];
+        for (int axis = 0; axis < 2; ++axis) {
+          const double*       x                 = wall[iWall].endpoints + axis;
+          const double*       b1                = wall[iWall].border[0] + axis;
+          const double*       b2                = wall[iWall].border[1] + axis;
+          box[axis]           = std::min(std::min(x[0], x[2]) - radius, std::min(std::min(b1[0], b1[2]), std::min(b2[0], b2[2])));
+          box[axis+2]         = std::max(std::max(x[0], x[2]) + radius, std::max(std::max(b1[0], b1[2]), std::max(b2[0], b2[2])));
+          const double        margin            = 1e-9 * (1 + std::max(fabs(box[axis]), fabs(box[axis+2])));
+          box[axis]          -= margin;
+          box[axis+2]        += margin;
+          if (!(box[axis] <= box[axis+2]) || !std::isfinite(box[axis]) || !std::isfinite(box[axis+2]))
+            return;                                       // test all walls
+          lo[axis]            = std::min(lo[axis], box[axis]);
+          hi[axis]            = std::max(hi[axis], box[axis+2]);
+        }
+        sumSize              += std::max(box[2] - box[0], box[3] - box[1]);
+      }
+
+      // Cells of at least the average wall size, and a few walls each
+      const double            extent[]          = { hi[0] - lo[0], hi[1] - lo[1] };
+      cellSize                = std::max(sumSize / numWalls, sqrt(WALLS_PER_CELL * extent[0] * extent[1] / numWalls));
+      for (int axis = 0; axis < 2; ++axis) {
+        origin[axis]          = lo[axis];
+        numCells[axis]        = std::max(1, static_cast<int>( ceil(extent[axis] / cellSize) ));
+      }
+
+      // Walls listed per cell, in increasing order
+      cellStart.assign(numCells[0] * numCells[1] + 1, 0);
+      for (int pass = 0; pass < 2; ++pass) {
+        if (pass == 1) {
+          for (size_t iCell = 1; iCell < cellStart.size(); ++iCell)
+            cellStart[iCell]   += cellStart[iCell - 1];
+          cellWalls.resize(cellStart.back());
+        }
+        for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+          const double*       box               = &bounds[4*iWall];
+          for (int iy = cell(box[1], 1); iy <= cell(box[3], 1); ++iy)
+            for (int ix = cell(box[0], 0); ix <= cell(box[2], 0); ++ix) {
+              const int       iCell             = ix + iy * numCells[0];
+              if (pass == 0)  ++cellStart[iCell + 1];
+              else            cellWalls[cellStart[iCell]++] = static_cast<int>(iWall);
+            }
+        }
+      }
+      for (size_t iCell = cellStart.size() - 1; iCell > 0; --iCell)
+        cellStart[iCell]      = cellStart[iCell - 1];
+      cellStart[0]            = 0;
+    }
+
+    /**
+      Walls that the segment from pos to pos + dp, or anything within margin of it, may hit, in
+      increasing order. All walls are returned for small worlds and for segments that span more
+      cells than there are walls.
+    */
+    const std::vector<int>& candidates(const double* pos, const double* dp, std::vector<int>& walls, double margin = 0) const
+    {
+      if (numCells[0] < 1)
+        return allWalls;
+
+      const double            box[]             = { std::min(pos[0], pos[0] + dp[0]) - margin, std::min(pos[1], pos[1] + dp[1]) - margin
+                                                  , std::max(pos[0], pos[0] + dp[0]) + margin, std::max(pos[1], pos[1] + dp[1]) + margin
+                                                  };
+      walls.clear();
+      if (!(box[2] >= origin[0] && box[3] >= origin[1]))
+        return box[2] < origin[0] || box[3] < origin[1] ? walls : allWalls;
+      if (box[0] > origin[0] + numCells[0] * cellSize || box[1] > origin[1] + numCells[1] * cellSize)
+        return walls;
+
+      const int               ix0               = cell(box[0], 0),  ix1 = cell(box[2], 0);
+      const int               iy0               = cell(box[1], 1),  iy1 = cell(box[3], 1);
+      if (static_cast<double>(ix1 - ix0 + 1) * (iy1 - iy0 + 1) > allWalls.size())
+        return allWalls;
+
+      for (int iy = iy0; iy <= iy1; ++iy)
+        for (int ix = ix0; ix <= ix1; ++ix) {
+          const int           iCell             = ix + iy * numCells[0];
+          walls.insert(walls.end(), cellWalls.begin() + cellStart[iCell], cellWalls.begin() + cellStart[iCell + 1]);
+        }
+      std::sort(walls.begin(), walls.end());
+      walls.erase(std::unique(walls.begin(), walls.end()), walls.end());
+      return walls;
+    }
+  };
+
+  /**
+    Walls of a world, packed once either when registered by the engine, or when the tables passed
+    to a call differ from those of the previous call.
+  */
+  class WallTable
+  {
+  protected:
+    std::vector<Wall>         wall;
+    WallGrid                  grid;
+
+  public:
+    size_t size() const                         { return wall.size(); }
+    const Wall* data() const                    { return wall.empty() ? 0 : &wall[0]; }
+    const WallGrid& broad_phase() const         { return grid; }
+
+    /// Columns of the tables, with numWalls rows in endpoints, border1 and border2
+    void pack( size_t numWalls, const double* endpoints, const double* radius2, const double* angle
+             , const double* border1, const double* border2
+             )
+    {
+      wall.resize(numWalls);
+      for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+        for (int iCol = 0; iCol < 4; ++iCol) {
+          wall[iWall].border[0][iCol]   = border1  [iWall + iCol*numWalls];
+          wall[iWall].border[1][iCol]   = border2  [iWall + iCol*numWalls];
+          wall[iWall].endpoints[iCol]   = endpoints[iWall + iCol*numWalls];
+        }
+        wall[iWall].radius2             = radius2  [iWall];
+        wall[iWall].angle               = angle    [iWall];
+      }
+      grid.build(wall);
+    }
+
+    bool equals( size_t numWalls, const double* endpoints, const double* radius2, const double* angle
+               , const double* border1, const double* border2
+               ) const
+    {
+      if (wall.size() != numWalls)
+        return false;
+      for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+        if (wall[iWall].radius2 != radius2[iWall] || wall[iWall].angle != angle[iWall])
+          return false;
+        for (int iCol = 0; iCol < 4; ++iCol)
+          if ( wall[iWall].border[0][iCol] != border1  [iWall + iCol*numWalls]
+            || wall[iWall].border[1][iCol] != border2  [iWall + iCol*numWalls]
+            || wall[iWall].endpoints[iCol] != endpoints[iWall + iCol*numWalls]
+             )
+            return false;
+      }
+      return true;
+    }
+  };
+
+  /**
+    Walls that are all tested in place of the grid of a WallTable, for sets that change at every
+    call such as the sides swept by a footprint.
+  */
+  class WallList
+  {
+  protected:
+    const Wall*               wall;
+    const std::vector<int>&   walls;
+
+  public:
+    WallList(const Wall* wall, const std::vector<int>& walls) : wall(wall), walls(walls) { }
+
+    const Wall* data() const                    { return wall; }
+    const WallList& broad_phase() const         { return *this; }
+    const std::vector<int>& candidates(const double*, const double*, std::vector<int>&, double = 0) const { return walls; }
+  };
+
+  static const size_t  MIN_AGENTS_PER_THREAD = 256;
+  static const size_t  MAX_THREADS           = 8;
+
+
+  //=============================================================================
+  //  Collision detection algorithms
+  //=============================================================================
+
+  /// Walls is a WallTable or a WallList
+  template<typename Walls>
+  inline bool nearestIntersection( const double*       pos
+                                 , const double*       dp
+                                 , const Walls&        table
+                                 ,       double&       crossingFrac
+                                 ,       double&       slope
+                                 ,       double*       wallTangent
+                                 )
+  {
+    // Only walls near the swept segment can be hit
+    static thread_local std::vector<int>  candidates;
+    const std::vector<int>&   walls     = table.broad_phase().candidates(pos, dp, candidates);
+    Hit                       nearest;
+
+#ifdef VIRMEN_AVX2
+    if (avx2::enabled()) {
+      avx2::lineLineIntersection  ( pos, dp, table.data(), 0, walls, nearest );
+      avx2::lineLineIntersection  ( pos, dp, table.data(), 1, walls, nearest );
+      avx2::lineCircleIntersection( pos, dp, table.data(), walls, nearest );
+    }
+    else
+#endif
+    {
+      // Line-line intersections
+      lineLineIntersection( pos, dp, table.data(), 0, walls, nearest );
+      lineLineIntersection( pos, dp, table.data(), 1, walls, nearest );
+
+      // Line-circle intersections
+      lineCircleIntersection( pos, dp, table.data(), walls, nearest );
+    }
+
+    crossingFrac      = nearest.crossingPt;
+    if (crossingFrac <= 1) {
+      slope           = nearest.slope(pos, dp, table.data());
+      wallTangent[0]  = cos(slope);
+      wallTangent[1]  = sin(slope);
+      return true;
+    }
+    return false;
+  }
+
+
+  /// Events that indicate trouble with the geometry, counted per thread for diagnostics and tests
+  struct Diagnostics
+  {
+    size_t          iterationLimits;              // detectCollision gave up and zeroed dp
+
+    Diagnostics() : iterationLimits(0) { }
+  };
+
+  inline Diagnostics& diagnostics()
+  {
+    static thread_local Diagnostics   counts;
+    return counts;
+  }
+
+
+  template<typename Walls>
+  inline bool detectCollision( const double*       pos
+                             , const double*       dp
+                             , const Walls&        table
+                             , const double        epsilon
+                             ,       double*       slideDP
+                             , const int           maxIterations = 50
+                             )
+  {
+    copyTo(2, slideDP, dp);
+
+    bool                collision = false;
+    int                 it        = 0;
+    for (; it < maxIterations; ++it)
+    {
+      // If the displacement to resolve is too small, zero it out to prevent
+      // infinite loops with infinitesimal corrections
+      if (fabs(slideDP[0]) < epsilon && fabs(slideDP[1]) < epsilon)
+        break;          // slideDP is zeroed out later
+
+
+      double            crossingFrac, slope;
+      double            wallTangent[2];
+      if (nearestIntersection( pos, slideDP, table, crossingFrac, slope, wallTangent )) 
+      {
+        const double    projDP    = dot(2, slideDP, wallTangent);
+        copyTo(2, slideDP, wallTangent, projDP);
+        collision       = true;
+      }
+      else return collision;
+    }
+
+
+    // If we've reached this point too many iterations have elapsed, so to be
+    // safe just set dp to zero
+    if (it == maxIterations)
+      ++diagnostics().iterationLimits;
+    copyTo(2, slideDP, 0.);
+    return collision;
+  }
+
+
+  //=============================================================================
+  //  Main logic
+  //=============================================================================
+
+  /**
+    Displacement outDP that is left of inDP after sliding along the walls that it runs into, from
+    the position inPos. Returns true if any wall was hit.
+  */
+  template<typename Walls>
+  inline bool resolveCollisions( const double*       inPos
+                               , const double*       inDP
+                               , const Walls&        table
+                               , const double        dpResolution
+                               ,       double*       outDP
+                               )
+  {
+    //----- Initial values for iterative algorithm
+    const double        epsilon       = 1e-2 * dpResolution;
+    const double        dpAngle       = atan2(inDP[1], inDP[0]);
+    double              pos[]         = {inPos[0], inPos[1]};
+    double              dp[]          = {inDP [0], inDP [1]};
+    bool                collision     = false;
+
+    if (std::isfinite(dpResolution)) {
+
+    //----- Iteratively resolve the remaining dp
+    while (fabs(dp[0]) > epsilon || fabs(dp[1]) > epsilon) 
+    {
+      // In case of no collisions, retain the entire displacement vector and stop
+      double            crossingFrac, slope;
+      double            wallTangent[2];
+      if (!nearestIntersection(pos, dp, table, crossingFrac, slope, wallTangent)) {
+        addTo(2, pos, dp);
+        break;
+      }
+      collision         = true;
+
+      // Retain the piece of dp up to the collision point minus some small 
+      // distance so as not to be inside the wall
+      double            dpLength      = norm(2, dp);
+      const double      dpPerp        = dpLength * fabs(sin(dpAngle - slope));
+      double            remainFrac    = 1;
+      const double     noCollFrac    = crossingFrac - epsilon/dpPerp;
+      if (noCollFrac > 0) {
+        addTo(2, pos, dp, noCollFrac);
+        remainFrac -= noCollFrac;
+      }
+
+      // Compute the appropriate piece of dp to project along the wall so
+      // that the lost length (perpendicular component) is small enough
+      double            chunkDP[2];
+      double            collFrac      = remainFrac;
+      collFrac          = dpResolution / dpPerp;
+      if (collFrac > remainFrac)
+        collFrac        = remainFrac;
+
+
+      // Replace the colliding fragment of dp with the component parallel to the wall
+      copyTo(2, chunkDP, wallTangent, dot(2, dp, wallTangent) * collFrac);
+      remainFrac       -= collFrac;
+
+      // Resolve additional collisions using the original algorithm
+      double            slideDP[2];
+      collision        |= detectCollision(pos, chunkDP, table, epsilon, slideDP);
+      addTo(2, pos, slideDP);
+
+
+      // Reduce dp to the remaining length
+      multiplyTo(2, dp, remainFrac);
+    }
+
+    } else {
+      // User opt-out: use the original algorithm
+      double            slideDP[2];
+      collision         = detectCollision(pos, dp, table, 0, slideDP);
+      addTo(2, pos, slideDP);
+    }
+
+    copyTo(2, outDP, pos);
+    addTo(2, outDP, inPos, -1);
+    return collision;
+  }
+
+
+  //=============================================================================
+  //  Oriented footprint
+  //=============================================================================
+
+  static const int    MAX_FOOTPRINT_STEPS   = 16;
+
+  inline double pointSegmentDistance2(const double* p, const double* a, const double* b)
+  {
+    const double        ab[]          = { b[0] - a[0], b[1] - a[1] };
+    const double        ap[]          = { p[0] - a[0], p[1] - a[1] };
+    const double        length2       = dot(2, ab, ab);
+    const double        t             = length2 > 0 ? std::max(0.0, std::min(1.0, dot(2, ap, ab) / length2)) : 0;
+    return sqr(ap[0] - t*ab[0]) + sqr(ap[1] - t*ab[1]);
+  }
+
+  /// Squared distance between the segments p0-p1 and q0-q1
+  inline double segmentDistance2(const double* p0, const double* p1, const double* q0, const double* q1)
+  {
+    const double        dp[]          = { p1[0] - p0[0], p1[1] - p0[1] };
+    const double        dq[]          = { q1[0] - q0[0], q1[1] - q0[1] };
+    const double        pq[]          = { q0[0] - p0[0], q0[1] - p0[1] };
+    const double        det           = dp[0] * dq[1] - dp[1] * dq[0];
+    if (det != 0) {
+      const double      t             = ( pq[0] * dq[1] - pq[1] * dq[0] ) / det;
+      const double      s             = ( pq[0] * dp[1] - pq[1] * dp[0] ) / det;
+      if (isInSegment(t) && isInSegment(s))
+        return 0;
+    }
+    return std::min( std::min(pointSegmentDistance2(p0, q0, q1), pointSegmentDistance2(p1, q0, q1))
+                   , std::min(pointSegmentDistance2(q0, p0, p1), pointSegmentDistance2(q1, p0, p1))
+                   );
+  }
+
+  /// Half of the axis of the footprint, which points along the heading as in the movement functions
+  inline void footprintAxis(double heading, double halfLength, double* axis)
+  {
+    axis[0]             = -halfLength * sin(heading);
+    axis[1]             =  halfLength * cos(heading);
+  }
+
+  /// Whether the axis of a footprint centered at pos is within the radius of the wall
+  inline bool overlaps(const Wall& wall, const double* pos, const double* axis)
+  {
+    const double        end1[]        = { pos[0] - axis[0], pos[1] - axis[1] };
+    const double        end2[]        = { pos[0] + axis[0], pos[1] + axis[1] };
+    return segmentDistance2(end1, end2, wall.endpoints, wall.endpoints + 2) < wall.radius2;
+  }
+
+  /// Wall translated by offset
+  inline Wall shiftedWall(const Wall& wall, const double* offset)
+  {
+    Wall                shifted       = wall;
+    for (int iCol = 0; iCol < 4; ++iCol) {
+      shifted.border[0][iCol]        += offset[iCol % 2];
+      shifted.border[1][iCol]        += offset[iCol % 2];
+      shifted.endpoints[iCol]        += offset[iCol % 2];
+    }
+    return shifted;
+  }
+
+  /// Wall from endpoint - axis to endpoint + axis, with borders as computed by loadVirmenWorld
+  inline Wall capWall(const double* endpoint, const double* axis, double radius2)
+  {
+    Wall                cap;
+    cap.endpoints[0]    = endpoint[0] - axis[0];
+    cap.endpoints[1]    = endpoint[1] - axis[1];
+    cap.endpoints[2]    = endpoint[0] + axis[0];
+    cap.endpoints[3]    = endpoint[1] + axis[1];
+    cap.radius2         = radius2;
+    cap.angle           = atan2(axis[1], axis[0]);
+
+    const double        radius        = sqrt(radius2);
+    const double        normal[]      = { radius * cos(cap.angle + 1.5707963267949), radius * sin(cap.angle + 1.5707963267949) };
+    for (int iCol = 0; iCol < 4; ++iCol) {
+      cap.border[0][iCol] = cap.endpoints[iCol] + normal[iCol % 2];
+      cap.border[1][iCol] = cap.endpoints[iCol] - normal[iCol % 2];
+    }
+    return cap;
+  }
+
+  /**
+    Walls that the center of a footprint with the given axis cannot cross. The axis swept along
+    a wall is a parallelogram with the wall translated by +/- axis and the axis at both of its
+    endpoints as sides; since the footprint is within the radius of the wall if and only if its
+    center is within that radius of the parallelogram, the point algorithm applies to these four
+    sides inflated by the radius of the wall.
+  */
+  inline void footprintWalls(const Wall* wall, const std::vector<int>& walls, const double* axis, std::vector<Wall>& sides)
+  {
+    const double        negAxis[]     = { -axis[0], -axis[1] };
+    sides.resize(4 * walls.size());
+    for (size_t iCand = 0; iCand < walls.size(); ++iCand) {
+      const Wall&       original      = wall[walls[iCand]];
+      sides[4*iCand    ] = shiftedWall(original, axis);
+      sides[4*iCand + 1] = shiftedWall(original, negAxis);
+      sides[4*iCand + 2] = capWall(original.endpoints    , axis, original.radius2);
+      sides[4*iCand + 3] = capWall(original.endpoints + 2, axis, original.radius2);
+    }
+  }
+
+
+  /**
+    Resolves translation and rotation of a footprint that is a capsule: the segment of length
+    2*halfLength centered at pos along the heading, inflated by the radius of each wall. inPos
+    and inDP are [x y z heading], of which z is left as is. The motion is split into up to
+    MAX_FOOTPRINT_STEPS steps so that the ends of the footprint move by less than the smallest
+    wall radius at each step; a step rotates the footprint unless that brings it within the
+    radius of a wall that it was not already close to, then translates it with the point
+    algorithm against the sides swept by its axis along the candidate walls. Without rotation
+    the whole displacement is resolved at once, and without length this is the point algorithm.
+  */
+  inline bool resolveFootprint( const double*       inPos
+                              , const double*       inDP
+                              , const WallTable&    table
+                              , const double        dpResolution
+                              , const double        halfLength
+                              ,       double*       outDP
+                              )
+  {
+    outDP[2]            = inDP[2];
+    outDP[3]            = inDP[3];
+    if (!(halfLength > 0))
+      return resolveCollisions(inPos, inDP, table, dpResolution, outDP);
+
+    // Walls near the motion of any part of the footprint, and the sides that they sweep
+    static thread_local std::vector<int>  candidates;
+    static thread_local std::vector<Wall> sides;
+    static thread_local std::vector<int>  allSides;
+    const std::vector<int>& walls         = table.broad_phase().candidates(inPos, inDP, candidates, halfLength);
+    const Wall*         wall          = table.data();
+    allSides.resize(4 * walls.size());
+    for (size_t iSide = 0; iSide < allSides.size(); ++iSide)
+      allSides[iSide]   = static_cast<int>(iSide);
+
+    double              axis[2];
+    footprintAxis(inPos[3], halfLength, axis);
+    const double        turn          = inDP[3];
+    if (turn == 0) {
+      footprintWalls(wall, walls, axis, sides);
+      return resolveCollisions(inPos, inDP, WallList(sides.empty() ? 0 : &sides[0], allSides), dpResolution, outDP);
+    }
+
+    double              minRadius2    = HUGE_VAL;
+    for (size_t iCand = 0; iCand < walls.size(); ++iCand)
+      if (wall[walls[iCand]].radius2 > 0)
+        minRadius2      = std::min(minRadius2, wall[walls[iCand]].radius2);
+    const double        arc           = halfLength * fabs(turn) / sqrt(minRadius2);
+    const int           numSteps      = static_cast<int>( std::min<double>(MAX_FOOTPRINT_STEPS, std::max(1.0, ceil(arc))) );
+
+    double              pos[]         = { inPos[0], inPos[1] };
+    double              heading       = inPos[3];
+    const double        stepDP[]      = { inDP[0] / numSteps, inDP[1] / numSteps };
+    bool                collision     = false;
+    for (int iStep = 0; iStep < numSteps; ++iStep) {
+      // Rotation, unless blocked by a wall
+      double            turned[2];
+      footprintAxis(heading + turn / numSteps, halfLength, turned);
+      bool              isBlocked     = false;
+      for (size_t iCand = 0; iCand < walls.size() && !isBlocked; ++iCand)
+        isBlocked       = overlaps(wall[walls[iCand]], pos, turned) && !overlaps(wall[walls[iCand]], pos, axis);
+      if (isBlocked)
+        collision       = true;
+      else {
+        heading        += turn / numSteps;
+        copyTo(2, axis, turned);
+      }
+
+      // Translation against the sides swept by the axis
+      footprintWalls(wall, walls, axis, sides);
+      double            slideDP[2];
+      collision        |= resolveCollisions(pos, stepDP, WallList(sides.empty() ? 0 : &sides[0], allSides), dpResolution, slideDP);
+      addTo(2, pos, slideDP);
+    }
+
+    outDP[0]            = pos[0] - inPos[0];
+    outDP[1]            = pos[1] - inPos[1];
+    outDP[3]            = heading - inPos[3];
+    return collision;
+  }
+
+
+  //=============================================================================
+  //  Batches of agents
+  //=============================================================================
+
+  /**
+    Resolves agents first to last of a batch, with positions and displacements stored as rows of
+    numAgents x numColumns matrices: 2 for points, 4 ([x y z heading]) for footprints of the
+    given halfLength. Workers do not call into Matlab.
+  */
+  inline void resolveBatch ( const size_t        first
+                           , const size_t        last
+                           , const size_t        numAgents
+                           , const size_t        numColumns
+                           , const double*       inPos
+                           , const double*       inDP
+                           , const WallTable&    table
+                           , const double        dpResolution
+                           , const double        halfLength
+                           ,       double*       outDP
+                           ,       bool*         collision
+                           )
+  {
+    for (size_t iAgent = first; iAgent < last; ++iAgent) {
+      double            pos[4], dp[4], slideDP[4];
+      for (size_t iCol = 0; iCol < numColumns; ++iCol) {
+        pos[iCol]       = inPos[iAgent + iCol*numAgents];
+        dp [iCol]       = inDP [iAgent + iCol*numAgents];
+      }
+      if (numColumns > 2)
+        collision[iAgent] = resolveFootprint(pos, dp, table, dpResolution, halfLength, slideDP);
+      else
+        collision[iAgent] = resolveCollisions(pos, dp, table, dpResolution, slideDP);
+      for (size_t iCol = 0; iCol < numColumns; ++iCol)
+        outDP[iAgent + iCol*numAgents] = slideDP[iCol];
+    }
+  }
+
+
+  /**
+    Resolves a batch of agents, split over threads if there are enough of them.
+  */
+  inline void resolveAgents ( const size_t        numAgents
+                            , const size_t        numColumns
+                            , const double*       inPos
+                            , const double*       inDP
+                            , const WallTable&    table
+                            , const double        dpResolution
+                            , const double        halfLength
+                            ,       double*       outDP
+                            ,       bool*         collision
+                            )
+  {
+    const size_t        available     = std::max(1u, std::thread::hardware_concurrency());
+    const size_t        numThreads    = std::max<size_t>(1, std::min(numAgents / MIN_AGENTS_PER_THREAD, std::min<size_t>(available, MAX_THREADS)));
+    const size_t        chunk         = (numAgents + numThreads - 1) / numThreads;
+    std::vector<std::thread>          workers;
+    for (size_t first = chunk; first < numAgents; first += chunk)
+      workers.push_back(std::thread( resolveBatch, first, std::min(first + chunk, numAgents), numAgents, numColumns, inPos, inDP
+                                   , std::cref(table), dpResolution, halfLength, outDP, collision
+                                   ));
+    resolveBatch(0, std::min(chunk, numAgents), numAgents, numColumns, inPos, inDP, table, dpResolution, halfLength, outDP, collision);
+    for (size_t iWorker = 0; iWorker < workers.size(); ++iWorker)
+      workers[iWorker].join();
+  }
+
+
+}
+
+
+#endif //VIRMENCOLLISIONS_H
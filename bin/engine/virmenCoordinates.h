@@ -0,0 +1,175 @@
+#ifndef VIRMENCOORDINATES_H
+#define VIRMENCOORDINATES_H
+
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <algorithm>
+#include <mex.h>
+#include "virmenSIMD.h"
+
+
+/**
+  Translates vertices (3 x N, column-major) to be relative to the animal position, computes
+  their distance from it and rotates them by the negative of the animal heading, all in a
+  single pass. The output can be double or single precision, the latter for data that is
+  uploaded as GLfloat anyway. The AVX2 kernel is selected at runtime and performs the same
+  operations in the same order as the scalar one, so that results are identical; large worlds
+  are split across threads.
+*/
+namespace coordinates {
+
+  static const mwSize         MIN_VERTICES_PER_THREAD       = 32768;
+  static const unsigned       MAX_THREADS                   = 8;
+
+
+  template<typename Output>
+  static void relative_scalar( const double* coord3, Output* coord3new, Output* distance
+                             , mwSize first, mwSize last, const double* pos, double c, double s
+                             )
+  {
+    const bool                rotate        = pos[3] != 0;
+    for (mwSize index = first; index < last; ++index) {
+      const double            x             = coord3[3*index]   - pos[0];
+      const double            y             = coord3[3*index+1] - pos[1];
+      const double            z             = coord3[3*index+2] - pos[2];
+      distance[index]         = static_cast<Output>( sqrt(x*x + y*y + z*z) );
+      if (rotate) {
+        coord3new[3*index]    = static_cast<Output>( c*x - s*y );
+        coord3new[3*index+1]  = static_cast<Output>( s*x + c*y );
+      } else {
+        coord3new[3*index]    = static_cast<Output>( x );
+        coord3new[3*index+1]  = static_cast<Output>( y );
+      }
+      coord3new[3*index+2]    = static_cast<Output>( z );
+    }
+  }
+
+
+#ifdef VIRMEN_AVX2
+
+  VIRMEN_TARGET_AVX2 static inline void store4(double* target, __m256d value)   { _mm256_storeu_pd(target, value); }
+  VIRMEN_TARGET_AVX2 static inline void store4(float* target, __m256d value)    { _mm_storeu_ps(target, _mm256_cvtpd_ps(value)); }
+
+  /**
+    Processes 4 vertices per iteration. The 12 interleaved coordinates are loaded as
+    a = [x0 y0 z0 x1], b = [y1 z1 x2 y2], d = [z2 x3 y3 z3] and transposed with in-lane shuffles;
+    the inverse is applied to store the result.
+  */
+  template<typename Output>
+  VIRMEN_TARGET_AVX2 static void relative_avx2( const double* coord3, Output* coord3new, Output* distance
+                                              , mwSize first, mwSize last, const double* pos, double c, double s
+                                              )
+  {
+    const bool                rotate        = pos[3] != 0;
+    const __m256d             px            = _mm256_set1_pd(pos[0]);
+    const __m256d             py            = _mm256_set1_pd(pos[1]);
+    const __m256d             pz            = _mm256_set1_pd(pos[2]);
+    const __m256d             vc            = _mm256_set1_pd(c);
+    const __m256d             vs            = _mm256_set1_pd(s);
+
+    mwSize                    index         = first;
+    for (; index + 4 <= last; index += 4) {
+      const double*           in            = coord3 + 3*index;
+      const __m256d           a             = _mm256_loadu_pd(in);
+      const __m256d           b             = _mm256_loadu_pd(in + 4);
+      const __m256d           d             = _mm256_loadu_pd(in + 8);
+      const __m256d           m2            = _mm256_permute2f128_pd(b, d, 0x21);   // x2 y2 z2 x3
+      const __m256d           xy02          = _mm256_permute2f128_pd(a, m2, 0x20);  // x0 y0 x2 y2
+      const __m256d           zx13          = _mm256_permute2f128_pd(a, m2, 0x31);  // z0 x1 z2 x3
+      const __m256d           yz13          = _mm256_permute2f128_pd(b, d, 0x30);   // y1 z1 y3 z3
+
+      const __m256d           x             = _mm256_sub_pd(_mm256_blend_pd(xy02, zx13, 0xA), px);
+      const __m256d           y             = _mm256_sub_pd(_mm256_shuffle_pd(xy02, yz13, 0x5), py);
+      const __m256d           z             = _mm256_sub_pd(_mm256_blend_pd(zx13, yz13, 0xA), pz);
+      const __m256d           dist          = _mm256_sqrt_pd(_mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(x, x), _mm256_mul_pd(y, y)), _mm256_mul_pd(z, z)));
+
+      __m256d                 xr            = x;
+      __m256d                 yr            = y;
+      if (rotate) {
+        xr                    = _mm256_sub_pd(_mm256_mul_pd(vc, x), _mm256_mul_pd(vs, y));
+        yr                    = _mm256_add_pd(_mm256_mul_pd(vs, x), _mm256_mul_pd(vc, y));
+      }
+
+      const __m256d           oxy02         = _mm256_shuffle_pd(xr, yr, 0x0);       // x0 y0 x2 y2
+      const __m256d           ozx13         = _mm256_shuffle_pd(z, xr, 0xA);        // z0 x1 z2 x3
+      const __m256d           oyz13         = _mm256_shuffle_pd(yr, z, 0xF);        // y1 z1 y3 z3
+      Output*                 out           = coord3new + 3*index;
+      store4(out    , _mm256_permute2f128_pd(oxy02, ozx13, 0x20));                    // x0 y0 z0 x1
+      store4(out + 4, _mm256_permute2f128_pd(oyz13, oxy02, 0x30));                    // y1 z1 x2 y2
+      store4(out + 8, _mm256_permute2f128_pd(ozx13, oyz13, 0x31));                    // z2 x3 y3 z3
+      store4(distance + index, dist);
+    }
+
+    relative_scalar(coord3, coord3new, distance, index, last, pos, c, s);
+  }
+
+#endif //VIRMEN_AVX2
+
+
+  template<typename Output>
+  static void relative_range( const double* coord3, Output* coord3new, Output* distance
+                            , mwSize first, mwSize last, const double* pos, double c, double s
+                            )
+  {
+#ifdef VIRMEN_AVX2
+    static const bool         useAVX2       = has_avx2();
+    if (useAVX2) {
+      relative_avx2(coord3, coord3new, distance, first, last, pos, c, s);
+      return;
+    }
+#endif
+    relative_scalar(coord3, coord3new, distance, first, last, pos, c, s);
+  }
+
+
+  /**
+    Number of threads to use for the given number of vertices if numThreads is 0, otherwise
+    numThreads itself.
+  */
+  static unsigned thread_count(mwSize numVertices, unsigned numThreads = 0)
+  {
+    if (numThreads > 0)
+      return numThreads;
+    const mwSize              maxUseful     = numVertices / MIN_VERTICES_PER_THREAD;
+    const unsigned            available     = std::max(1u, std::thread::hardware_concurrency());
+    return static_cast<unsigned>( std::max<mwSize>(1, std::min<mwSize>(maxUseful, std::min(available, MAX_THREADS))) );
+  }
+
+
+  /**
+    Fills coord3new (3 x numVertices) and distance (numVertices) from the vertices coord3 and
+    the animal position pos = [x y z heading]. If numThreads is 0, the vertices are split over
+    threads only if there are enough of them to make up for the cost of starting threads.
+    Workers do not call into Matlab.
+  */
+  template<typename Output>
+  static void relative( const double* coord3, Output* coord3new, Output* distance
+                      , mwSize numVertices, const double* pos, unsigned numThreads = 0
+                      )
+  {
+    const double              c             = cos(-pos[3]);
+    const double              s             = sin(-pos[3]);
+    const unsigned            nThreads      = thread_count(numVertices, numThreads);
+    if (nThreads < 2) {
+      relative_range(coord3, coord3new, distance, 0, numVertices, pos, c, s);
+      return;
+    }
+
+    // Chunks are multiples of 4 vertices so that only the last one has a scalar tail
+    const mwSize              chunk         = ( (numVertices + nThreads - 1) / nThreads + 3 ) / 4 * 4;
+    std::vector<std::thread>  workers;
+    workers.reserve(nThreads - 1);
+    for (mwSize first = chunk; first < numVertices; first += chunk)
+      workers.push_back(std::thread( relative_range<Output>, coord3, coord3new, distance
+                                   , first, std::min(first + chunk, numVertices), pos, c, s
+                                   ));
+    relative_range(coord3, coord3new, distance, 0, std::min(chunk, numVertices), pos, c, s);
+    for (size_t iWorker = 0; iWorker < workers.size(); ++iWorker)
+      workers[iWorker].join();
+  }
+
+}
+
+
+#endif //VIRMENCOORDINATES_H
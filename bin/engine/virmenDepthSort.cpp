@@ -0,0 +1,60 @@
+#include <mex.h>
+#include <stdint.h>
+#include "virmenDepthSort.h"
+
+
+/**
+  [triangles, order] = virmenDepthSort(distance, triangulation, geometry)
+
+  Returns the triangulation (3 x N int32 or uint32) reordered from back to front, i.e. by
+  decreasing distance of the nearest vertex of each triangle, and optionally the (1-based) order
+  itself, e.g. to reorder per-triangle visibility flags. If geometry (e.g. the world index) is
+  the same as in the previous call, the previous order is used as a starting point.
+*/
+
+static DepthSort      depthSort;
+
+
+template<typename Index>
+static void sort_triangles(int nlhs, mxArray* plhs[], const mxArray* distance, const mxArray* triangulation, int geometry)
+{
+  const mwSize        numTriangles    = mxGetN(triangulation);
+  const mwSize        numVertices     = mxGetNumberOfElements(distance);
+  const Index*        tria            = static_cast<const Index*>(mxGetData(triangulation));
+  for (mwSize index = 0; index < 3*numTriangles; ++index)
+    if (static_cast<mwSize>(tria[index]) >= numVertices)
+      mexErrMsgIdAndTxt("virmenDepthSort:triangulation", "Vertex index %d exceeds the number of distances (%d).", static_cast<int>(tria[index]), static_cast<int>(numVertices));
+
+  const std::vector<uint32_t>&  order = depthSort.sort(mxGetPr(distance), tria, numTriangles, geometry);
+
+  plhs[0]             = mxCreateNumericMatrix(3, numTriangles, mxGetClassID(triangulation), mxREAL);
+  Index*              sorted          = static_cast<Index*>(mxGetData(plhs[0]));
+  for (mwSize index = 0; index < numTriangles; ++index, sorted += 3) {
+    const Index*      source          = tria + 3*order[index];
+    sorted[0]         = source[0];
+    sorted[1]         = source[1];
+    sorted[2]         = source[2];
+  }
+
+  if (nlhs > 1) {
+    plhs[1]           = mxCreateDoubleMatrix(1, numTriangles, mxREAL);
+    double*           ord             = mxGetPr(plhs[1]);
+    for (mwSize index = 0; index < numTriangles; ++index)
+      ord[index]      = order[index] + 1.0;
+  }
+}
+
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  if (nrhs < 2 || !mxIsDouble(prhs[0]) || mxGetM(prhs[1]) != 3)
+    mexErrMsgIdAndTxt("virmenDepthSort:arguments", "Usage: virmenDepthSort(distance (double), triangulation (3 x N int32 or uint32), [geometry]).");
+  const int           geometry        = nrhs > 2 ? static_cast<int>(mxGetScalar(prhs[2])) : -1;
+
+  switch (mxGetClassID(prhs[1])) {
+  case mxINT32_CLASS:   sort_triangles<int32_t >(nlhs, plhs, prhs[0], prhs[1], geometry);  break;
+  case mxUINT32_CLASS:  sort_triangles<uint32_t>(nlhs, plhs, prhs[0], prhs[1], geometry);  break;
+  default:
+    mexErrMsgIdAndTxt("virmenDepthSort:arguments", "Triangulation must be of type int32 or uint32.");
+  }
+}
@@ -0,0 +1,159 @@
+#ifndef VIRMENDEPTHSORT_H
+#define VIRMENDEPTHSORT_H
+
+#include <vector>
+#include <cstring>
+#include <stdint.h>
+
+
+/**
+  Distance of the nearest vertex of a triangle, the depth by which triangles are ordered.
+*/
+template<typename Index>
+inline double nearest_vertex(const double* distance, const Index* tria)
+{
+  double                      nearest       = distance[tria[0]];
+  if (distance[tria[1]] < nearest)            nearest = distance[tria[1]];
+  if (distance[tria[2]] < nearest)            nearest = distance[tria[2]];
+  return nearest;
+}
+
+
+/**
+  Back-to-front order of triangles by the distance of their nearest vertex, for transparent
+  worlds. Depths are reduced to 32-bit float keys and sorted with an LSD radix sort (8 bits per
+  pass, skipping passes in which all keys share the same digit). Since the animal moves little
+  between frames, the previous order of the same geometry is first re-sorted with an insertion
+  pass, which is linear if only a few triangles changed places; a full radix sort is performed
+  only if the number of moves exceeds a small multiple of the number of triangles.
+
+  Both sorts are stable. Triangles with equal keys are listed by increasing index after a radix
+  sort, as for sort(..., 'descend') in Matlab, but keep their previous relative order after an
+  insertion pass.
+*/
+class DepthSort
+{
+protected:
+  std::vector<uint32_t>       keys;                           // per triangle, ascending for back-to-front
+  std::vector<uint32_t>       order;
+  std::vector<uint32_t>       scratchKeys;                    // ping-pong buffers for the radix sort
+  std::vector<uint32_t>       sortedKeys;
+  std::vector<uint32_t>       scratchOrder;
+  int                         geometry;                       // identifies the triangulation of the previous order
+  size_t                      numInsertions;
+  size_t                      numRadixSorts;
+
+  static const size_t         MOVES_PER_TRIANGLE  = 4;
+
+
+public:
+  DepthSort() : geometry(-1), numInsertions(0), numRadixSorts(0) { }
+
+  const std::vector<uint32_t>&  result() const  { return order; }
+  size_t insertionSorts() const               { return numInsertions; }
+  size_t radixSorts() const                   { return numRadixSorts; }
+
+  /// Forgets the previous order, e.g. when the geometry has changed
+  void reset()                                { geometry = -1; }
+
+
+  /**
+    Orders the triangles (3 x numTriangles vertex indices) by decreasing distance of their
+    nearest vertex. Geometry identifies the triangulation (e.g. the world index); the previous
+    order is reused only if it is the same as in the previous call, and negative values
+    disable reuse.
+  */
+  template<typename Index>
+  const std::vector<uint32_t>& sort(const double* distance, const Index* triangulation, size_t numTriangles, int geometry)
+  {
+    keys.resize(numTriangles);
+    const Index*              tria          = triangulation;
+    for (size_t iTri = 0; iTri < numTriangles; ++iTri, tria += 3)
+      keys[iTri]              = ~float_key(static_cast<float>( nearest_vertex(distance, tria) ));
+
+    const bool                isCoherent    = geometry >= 0 && geometry == this->geometry && order.size() == numTriangles;
+    this->geometry            = geometry;
+    if (isCoherent && insertion_sort(MOVES_PER_TRIANGLE * numTriangles + 64))
+      ++numInsertions;
+    else {
+      radix_sort();
+      ++numRadixSorts;
+    }
+    return order;
+  }
+
+
+protected:
+  /// Maps floats to unsigned integers with the same ordering
+  static uint32_t float_key(float value)
+  {
+    uint32_t                  bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+  }
+
+  /**
+    Sorts the previous order by the current keys, giving up (with order still a permutation)
+    after the given number of moves.
+  */
+  bool insertion_sort(size_t maxMoves)
+  {
+    size_t                    numMoves      = 0;
+    for (size_t index = 1; index < order.size(); ++index) {
+      const uint32_t          iTri          = order[index];
+      const uint32_t          key           = keys[iTri];
+      size_t                  target        = index;
+      for (; target > 0 && keys[order[target-1]] > key; --target)
+        order[target]         = order[target-1];
+      order[target]           = iTri;
+
+      numMoves               += index - target;
+      if (numMoves > maxMoves)
+        return false;
+    }
+    return true;
+  }
+
+  void radix_sort()
+  {
+    const size_t              count         = keys.size();
+    order.resize(count);
+    scratchOrder.resize(count);
+    scratchKeys.assign(keys.begin(), keys.end());
+    sortedKeys.resize(count);
+    for (size_t iTri = 0; iTri < count; ++iTri)
+      order[iTri]             = static_cast<uint32_t>(iTri);
+
+    uint32_t*                 srcKey        = scratchKeys.empty() ? 0 : &scratchKeys[0];
+    uint32_t*                 srcOrder      = order.empty() ? 0 : &order[0];
+    uint32_t*                 dstKey        = sortedKeys.empty() ? 0 : &sortedKeys[0];
+    uint32_t*                 dstOrder      = scratchOrder.empty() ? 0 : &scratchOrder[0];
+    for (int shift = 0; shift < 32; shift += 8) {
+      size_t                  offset[256]   = {0};
+      for (size_t index = 0; index < count; ++index)
+        ++offset[(srcKey[index] >> shift) & 0xFF];
+      if (count == 0 || offset[(srcKey[0] >> shift) & 0xFF] == count)
+        continue;                                             // all keys have the same digit
+
+      size_t                  total         = 0;
+      for (int digit = 0; digit < 256; ++digit) {
+        const size_t          number        = offset[digit];
+        offset[digit]         = total;
+        total                += number;
+      }
+      for (size_t index = 0; index < count; ++index) {
+        const size_t          target        = offset[(srcKey[index] >> shift) & 0xFF]++;
+        dstKey[target]        = srcKey[index];
+        dstOrder[target]      = srcOrder[index];
+      }
+      std::swap(srcKey, dstKey);
+      std::swap(srcOrder, dstOrder);
+    }
+
+    if (count > 0 && srcOrder != &order[0])
+      std::memcpy(&order[0], srcOrder, count * sizeof(uint32_t));
+  }
+};
+
+
+#endif //VIRMENDEPTHSORT_H
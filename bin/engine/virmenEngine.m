@@ -36,6 +36,14 @@ function err = virmenEngine(exper)
 % possibility of those damages.
 % *************************************************************************
 
+% Compiled functions that the engine depends on, which are built by virmenMake
+engineMex = {'virmenOpenGLRoutines','virmenResolveCollisions','virmenProcessCoordinates' ...
+            ,'virmenVisibleTriangles','virmenDepthSort','virmenWorldGridQuery'};
+isCompiled = cellfun(@(name) exist(name,'file') == 3, engineMex);
+if ~all(isCompiled)
+    error('virmenEngine:mex', 'Missing compiled %s for this platform; run virmenMake first.', strjoin(engineMex(~isCompiled), ', '));
+end
+
 % Clean up in case of an incorrect exit (e.g. user terminated Virmen by stopping debug mode)
 drawnow;
 virmenOpenGLRoutines(2);
@@ -47,13 +55,25 @@ err = -1;
 vr.exper = exper;
 vr.code = exper.experimentCode(); %#ok<*STRNU>
 [letterGrid, letterFont, letterAspectRatio] = virmenLoadFont;
-[windows, transformations] = virmenLoadWindows(exper);
+% Render offscreen if requested, e.g. on machines without a display
+isHeadless = ~isempty(getenv('VIRMEN_HEADLESS'));
+[windows, transformations] = virmenLoadWindows(exper, isHeadless);
+% Frames that can be in flight on the GPU, trading latency for throughput
+numGraphicsBuffers = 3;
+if exist('RigParameters','class') && isprop(RigParameters,'graphicsBuffers')
+    numGraphicsBuffers = RigParameters.graphicsBuffers;
+end
+% Triangulated worlds are cached on disk, '' to always triangulate them
+worldCacheDir = fullfile(prefdir, 'virmenWorldCache');
+if exist('RigParameters','class') && isprop(RigParameters,'worldCacheDir')
+    worldCacheDir = RigParameters.worldCacheDir;
+end
 
 
 % Load worlds
 vr.worlds = struct([]);
 for wNum = 1:length(vr.exper.worlds)
-    vr.worlds{wNum} = loadVirmenWorld(vr.exper.worlds{wNum});
+    vr.worlds{wNum} = loadVirmenWorld(vr.exper.worlds{wNum},worldCacheDir);
     if size(vr.worlds{wNum}.surface.colors,1) == 4
         vr.worlds{wNum}.surface.colors(4,isnan(vr.worlds{wNum}.surface.colors(4,:))) = 1-eps;
     end
@@ -67,6 +87,18 @@ vr.velocity = [0 0 0 0];
 vr.dt = NaN;
 vr.dp = NaN(1,4);
 vr.dpResolution = inf;
+vr.framePipeline = false; % render from world coordinates with virmenOpenGLRoutines(7/16/17) instead of command 1
+vr.gpuProjection = false;
+vr.headless = isHeadless;
+vr.timedFrames = 0;     % number of most recent frames for which to record stage durations
+vr.fenceTimeout = 0.1;  % s to wait for the GPU at a time before counting a stall
+vr.skipStalledFrames = false;
+vr.renderQueueDepth = 0;  % frames that can be queued for a native render thread, 0 to render in the engine thread
+vr.presented = [];      % most recent frame presented by the render thread
+vr.drawDistance = inf;  % only process triangles within this distance of the animal
+vr.viewAngle = 2*pi;    % ... and within this angle (radians) centered on its heading
+vr.lodAngle = 0;        % draw coarser objects when the detail that they lose is seen under this angle (radians), 0 to disable
+vr.footprintLength = 0; % length of the animal along its heading for collisions, which also block turns; 0 for a point
 vr.collision = false;
 vr.text = struct('string',{},'position',{},'size',{},'color',{},'window',{});
 vr.plot = struct('x',{},'y',{},'color',{},'window',{});
@@ -78,6 +110,7 @@ vr.buttonReleased = NaN;
 vr.modifiers = NaN;
 vr.activeWindow = NaN;
 vr.cursorPosition = NaN;
+vr.inputEvents = zeros(0,5);
 vr.iterations = 0;
 vr.timeStarted = NaN;
 vr.timeElapsed = 0;
@@ -96,7 +129,7 @@ end
 
 % Initialize an OpenGL window
 drawnow;
-virmenOpenGLRoutines(0,windows,ismac);
+virmenOpenGLRoutines(0,windows,ismac,isHeadless,numGraphicsBuffers);
 
 % Run initialization code
 try
@@ -110,6 +143,43 @@ catch ME
     return
 end
 
+% Restricting geometry to the vicinity of the animal is done before the transformation in Matlab
+isSpatiallyCulled = isfinite(vr.drawDistance) || vr.viewAngle < 2*pi || vr.lodAngle > 0;
+if isSpatiallyCulled && vr.framePipeline
+    disp('Culling by vr.drawDistance, vr.viewAngle or vr.lodAngle requires vr.framePipeline = false, which is used instead.');
+    vr.framePipeline = false;
+end
+
+% Register all worlds with the graphics engine so that switching between them is cheap
+if vr.framePipeline
+    for wNum = 1:length(vr.worlds)
+        virmenOpenGLRoutines(6,wNum,vr.worlds{wNum}.surface.vertices,vr.worlds{wNum}.surface.triangulation ...
+                            ,vr.worlds{wNum}.surface.colors);
+        vr.worlds{wNum}.changed = false;
+    end
+end
+if vr.framePipeline && vr.gpuProjection
+    vr.gpuProjection = virmenShaderProjection(vr.exper.transformationFunction);
+end
+
+% Walls are kept by the collision detection, and registered again when a world is changed
+for wNum = 1:length(vr.worlds)
+    registerWalls(vr.worlds{wNum}, wNum);
+end
+
+% Allocate storage for frame timing, if requested in the initialization code
+virmenOpenGLRoutines(14,vr.timedFrames);
+virmenOpenGLRoutines(15,vr.fenceTimeout,vr.skipStalledFrames);
+isTimed = vr.timedFrames > 0;
+
+% Hand presentation over to a native thread, if requested in the initialization code
+if vr.renderQueueDepth > 0 && (~vr.framePipeline || vr.gpuProjection)
+    disp('Threaded rendering requires the frame pipeline with projections on the CPU, rendering in the engine thread instead.');
+    vr.renderQueueDepth = 0;
+end
+virmenOpenGLRoutines(17,vr.renderQueueDepth);
+stageTimes = zeros(1,7);  % movement, collisions, runtime, coordinates, transformation, culling, sort
+
 % Initialize engine
 oldWorld = NaN;
 oldBackgroundColor = [NaN NaN NaN];
@@ -147,6 +217,7 @@ while ~vr.experimentEnded
 
     
     % Input movement information
+    stageTic = tic;
     try
         if numMovementOutputs == 2
             [vr.velocity, vr.sensorData] = vr.exper.movementFunction(vr);
@@ -164,19 +235,28 @@ while ~vr.experimentEnded
         return
     end
 
+    stageTimes(1) = toc(stageTic);
+
     % Calculate displacement
+    stageTic = tic;
     vr.dp = vr.velocity*vr.dt;
     
     % Detect collisions with edges (continuous-time collision detection)
-    [vr.dp(1:2), vr.collision] = virmenResolveCollisions(vr.position(1:2),vr.dp(1:2), ...
-        vr.worlds{vr.currentWorld}.walls.endpoints,vr.worlds{vr.currentWorld}.walls.radius2, ...
-        vr.worlds{vr.currentWorld}.walls.angle,vr.worlds{vr.currentWorld}.walls.border1, ...
-        vr.worlds{vr.currentWorld}.walls.border2,vr.dpResolution);
+    if vr.worlds{vr.currentWorld}.changed
+        registerWalls(vr.worlds{vr.currentWorld}, vr.currentWorld);
+    end
+    if vr.footprintLength > 0
+        [vr.dp, vr.collision] = virmenResolveCollisions(vr.position,vr.dp,vr.currentWorld,vr.dpResolution,vr.footprintLength/2);
+    else
+        [vr.dp(1:2), vr.collision] = virmenResolveCollisions(vr.position(1:2),vr.dp(1:2),vr.currentWorld,vr.dpResolution);
+    end
     
     % Update position
     vr.position = vr.position + vr.dp;
+    stageTimes(2) = toc(stageTic);
 
     % Run custom code on each engine iteration
+    stageTic = tic;
     try
         vr = vr.code.runtime(vr);
     catch ME
@@ -187,6 +267,7 @@ while ~vr.experimentEnded
         err.stack = ME.stack(1:end-1);
         return
     end
+    stageTimes(3) = toc(stageTic);
     
     % Reset user input states (keyboard and mouse)
     vr.textClicked = NaN;
@@ -197,42 +278,108 @@ while ~vr.experimentEnded
     vr.modifiers = NaN;
     vr.activeWindow = NaN;
     
-    % Translate+rotate coordinates and calculate distances from animal
-    [vertexArray, distance] = virmenProcessCoordinates(vr.worlds{oldWorld}.surface.vertices,vr.position);
+    % Objects marked by virmenObjectsChanged
+    worldDirty = vr.worlds{oldWorld}.dirty;
+    isDirty = ~isempty(worldDirty.vertices) || ~isempty(worldDirty.colors) || ~isempty(worldDirty.visible);
     
-    % Transform 3D coordinates to 2D screen coordinates
-    try
-      if numTransformInputs == 2
-        vertexArrayTransformed = vr.exper.transformationFunction(vertexArray, vr);
-      else
-        vertexArrayTransformed = vr.exper.transformationFunction(vertexArray);
-      end
-    catch ME
-        drawnow;
-        virmenOpenGLRoutines(2);
-        err = struct;
-        err.message = ME.message;
-        err.stack = ME.stack(1:end-1);
-        return
-    end
+    % The frame pipeline performs all geometry processing within the render call
+    if vr.framePipeline
+        if vr.worlds{oldWorld}.changed
+            drawnow;
+            virmenOpenGLRoutines(6,oldWorld,vr.worlds{oldWorld}.surface.vertices,vr.worlds{oldWorld}.surface.triangulation ...
+                                ,vr.worlds{oldWorld}.surface.colors);
+        elseif isDirty
+            % Only the parts of the world that belong to these objects are uploaded
+            virmenOpenGLRoutines(19,oldWorld,vr.worlds{oldWorld}.surface.vertices,vr.worlds{oldWorld}.surface.colors ...
+                                ,vr.worlds{oldWorld}.surface.visible,vr.worlds{oldWorld}.objects.vertices(worldDirty.vertices,:) ...
+                                ,vr.worlds{oldWorld}.objects.vertices(worldDirty.colors,:),vr.worlds{oldWorld}.objects.triangles(worldDirty.visible,:));
+        end
+        if numTransformInputs == 2
+            transformArg = vr;
+        else
+            transformArg = [];
+        end
+    else
+        % Only triangles near the animal (and in view) are processed, if so requested
+        stageTic = tic;
+        worldSurface = vr.worlds{oldWorld}.surface;
+        if isSpatiallyCulled
+            isMoved = vr.worlds{oldWorld}.changed || ~isempty(worldDirty.vertices);
+            if isMoved
+                vr.worlds{oldWorld}.grid = virmenWorldGrid(vr.worlds{oldWorld});
+            end
+            if vr.lodAngle > 0
+                % Levels of detail are built once first needed, then again only for objects that changed
+                if vr.worlds{oldWorld}.changed || ~isfield(vr.worlds{oldWorld}.lod, 'levelObject')
+                    vr.worlds{oldWorld}.lod = virmenWorldLOD(vr.worlds{oldWorld});
+                elseif ~isempty(worldDirty.vertices) || ~isempty(worldDirty.colors)
+                    vr.worlds{oldWorld}.lod = virmenWorldLOD(vr.worlds{oldWorld}, [], vr.worlds{oldWorld}.lod ...
+                                                            , unique([worldDirty.vertices; worldDirty.colors]));
+                end
+
+                % Distant objects are replaced by coarse versions, whose vertices follow those of the world
+                lod = vr.worlds{oldWorld}.lod;
+                [triangleIndex, vertexIndex, worldSurface.triangulation, ~, worldSurface.visible] = virmenWorldGridQuery(vr.worlds{oldWorld}.grid ...
+                                          ,worldSurface.triangulation,vr.position,vr.drawDistance,vr.viewAngle,worldSurface.visible,lod,vr.lodAngle);
+                numFull = sum(vertexIndex <= size(worldSurface.vertices,2));
+                coarseIndex = vertexIndex(numFull+1:end) - size(worldSurface.vertices,2);
+                worldSurface.vertices = [worldSurface.vertices(:,vertexIndex(1:numFull)), lod.vertices(:,coarseIndex)];
+                worldSurface.colors = [worldSurface.colors(:,vertexIndex(1:numFull)), lod.colors(:,coarseIndex)];
+            else
+                [triangleIndex, vertexIndex, worldSurface.triangulation] = virmenWorldGridQuery(vr.worlds{oldWorld}.grid ...
+                                          ,worldSurface.triangulation,vr.position,vr.drawDistance,vr.viewAngle);
+                worldSurface.vertices = worldSurface.vertices(:,vertexIndex);
+                worldSurface.colors = worldSurface.colors(:,vertexIndex);
+                worldSurface.visible = worldSurface.visible(triangleIndex);
+            end
+        end
     
-    % Number of transformations returned by the user's function
-    nDim = size(vertexArrayTransformed,3);
+        % Translate+rotate coordinates and calculate distances from animal
+        [vertexArray, distance] = virmenProcessCoordinates(worldSurface.vertices,vr.position);
+        stageTimes(4) = toc(stageTic);
     
-    % Extract triangles visible in each transformation
-    triangles = virmenVisibleTriangles(vr.worlds{oldWorld}.surface.triangulation,vertexArrayTransformed ...
-                                      ,nDim,size(vertexArrayTransformed,2),vr.worlds{oldWorld}.surface.visible);
+        % Transform 3D coordinates to 2D screen coordinates
+        stageTic = tic;
+        try
+          if numTransformInputs == 2
+            vertexArrayTransformed = vr.exper.transformationFunction(vertexArray, vr);
+          else
+            vertexArrayTransformed = vr.exper.transformationFunction(vertexArray);
+          end
+        catch ME
+            drawnow;
+            virmenOpenGLRoutines(2);
+            err = struct;
+            err.message = ME.message;
+            err.stack = ME.stack(1:end-1);
+            return
+        end
     
-    % Assign distances as the z coordinate
-    for d = 1:nDim
-        vertexArrayTransformed(3,:,d) = distance;
-    end
+        stageTimes(5) = toc(stageTic);
+        
+        % Number of transformations returned by the user's function
+        nDim = size(vertexArrayTransformed,3);
+    
+        % Order triangles from back to front (only when transparency is on), starting from the
+        % order of the previous frame
+        stageTic = tic;
+        if size(vr.worlds{vr.currentWorld}.surface.colors,1)==4
+            [worldSurface.triangulation, ord] = virmenDepthSort(distance,worldSurface.triangulation,oldWorld);
+            worldSurface.visible = worldSurface.visible(ord);
+        end
+        stageTimes(7) = toc(stageTic);
+    
+        % Extract triangles visible in each transformation, compacted in drawing order
+        stageTic = tic;
+        [triangles, triangleCounts, firstTriangle] = virmenVisibleTriangles(worldSurface.triangulation ...
+                                          ,vertexArrayTransformed,nDim,size(vertexArrayTransformed,2),worldSurface.visible);
+    
+        % Assign distances as the z coordinate
+        for d = 1:nDim
+            vertexArrayTransformed(3,:,d) = distance;
+        end
+        stageTimes(6) = toc(stageTic);
     
-    % Sort triangles from back to front (only when transparency is on)
-    if size(vr.worlds{vr.currentWorld}.surface.colors,1)==4
-        ord = virmenTrianglesDistance(distance,vr.worlds{oldWorld}.surface.triangulation);
-        [~, ord] = sort(ord,'descend');
-        triangles = virmenOrderTriangles(triangles,size(triangles,2),nDim,ord);
     end
     
     % Set up textboxes and plots
@@ -271,78 +418,82 @@ while ~vr.experimentEnded
         end
     end
     
+    % Start the timing record of this frame; rendering stages are timed by virmenOpenGLRoutines
+    if isTimed
+        virmenOpenGLRoutines(13,vr.iterations,stageTimes);
+    end
+    
     % Render the environment
     drawnow;
-    vr.cursorPosition = zeros(size(windows,2),2);
-    for wind = 1:size(windows,2)
-        % Determine the total number of line segments to draw
-        tot = 0;
-        for ndx = 1:length(vr.text)
-            if vr.text(ndx).window == wind
-                for s = 1:length(vr.text(ndx).string)
-                    tot = tot+length(letterFont{double(vr.text(ndx).string(s))});
+    if vr.framePipeline
+        % All windows in a single call, sharing geometry and presented together
+        try
+            virmenFramePipeline(vr,oldWorld,transformations,transformArg);
+        catch ME
+            drawnow;
+            virmenOpenGLRoutines(2);
+            err = struct;
+            err.message = ME.message;
+            err.stack = ME.stack(1:end-1);
+            return
+        end
+    else
+        for wind = 1:size(windows,2)
+            % Determine the total number of line segments to draw
+            tot = 0;
+            for ndx = 1:length(vr.text)
+                if vr.text(ndx).window == wind
+                    for s = 1:length(vr.text(ndx).string)
+                        tot = tot+length(letterFont{double(vr.text(ndx).string(s))});
+                    end
                 end
             end
-        end
-        colors = zeros(6,tot);
-        coords = zeros(4,tot);
+            colors = zeros(6,tot);
+            coords = zeros(4,tot);
         
-        % Create arrays of coordinates and colors
-        cnt = 0;
-        for ndx = 1:length(vr.text)
-            if vr.text(ndx).window == wind
-                for s = 1:length(vr.text(ndx).string)
-                    virmenCreateLetters(coords,colors,cnt,letterGrid,letterFont{double(vr.text(ndx).string(s))},vr.text(ndx).size,vr.text(ndx).position,s,vr.text(ndx).color);
+            % Create arrays of coordinates and colors
+            cnt = 0;
+            for ndx = 1:length(vr.text)
+                if vr.text(ndx).window == wind
+                    for s = 1:length(vr.text(ndx).string)
+                        virmenCreateLetters(coords,colors,cnt,letterGrid,letterFont{double(vr.text(ndx).string(s))},vr.text(ndx).size,vr.text(ndx).position,s,vr.text(ndx).color);
+                    end
                 end
             end
-        end
         
-        % Attach plots to the arrays of coordinates and colors
-        for ndx = 1:length(vr.plot)
-            if vr.plot(ndx).window == wind
-                sz = size(coords,2);
-                coords(:,sz+1:sz+length(vr.plot(ndx).x)-1) = ...
-                    [vr.plot(ndx).x(1:end-1); vr.plot(ndx).y(1:end-1); vr.plot(ndx).x(2:end); vr.plot(ndx).y(2:end)];
-                colors([1 4],sz+1:sz+length(vr.plot(ndx).x)-1) = vr.plot(ndx).color(1);
-                colors([2 5],sz+1:sz+length(vr.plot(ndx).x)-1) = vr.plot(ndx).color(2);
-                colors([3 6],sz+1:sz+length(vr.plot(ndx).x)-1) = vr.plot(ndx).color(3);
+            % Attach plots to the arrays of coordinates and colors
+            for ndx = 1:length(vr.plot)
+                if vr.plot(ndx).window == wind
+                    sz = size(coords,2);
+                    coords(:,sz+1:sz+length(vr.plot(ndx).x)-1) = ...
+                        [vr.plot(ndx).x(1:end-1); vr.plot(ndx).y(1:end-1); vr.plot(ndx).x(2:end); vr.plot(ndx).y(2:end)];
+                    colors([1 4],sz+1:sz+length(vr.plot(ndx).x)-1) = vr.plot(ndx).color(1);
+                    colors([2 5],sz+1:sz+length(vr.plot(ndx).x)-1) = vr.plot(ndx).color(2);
+                    colors([3 6],sz+1:sz+length(vr.plot(ndx).x)-1) = vr.plot(ndx).color(3);
+                end
             end
-        end
         
-        % Create an array of indices
-        indices = 0:2*size(coords,2)-1;
+            % Create an array of indices
+            indices = 0:2*size(coords,2)-1;
         
-        % Render the environment
-        if ~isnan(transformations(wind)) && transformations(wind) <= nDim
-            [keyPressed, keyReleased, buttonPressed, buttonReleased, modifiers, activeWindow, vr.cursorPosition(wind,:)] = ...
-                virmenOpenGLRoutines(1,vertexArrayTransformed,triangles,vr.worlds{oldWorld}.surface.colors ...
+            % Render the environment
+            if ~isnan(transformations(wind)) && transformations(wind) <= nDim
+                virmenOpenGLRoutines(1,vertexArrayTransformed,triangles,worldSurface.colors ...
                                     ,coords,int32(indices),colors,wind,transformations(wind) ...
-                                    ,3*size(vertexArrayTransformed,2),3*size(triangles,2) ...
-                                    ,vr.worlds{oldWorld}.changed);
-        else
-            [keyPressed, keyReleased, buttonPressed, buttonReleased, modifiers, activeWindow, vr.cursorPosition(wind,:)] = ...
+                                    ,3*size(vertexArrayTransformed,2),3*triangleCounts(transformations(wind)) ...
+                                    ,vr.worlds{oldWorld}.changed,3*firstTriangle(transformations(wind)) ...
+                                    ,[size(vr.worlds{oldWorld}.surface.triangulation,2) size(vr.worlds{oldWorld}.surface.vertices,2)]);
+            else
                 virmenOpenGLRoutines(1,[],[],[],coords,int32(indices),colors,wind,0,0,0,false);
+            end
         end
-        
-        % Process user inputs (keyboard and mouse)
-        if keyPressed >= 0
-            vr.keyPressed = keyPressed;
-        end
-        if keyReleased >= 0
-            vr.keyReleased = keyReleased;
-        end
-        if buttonPressed >= 0
-            vr.buttonPressed = buttonPressed;
-        end
-        if buttonReleased >= 0
-            vr.buttonReleased = buttonReleased;
-        end
-        if modifiers >= 0
-            vr.modifiers = modifiers;
-        end
-        if activeWindow >= 0
-            vr.activeWindow = activeWindow+1;
-        end
+    end
+    
+    % Process user inputs (keyboard and mouse), all events since the last frame
+    [events, vr.cursorPosition, presented] = virmenOpenGLRoutines(18);
+    vr = virmenUserInput(vr, events);
+    if ~isempty(presented)
+        vr.presented = presented(end);
     end
     
     % Use the end of buffer swap to evaluate frame duration
@@ -351,7 +502,13 @@ while ~vr.experimentEnded
     vr.timeElapsed = timeElapsed;
         
     % Mark changes to world geometry as resolved, to cache graphics
+    if vr.worlds{oldWorld}.changed
+        registerWalls(vr.worlds{oldWorld}, oldWorld);
+    end
     vr.worlds{oldWorld}.changed = false;
+    if isDirty
+        vr.worlds{oldWorld}.dirty = struct('vertices',zeros(0,1),'colors',zeros(0,1),'visible',zeros(0,1));
+    end
 
     if ~isempty(vr.text)
       % Determine text position boundaries
@@ -387,6 +544,16 @@ end
 disp(['Ran ' num2str(vr.iterations-1) ' iterations in ' num2str(vr.timeElapsed,4) ...
     ' s (' num2str(vr.timeElapsed*1000/(vr.iterations-1),3) ' ms/frame refresh time).']);
 
+% Make frame timing available to the termination code, see virmenFrameTimingReport
+if isTimed
+    vr.frameTiming = virmenOpenGLRoutines(14);
+end
+vr.fenceStatistics = virmenOpenGLRoutines(15);
+if vr.fenceStatistics.numTimeouts > 0
+    disp(['GPU stalled for more than ' num2str(1000*vr.fenceTimeout) ' ms ' num2str(vr.fenceStatistics.numTimeouts) ' times, ' ...
+        num2str(vr.fenceStatistics.numSkipped) ' draws skipped (longest wait ' num2str(1000*vr.fenceStatistics.maxWait,4) ' ms).']);
+end
+
 % Run termination code
 try
       vr.code.termination(vr);
@@ -401,4 +568,36 @@ end
 
 % Close the window used by ViRMEn
 drawnow;
-virmenOpenGLRoutines(2);
\ No newline at end of file
+virmenOpenGLRoutines(2);
+
+
+function vr = virmenUserInput(vr, events)
+% Records user inputs (keyboard and mouse) polled from virmenOpenGLRoutines. All events since the
+% last frame are in vr.inputEvents, one per row as [time type code modifiers window], where type
+% is 1/2 for a key press/release and 3/4 for a mouse button press/release. The last of each type
+% is also stored in vr.keyPressed, vr.keyReleased, vr.buttonPressed and vr.buttonReleased.
+
+vr.inputEvents = events;
+for iEvent = 1:size(events,1)
+    switch events(iEvent,2)
+        case 1
+            vr.keyPressed = events(iEvent,3);
+        case 2
+            vr.keyReleased = events(iEvent,3);
+        case 3
+            vr.buttonPressed = events(iEvent,3);
+            vr.activeWindow = events(iEvent,5);
+        case 4
+            vr.buttonReleased = events(iEvent,3);
+            vr.activeWindow = events(iEvent,5);
+    end
+    vr.modifiers = events(iEvent,4);
+end
+
+
+function registerWalls(vrWorld, wNum)
+% Packs the walls of a world in the memory of virmenResolveCollisions, so that they are not
+% passed on every iteration
+
+virmenResolveCollisions('register',wNum,vrWorld.walls.endpoints,vrWorld.walls.radius2 ...
+                       ,vrWorld.walls.angle,vrWorld.walls.border1,vrWorld.walls.border2);
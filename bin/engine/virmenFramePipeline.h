@@ -0,0 +1,330 @@
+#ifndef VIRMENFRAMEPIPELINE_H
+#define VIRMENFRAMEPIPELINE_H
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+#include <mex.h>
+#include "virmenFrameTiming.h"
+#include "virmenCoordinates.h"
+#include "virmenDepthSort.h"
+
+
+/**
+  Per-frame geometry processing that replaces the chain of virmenProcessCoordinates, the user
+  transformation, virmenVisibleTriangles, distance assignment and (for transparent worlds)
+  virmenTrianglesDistance + sort + virmenOrderTriangles in virmenEngine.m.
+
+  The triangulation of each world is kept in MEX memory until the world is marked as changed.
+  Vertex positions, colors and visibility flags are read in-place from the Matlab arrays on
+  every frame, since experiments are free to modify them at runtime without notice.
+  The animal-centered coordinates are written into a persistent mxArray that is passed to the
+  transformation function, so that no world-sized arrays are allocated per frame other than the
+  output of the (user-defined) transformation itself.
+*/
+
+
+//=============================================================================
+//  World geometry that is kept between engine iterations
+//=============================================================================
+
+struct ResidentWorld
+{
+  GLsizei                     numVertices;
+  GLsizei                     numTriangles;
+  std::vector<GLuint>         triangulation;      // 3 x numTriangles, 0-based vertex indices
+
+  ResidentWorld() : numVertices(0), numTriangles(0) {}
+};
+
+
+//=============================================================================
+//  Frame pipeline
+//=============================================================================
+
+class FramePipeline
+{
+protected:
+  std::vector<ResidentWorld>  worlds;
+  mxArray*                    relative;           // 3 x numVertices animal-centered coordinates
+  mxArray*                    projected;          // 3 x numVertices x nDim screen coordinates
+  std::vector<double>         distance;           // per vertex distance from the animal
+  DepthSort                   depthSort;          // back-to-front triangle order
+  int                         currentWorld;
+  double                      currentIteration;
+  bool                        isSorted;
+
+public:
+  FramePipeline()
+    : relative        (0)
+    , projected       (0)
+    , currentWorld    (-1)
+    , currentIteration(-1)
+    , isSorted        (false)
+  { }
+
+  ~FramePipeline()    { release(); }
+
+  void release()
+  {
+    if (relative)     mxDestroyArray(relative);
+    if (projected)    mxDestroyArray(projected);
+    relative          = 0;
+    projected         = 0;
+    worlds.clear();
+    currentWorld      = -1;
+    currentIteration  = -1;
+  }
+
+  bool isRegistered(int iWorld) const {
+    return iWorld < static_cast<int>(worlds.size()) && worlds[iWorld].numVertices > 0;
+  }
+  const ResidentWorld& world(int iWorld) const  { return worlds[iWorld]; }
+
+  /// Number of transformations returned by the user function for the current frame
+  GLsizei numTransformations() const
+  {
+    if (!projected)   return 0;
+    if (mxGetNumberOfDimensions(projected) < 3)
+      return 1;
+    return static_cast<GLsizei>( mxGetDimensions(projected)[2] );
+  }
+
+
+  /**
+    Copies the triangulation of a world into MEX memory. This should be called whenever the
+    world geometry has changed (vr.worlds{}.changed), and is cheap otherwise.
+  */
+  void registerWorld(int iWorld, const mxArray* vertices, const mxArray* triangulation)
+  {
+    if (mxGetClassID(triangulation) != mxINT32_CLASS && mxGetClassID(triangulation) != mxUINT32_CLASS)
+      mexErrMsgIdAndTxt("virmenOpenGLRoutines:registerWorld", "Triangulation must be of type int32 or uint32.");
+    if (mxGetM(vertices) != 3 || mxGetM(triangulation) != 3)
+      mexErrMsgIdAndTxt("virmenOpenGLRoutines:registerWorld", "Vertices and triangulation must both be 3 x N arrays.");
+
+    // Indices are used as is to address vertices on every frame, so they are only checked here
+    const GLuint*             tria          = (const GLuint*) mxGetData(triangulation);
+    const size_t              numIndices    = 3*mxGetN(triangulation);
+    const GLuint              numVertices   = static_cast<GLuint>( mxGetN(vertices) );
+    if (numIndices > 0 && *std::max_element(tria, tria + numIndices) >= numVertices)
+      mexErrMsgIdAndTxt("virmenOpenGLRoutines:registerWorld", "Triangulation refers to vertices beyond the %d of world %d.", numVertices, iWorld + 1);
+
+    if (iWorld >= static_cast<int>(worlds.size()))
+      worlds.resize(iWorld + 1);
+
+    ResidentWorld&            resident      = worlds[iWorld];
+    resident.numVertices      = static_cast<GLsizei>( numVertices );
+    resident.numTriangles     = static_cast<GLsizei>( mxGetN(triangulation) );
+    resident.triangulation.assign(tria, tria + numIndices);
+
+    // Force recomputation in case this world is being displayed
+    if (iWorld == currentWorld)
+      currentIteration        = -1;
+    depthSort.reset();
+  }
+
+
+  /**
+    Translates and rotates vertices to be relative to the animal position, and applies the
+    user-specified transformation to obtain screen coordinates. This needs to be done only once
+    per engine iteration, independently of the number of windows. Distances are computed for
+    all vertices and, if sortByDepth is set, the back-to-front order of triangles is determined.
+  */
+  void prepare( int               iWorld
+              , const mxArray*    vertices
+              , const double*     pos
+              , const mxArray*    transformation
+              , const mxArray*    transformArg
+              , bool              sortByDepth
+              , double            iteration
+              )
+  {
+    if (iWorld == currentWorld && iteration == currentIteration && projected)
+      return;
+
+    const ResidentWorld&      resident      = worlds[iWorld];
+    const mwSize              numVertices   = resident.numVertices;
+    if (mxGetN(vertices) != numVertices)
+      mexErrMsgIdAndTxt ( "virmenOpenGLRoutines:framePipeline"
+                        , "Number of vertices (%d) differs from that registered for world %d (%d); the world should be marked as changed."
+                        , static_cast<int>(mxGetN(vertices)), iWorld + 1, static_cast<int>(numVertices)
+                        );
+
+    // Release the previous frame first since it may share data with the input array
+    if (projected)            mxDestroyArray(projected);
+    projected                 = 0;
+    if (relative && mxGetN(relative) != numVertices) {
+      mxDestroyArray(relative);
+      relative                = 0;
+    }
+    if (!relative) {
+      relative                = mxCreateDoubleMatrix(3, numVertices, mxREAL);
+      mexMakeArrayPersistent(relative);
+    }
+    distance.resize(numVertices);
+
+    // Translate, compute distance and rotate in a single pass
+    {
+      StageTimer              timer(STAGE_COORDINATES);
+      coordinates::relative(mxGetPr(vertices), mxGetPr(relative), distance.data(), numVertices, pos);
+    }
+
+    // Apply the user transformation
+    {
+      StageTimer              timer(STAGE_TRANSFORMATION);
+      mxArray*                rhs[]         = { const_cast<mxArray*>(transformation), relative, const_cast<mxArray*>(transformArg) };
+      const int               nrhs          = ( transformArg && !mxIsEmpty(transformArg) ) ? 3 : 2;
+      mexCallMATLAB(1, &projected, nrhs, rhs, "feval");
+    }
+    mexMakeArrayPersistent(projected);
+    if (mxGetClassID(projected) != mxDOUBLE_CLASS || mxGetM(projected) != 3 || mxGetDimensions(projected)[1] != numVertices)
+      mexErrMsgIdAndTxt("virmenOpenGLRoutines:framePipeline", "Transformation function must return a 3 x %d x nDim double array.", static_cast<int>(numVertices));
+
+    // Back-to-front order of triangles using the nearest vertex of each
+    isSorted                  = sortByDepth;
+    if (sortByDepth)
+      sortTriangles(resident, iWorld);
+
+    currentWorld              = iWorld;
+    currentIteration          = iteration;
+  }
+
+
+  /**
+    For projections that are performed on the GPU, the only per-vertex computation that remains
+    on the CPU is the distance from the animal, which is needed to sort triangles from back to
+    front for transparent worlds.
+  */
+  void prepareDepthOrder(int iWorld, const mxArray* vertices, const double* pos, double iteration)
+  {
+    if (iWorld == currentWorld && iteration == currentIteration && isSorted)
+      return;
+
+    const ResidentWorld&      resident      = worlds[iWorld];
+    const mwSize              numVertices   = resident.numVertices;
+    if (mxGetN(vertices) != numVertices)
+      mexErrMsgIdAndTxt ( "virmenOpenGLRoutines:framePipeline"
+                        , "Number of vertices (%d) differs from that registered for world %d (%d); the world should be marked as changed."
+                        , static_cast<int>(mxGetN(vertices)), iWorld + 1, static_cast<int>(numVertices)
+                        );
+    distance.resize(numVertices);
+
+    // Screen coordinates are not computed on this path
+    if (projected)            mxDestroyArray(projected);
+    projected                 = 0;
+
+    StageTimer                timer(STAGE_COORDINATES);
+    const double*             coord3        = mxGetPr(vertices);
+    for (mwSize index = 0; index < numVertices; ++index, coord3 += 3) {
+      const double            x             = coord3[0] - pos[0];
+      const double            y             = coord3[1] - pos[1];
+      const double            z             = coord3[2] - pos[2];
+      distance[index]         = sqrt(x*x + y*y + z*z);
+    }
+
+    isSorted                  = true;
+    sortTriangles(resident, iWorld);
+
+    currentWorld              = iWorld;
+    currentIteration          = iteration;
+  }
+
+
+  /**
+    Writes screen coordinates with distance as the z coordinate, and the triangles that are
+    visible in the given transformation (0-based), into the provided (mapped) buffers. Culled
+    triangles are output as degenerate triangles, as in virmenVisibleTriangles. Returns the
+    number of indices written.
+  */
+  GLsizei write ( GLsizei         iTransform
+                , const mxArray*  visible
+                , GLfloat*        vertexOut
+                , GLuint*         triangleOut
+                , GLuint          indexOffset
+                ) const
+  {
+    StageTimer                timer(STAGE_CULLING);
+    const ResidentWorld&      resident      = worlds[currentWorld];
+    const GLsizei             numVertices   = resident.numVertices;
+    const GLsizei             numTriangles  = resident.numTriangles;
+    if (mxGetNumberOfElements(visible) != static_cast<mwSize>(numTriangles))
+      mexErrMsgIdAndTxt ( "virmenOpenGLRoutines:framePipeline"
+                        , "Number of visibility flags (%d) must be equal to the number of triangles (%d)."
+                        , static_cast<int>(mxGetNumberOfElements(visible)), numTriangles
+                        );
+
+    if (!mxIsLogical(visible))
+      mexErrMsgIdAndTxt("virmenOpenGLRoutines:framePipeline", "Visibility flags must be of type logical.");
+
+    const double*             coord3        = mxGetPr(projected) + 3*numVertices*iTransform;
+    const double*             coord2        = coord3;
+    for (GLsizei iVtx = 0; iVtx < numVertices; ++iVtx, coord2 += 3, vertexOut += 3) {
+      vertexOut[0]            = static_cast<GLfloat>( coord2[0] );
+      vertexOut[1]            = static_cast<GLfloat>( coord2[1] );
+      vertexOut[2]            = static_cast<GLfloat>( distance[iVtx] );
+    }
+
+    const mxLogical*          isVisible     = mxGetLogicals(visible);
+    for (GLsizei index = 0; index < numTriangles; ++index, triangleOut += 3) {
+      const GLsizei           iTri          = isSorted ? depthSort.result()[index] : index;
+      const GLuint*           tria          = &resident.triangulation[3*iTri];
+      if  ( isVisible[iTri]
+          && ( coord3[3*tria[0]+2] == 1 || coord3[3*tria[1]+2] == 1 || coord3[3*tria[2]+2] == 1 )
+          ) {
+        triangleOut[0]        = tria[0] + indexOffset;
+        triangleOut[1]        = tria[1] + indexOffset;
+        triangleOut[2]        = tria[2] + indexOffset;
+      } else {
+        triangleOut[0]        = indexOffset;
+        triangleOut[1]        = indexOffset;
+        triangleOut[2]        = indexOffset;
+      }
+    }
+
+    return 3 * numTriangles;
+  }
+
+
+  /**
+    Writes only the triangles that are flagged as visible (by vr.worlds{}.surface.visible),
+    back-to-front if ordered is set, for when the per-vertex visibility is determined on the
+    GPU. Returns the number of indices written.
+  */
+  GLsizei writeVisible(int iWorld, const mxArray* visible, GLuint* triangleOut, bool ordered) const
+  {
+    StageTimer                timer(STAGE_CULLING);
+    const ResidentWorld&      resident      = worlds[iWorld];
+    const GLsizei             numTriangles  = resident.numTriangles;
+    if (!mxIsLogical(visible) || mxGetNumberOfElements(visible) != static_cast<mwSize>(numTriangles))
+      mexErrMsgIdAndTxt ( "virmenOpenGLRoutines:framePipeline"
+                        , "Visibility flags must be a logical array with one entry per triangle (%d)."
+                        , numTriangles
+                        );
+
+    const mxLogical*          isVisible     = mxGetLogicals(visible);
+    GLuint*                   target        = triangleOut;
+    for (GLsizei index = 0; index < numTriangles; ++index) {
+      const GLsizei           iTri          = ordered ? depthSort.result()[index] : index;
+      if (!isVisible[iTri])   continue;
+      const GLuint*           tria          = &resident.triangulation[3*iTri];
+      target[0]               = tria[0];
+      target[1]               = tria[1];
+      target[2]               = tria[2];
+      target                 += 3;
+    }
+
+    return static_cast<GLsizei>( target - triangleOut );
+  }
+
+
+protected:
+  void sortTriangles(const ResidentWorld& resident, int iWorld)
+  {
+    StageTimer                timer(STAGE_SORT);
+    if (resident.numTriangles > 0)
+      depthSort.sort(&distance[0], &resident.triangulation[0], resident.numTriangles, iWorld);
+  }
+};
+
+
+#endif //VIRMENFRAMEPIPELINE_H
@@ -0,0 +1,36 @@
+function varargout = virmenFramePipeline(vr, world, transformations, transformArg)
+% [keyPressed, ...] = virmenFramePipeline(vr, world, transformations, transformArg)
+%   Renders vr.worlds{world} into all ViRMEn windows with a single MEX call, window i using the
+%   transformations(i)-th output of the transformation function (NaN to only clear it).
+%   Translation and rotation about vr.position, the transformation function, visibility culling,
+%   depth assignment and (for transparent worlds) back-to-front ordering of triangles are
+%   performed within virmenOpenGLRoutines, which writes directly into its mapped graphics
+%   buffers. The transformation function is evaluated only once per engine iteration, and called
+%   as transformationFunction(vertexArray, transformArg) if transformArg is non-empty.
+%
+%   All windows share graphics buffers, so that colors and (for projections on the GPU)
+%   world-space vertices are uploaded once for all of them. Windows are drawn first and then
+%   presented together: only the first waits for vsync, the others are swapped right after it.
+%   Outputs, if any are requested, are the same as for virmenOpenGLRoutines(1, ...) except that
+%   cursorPosition is numWindows x 2. The engine instead polls all input events since the last
+%   frame with virmenOpenGLRoutines(18), so that nothing is allocated here.
+%
+%   If vr.renderQueueDepth > 0, frames are instead submitted to a native render thread, which
+%   draws and presents them while the engine continues; submission only waits if that many
+%   frames are already queued. An eighth output then lists the frames presented since the
+%   previous call, with their submission and presentation times.
+%
+%   The world must have been registered with virmenOpenGLRoutines(6, world, vertices,
+%   triangulation, colors), which should be repeated whenever vr.worlds{world}.changed is set.
+%   Only vertices and triangles are streamed to the graphics card per frame; colors are
+%   uploaded only for the range of vertices in which they differ from the previous frame.
+
+if vr.renderQueueDepth > 0
+    command = 17;
+else
+    command = 16;
+end
+[varargout{1:nargout}] = ...
+    virmenOpenGLRoutines(command, world, vr.worlds{world}.surface.vertices, vr.worlds{world}.surface.visible ...
+                        , vr.worlds{world}.surface.colors, vr.position, vr.exper.transformationFunction, transformArg ...
+                        , transformations, vr.iterations);
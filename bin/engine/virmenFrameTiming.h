@@ -0,0 +1,231 @@
+#ifndef VIRMENFRAMETIMING_H
+#define VIRMENFRAMETIMING_H
+
+#include <vector>
+#include <algorithm>
+#include <thread>
+#include <mex.h>
+
+#if defined(_WIN32)
+  #include <windows.h>
+#elif defined(__APPLE__)
+  #include <mach/mach_time.h>
+#else
+  #include <time.h>
+#endif
+
+
+/**
+  Per-frame durations of each stage of the engine loop, recorded into a preallocated ring buffer
+  so that dropped frames can be attributed to Matlab code, geometry processing, GPU fence waits
+  or the buffer swap. Stages up to STAGE_FIRST_NATIVE are measured in Matlab and passed in at
+  the start of each frame; the others are accumulated here as they occur. Frames rendered with
+  the frame pipeline report transformation, culling and sorting here, otherwise these are
+  measured in Matlab. Only the thread that configured timing records stages, so frames that
+  are presented by the render thread (command 17) report their presentation times separately.
+*/
+enum TimingStage
+{ STAGE_MOVEMENT
+, STAGE_COLLISIONS
+, STAGE_RUNTIME
+, STAGE_COORDINATES
+, STAGE_TRANSFORMATION
+, STAGE_CULLING
+, STAGE_SORT
+, STAGE_FIRST_NATIVE
+, STAGE_FENCE_WAIT      = STAGE_FIRST_NATIVE
+, STAGE_DRAW
+, STAGE_SWAP
+, NUM_TIMING_STAGES
+};
+
+static const char*  TIMING_STAGE_NAMES[]  = { "movement", "collisions", "runtime", "coordinates", "transformation", "culling", "sort", "fenceWait", "draw", "swap" };
+static const int    MAX_TIMED_WINDOWS     = 8;
+
+
+/**
+  Monotonic time in seconds.
+*/
+static double timing_now()
+{
+#if defined(_WIN32)
+  static LARGE_INTEGER  frequency = {0};
+  if (frequency.QuadPart == 0)
+    QueryPerformanceFrequency(&frequency);
+  LARGE_INTEGER         counter;
+  QueryPerformanceCounter(&counter);
+  return static_cast<double>(counter.QuadPart) / frequency.QuadPart;
+#elif defined(__APPLE__)
+  static mach_timebase_info_data_t  timebase = {0, 0};
+  if (timebase.denom == 0)
+    mach_timebase_info(&timebase);
+  return 1e-9 * mach_absolute_time() * timebase.numer / timebase.denom;
+#else
+  timespec              now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + 1e-9 * now.tv_nsec;
+#endif
+}
+
+
+class FrameTiming
+{
+protected:
+  struct FrameRecord {
+    double                    iteration;
+    double                    start;                          // since timing was configured
+    double                    swapEnd;                        // of the first window
+    double                    stage[NUM_TIMING_STAGES];       // totals over windows
+    double                    draw[MAX_TIMED_WINDOWS];
+    double                    swap[MAX_TIMED_WINDOWS];
+    int                       numWindows;
+  };
+
+  std::vector<FrameRecord>    records;
+  size_t                      next;
+  size_t                      count;
+  double                      origin;
+  double                      attributed;                     // total over all recorded stages
+  FrameRecord*                current;
+  std::thread::id             owner;
+
+
+public:
+  FrameTiming() : next(0), count(0), origin(0), attributed(0), current(0) { }
+
+  bool isEnabled() const      { return std::this_thread::get_id() == owner && current != 0; }
+  double attributedTime() const { return attributed; }
+
+
+  /**
+    Allocates storage for the given number of most recent frames, discarding previous records.
+    A capacity of zero disables timing.
+  */
+  void configure(size_t capacity)
+  {
+    records.assign(capacity, FrameRecord());
+    next                      = 0;
+    count                     = 0;
+    origin                    = timing_now();
+    current                   = 0;
+    owner                     = std::this_thread::get_id();
+  }
+
+  /**
+    Starts the record of a new frame, with the durations of stages measured in Matlab.
+  */
+  void beginFrame(double iteration, const double* matlabStages, size_t numMatlabStages)
+  {
+    if (records.empty())
+      return;
+
+    current                   = &records[next];
+    next                      = (next + 1) % records.size();
+    count                     = std::min(count + 1, records.size());
+
+    *current                  = FrameRecord();
+    current->iteration        = iteration;
+    current->start            = timing_now() - origin;
+    for (size_t iStage = 0; iStage < numMatlabStages && iStage < STAGE_FIRST_NATIVE; ++iStage)
+      current->stage[iStage]  = matlabStages[iStage];
+  }
+
+  void add(TimingStage stage, double duration)
+  {
+    if (!current)             return;
+    current->stage[stage]    += duration;
+    attributed               += duration;
+  }
+
+  void addWindow(TimingStage stage, int iWindow, double duration)
+  {
+    if (!current)             return;
+    current->stage[stage]    += duration;
+    attributed               += duration;
+    if (iWindow >= MAX_TIMED_WINDOWS)
+      return;
+
+    current->numWindows       = std::max(current->numWindows, iWindow + 1);
+    if (stage == STAGE_DRAW)  current->draw[iWindow] += duration;
+    if (stage == STAGE_SWAP)  current->swap[iWindow] += duration;
+    if (stage == STAGE_SWAP && iWindow == 0)
+      current->swapEnd        = timing_now() - origin;
+  }
+
+  /**
+    Returns recorded frames, oldest first, as a struct array with one field per stage (in
+    seconds) and per-window draw and swap durations.
+  */
+  mxArray* report() const
+  {
+    std::vector<const char*>  fields;
+    fields.push_back("iteration");
+    fields.push_back("start");
+    fields.push_back("swapEnd");
+    fields.insert(fields.end(), TIMING_STAGE_NAMES, TIMING_STAGE_NAMES + NUM_TIMING_STAGES);
+    fields.push_back("windowDraw");
+    fields.push_back("windowSwap");
+
+    mxArray*                  timing        = mxCreateStructMatrix(count, 1, static_cast<int>(fields.size()), &fields[0]);
+    const size_t              first         = ( next + records.size() - count ) % std::max<size_t>(records.size(), 1);
+    for (size_t iFrame = 0; iFrame < count; ++iFrame) {
+      const FrameRecord&      record        = records[(first + iFrame) % records.size()];
+      int                     iField        = 0;
+      mxSetFieldByNumber(timing, iFrame, iField++, mxCreateDoubleScalar(record.iteration));
+      mxSetFieldByNumber(timing, iFrame, iField++, mxCreateDoubleScalar(record.start));
+      mxSetFieldByNumber(timing, iFrame, iField++, mxCreateDoubleScalar(record.swapEnd));
+      for (int iStage = 0; iStage < NUM_TIMING_STAGES; ++iStage)
+        mxSetFieldByNumber(timing, iFrame, iField++, mxCreateDoubleScalar(record.stage[iStage]));
+
+      mxArray*                draw          = mxCreateDoubleMatrix(1, record.numWindows, mxREAL);
+      mxArray*                swap          = mxCreateDoubleMatrix(1, record.numWindows, mxREAL);
+      std::copy(record.draw, record.draw + record.numWindows, mxGetPr(draw));
+      std::copy(record.swap, record.swap + record.numWindows, mxGetPr(swap));
+      mxSetFieldByNumber(timing, iFrame, iField++, draw);
+      mxSetFieldByNumber(timing, iFrame, iField++, swap);
+    }
+    return timing;
+  }
+};
+
+FrameTiming frameTiming;
+
+
+/**
+  Adds the time elapsed over its lifetime to the given stage, if timing is enabled. Time spent
+  in nested timers is excluded, so that e.g. a fence wait within a draw is only counted once.
+*/
+class StageTimer
+{
+protected:
+  TimingStage                 stage;
+  int                         iWindow;
+  double                      start;
+  double                      nested;
+
+public:
+  StageTimer(TimingStage stage, int iWindow = -1)
+    : stage(stage), iWindow(iWindow), start(0), nested(0)
+  {
+    if (!frameTiming.isEnabled())
+      return;
+    start                     = timing_now();
+    nested                    = frameTiming.attributedTime();
+  }
+
+  ~StageTimer()              { stop(); }
+
+  /// Records the elapsed time now instead of at the end of scope
+  void stop()
+  {
+    if (start == 0 || !frameTiming.isEnabled())
+      return;
+    const double              duration      = timing_now() - start - (frameTiming.attributedTime() - nested);
+    if (iWindow < 0)          frameTiming.add(stage, duration);
+    else                      frameTiming.addWindow(stage, iWindow, duration);
+    start                     = 0;
+  }
+};
+
+
+#endif //VIRMENFRAMETIMING_H
@@ -0,0 +1,67 @@
+function summary = virmenFrameTimingReport(timing, refreshRate)
+% summary = virmenFrameTimingReport(timing, refreshRate)
+%   Summarizes per-frame stage durations recorded by the engine when vr.timedFrames > 0 is set
+%   in the initialization code; timing is vr.frameTiming as available to the termination code,
+%   or virmenOpenGLRoutines(14) at any time while the engine is running.
+%
+%   A frame is counted as having missed vsync(s) if the interval between the end of consecutive
+%   buffer swaps (of the first window) exceeds 1.5 refresh periods. Each such frame is
+%   attributed to the stage that took the longest in it. Without an output argument, a table is
+%   printed and histograms of each stage are plotted.
+%
+%   refreshRate is in Hz and defaults to 60.
+
+if nargin < 2
+    refreshRate = 60;
+end
+
+stages = {'movement','collisions','runtime','coordinates','transformation','culling','sort','fenceWait','draw','swap'};
+durations = zeros(numel(timing),numel(stages));
+for iStage = 1:numel(stages)
+    durations(:,iStage) = [timing.(stages{iStage})];
+end
+
+% Missed vsyncs from the presentation intervals
+interval = diff([timing.swapEnd]);
+period = 1/refreshRate;
+isLate = interval > 1.5*period;
+numMissed = sum(round(interval(isLate)/period) - 1);
+[~, culprit] = max(durations([false isLate],:),[],2);
+
+summary = struct;
+summary.stage = stages;
+summary.mean = mean(durations,1);
+summary.median = median(durations,1);
+sorted = sort(durations,1);
+summary.p99 = sorted(max(1,ceil(0.99*size(sorted,1))),:);
+summary.max = max(durations,[],1);
+summary.frameInterval = interval;
+summary.numLateFrames = sum(isLate);
+summary.numMissedVsyncs = numMissed;
+summary.lateFramesByStage = accumarray(culprit(:),1,[numel(stages) 1])';
+
+if nargout > 0
+    return
+end
+
+fprintf('%d frames, %d presented late (%d missed vsyncs at %g Hz)\n', numel(timing), summary.numLateFrames, numMissed, refreshRate);
+fprintf('%-16s %10s %10s %10s %10s %6s\n', 'stage', 'mean (ms)', 'median', '99%', 'max', 'late');
+for iStage = 1:numel(stages)
+    fprintf('%-16s %10.3f %10.3f %10.3f %10.3f %6d\n', stages{iStage}, 1000*summary.mean(iStage), 1000*summary.median(iStage) ...
+           , 1000*summary.p99(iStage), 1000*summary.max(iStage), summary.lateFramesByStage(iStage));
+end
+
+figure('Name','ViRMEn frame timing');
+for iStage = 1:numel(stages)
+    subplot(3,4,iStage);
+    histogram(1000*durations(:,iStage));
+    title(stages{iStage});
+    xlabel('ms');
+end
+subplot(3,4,numel(stages)+1);
+histogram(1000*interval);
+hold on;
+plot(1000*period*[1.5 1.5], ylim, 'r--');
+title('frame interval');
+xlabel('ms');
+clear summary
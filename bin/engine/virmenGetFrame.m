@@ -2,6 +2,8 @@ function M = virmenGetFrame(w)
 % M = virmenGetFrame(w)
 %   Obtains the current image displayed in ViRMEn window w.
 %   Output is a height x width x 3 matrix of RGB values
+%   This waits for rendering to complete. To record every frame, e.g. for a
+%   full session, use virmenCaptureFrames() instead.
 
 M = virmenOpenGLRoutines(5,w);
 M = permute(M,[3 2 1]);
\ No newline at end of file
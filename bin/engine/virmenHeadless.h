@@ -0,0 +1,224 @@
+#ifndef VIRMENHEADLESS_H
+#define VIRMENHEADLESS_H
+
+#include <mex.h>
+
+
+/**
+  Offscreen rendering without a display server, for running ViRMEn worlds on analysis nodes and
+  build machines. Each ViRMEn window is emulated by an EGL context without a surface, which
+  renders into a framebuffer object of the window size. Swapping buffers resolves this into a
+  second framebuffer that holds the "displayed" image, from which pixels are read back.
+
+  Only available when compiled with -DVIRMEN_EGL (and linked to libEGL), otherwise requesting
+  headless mode results in an error.
+*/
+
+// Returned by glewInit() (GLEW >= 2.1) when there is no X display, which is expected here
+#ifndef GLEW_ERROR_NO_GLX_DISPLAY
+#define GLEW_ERROR_NO_GLX_DISPLAY 4
+#endif
+
+
+#ifdef VIRMEN_EGL
+
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+
+struct HeadlessWindow {
+  EGLContext    context;
+  GLuint        renderFramebufferID;          // target of rendering, multisampled if antialiasing
+  GLuint        displayFramebufferID;         // resolved on swap
+  GLuint        renderbufferIDs[3];           // render color and depth, display color
+  int           width;
+  int           height;
+};
+
+EGLDisplay      headlessDisplay = EGL_NO_DISPLAY;
+
+
+/**
+  Prefers a GPU or software device via EGL_EXT_platform_device, then the Mesa surfaceless
+  platform, and lastly whatever the default display is.
+*/
+static void headless_init()
+{
+  if (headlessDisplay != EGL_NO_DISPLAY)
+    return;
+
+  PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay  = (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  PFNEGLQUERYDEVICESEXTPROC       queryDevices        = (PFNEGLQUERYDEVICESEXTPROC)       eglGetProcAddress("eglQueryDevicesEXT");
+
+  EGLDisplay    display     = EGL_NO_DISPLAY;
+  if (getPlatformDisplay && queryDevices) {
+    EGLDeviceEXT  devices[16];
+    EGLint        numDevices  = 0;
+    if (queryDevices(16, devices, &numDevices) && numDevices > 0)
+      display   = getPlatformDisplay(EGL_PLATFORM_DEVICE_EXT, devices[0], NULL);
+    if (display != EGL_NO_DISPLAY && !eglInitialize(display, NULL, NULL))
+      display   = EGL_NO_DISPLAY;
+  }
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+  if (display == EGL_NO_DISPLAY && getPlatformDisplay) {
+    display     = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (display != EGL_NO_DISPLAY && !eglInitialize(display, NULL, NULL))
+      display   = EGL_NO_DISPLAY;
+  }
+#endif
+  if (display == EGL_NO_DISPLAY) {
+    display     = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    if (display != EGL_NO_DISPLAY && !eglInitialize(display, NULL, NULL))
+      display   = EGL_NO_DISPLAY;
+  }
+
+  if (display == EGL_NO_DISPLAY)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "Failed to initialize an EGL display, error 0x%x.", eglGetError());
+  if (!eglBindAPI(EGL_OPENGL_API))
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "EGL implementation does not support desktop OpenGL.");
+  headlessDisplay               = display;
+}
+
+/**
+  Creates a compatibility profile context, since the fixed-function pipeline is used, and makes
+  it current. If shared is given, the new context shares buffers, programs and sync objects with
+  it. Framebuffers can only be created once extensions have been loaded.
+*/
+static void headless_create_context(HeadlessWindow& window, const HeadlessWindow* shared)
+{
+  static const EGLint configAttributes[] = {
+    EGL_SURFACE_TYPE    , EGL_PBUFFER_BIT,
+    EGL_RENDERABLE_TYPE , EGL_OPENGL_BIT,
+    EGL_NONE
+  };
+  static const EGLint contextAttributes[] = {
+    EGL_CONTEXT_MAJOR_VERSION       , 3,
+    EGL_CONTEXT_MINOR_VERSION       , 3,
+    EGL_CONTEXT_OPENGL_PROFILE_MASK , EGL_CONTEXT_OPENGL_COMPATIBILITY_PROFILE_BIT,
+    EGL_NONE
+  };
+
+  EGLConfig     config;
+  EGLint        numConfigs  = 0;
+  if (!eglChooseConfig(headlessDisplay, configAttributes, &config, 1, &numConfigs) || numConfigs < 1)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "No EGL configuration available for desktop OpenGL.");
+
+  window                    = HeadlessWindow();
+  window.context            = eglCreateContext(headlessDisplay, config, shared ? shared->context : EGL_NO_CONTEXT, contextAttributes);
+  if (window.context == EGL_NO_CONTEXT)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "Failed to create an OpenGL 3.3 compatibility context, error 0x%x.", eglGetError());
+  if (!eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, window.context))
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "Failed to make context current without a surface, error 0x%x.", eglGetError());
+}
+
+static void headless_create_framebuffer(HeadlessWindow& window, int width, int height, int samples)
+{
+  window.width              = width;
+  window.height             = height;
+  glGenRenderbuffers(3, window.renderbufferIDs);
+
+  glBindRenderbuffer(GL_RENDERBUFFER, window.renderbufferIDs[0]);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, window.renderbufferIDs[1]);
+  glRenderbufferStorageMultisample(GL_RENDERBUFFER, samples, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, window.renderbufferIDs[2]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+
+  glGenFramebuffers(1, &window.displayFramebufferID);
+  glBindFramebuffer(GL_FRAMEBUFFER, window.displayFramebufferID);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, window.renderbufferIDs[2]);
+
+  glGenFramebuffers(1, &window.renderFramebufferID);
+  glBindFramebuffer(GL_FRAMEBUFFER, window.renderFramebufferID);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, window.renderbufferIDs[0]);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT , GL_RENDERBUFFER, window.renderbufferIDs[1]);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "Offscreen framebuffer of size %d x %d (%d samples) is incomplete.", width, height, samples);
+}
+
+static void headless_make_current(const HeadlessWindow& window)
+{
+  eglBindAPI(EGL_OPENGL_API);                 // per thread, e.g. for the render thread
+  eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, window.context);
+  glBindFramebuffer(GL_FRAMEBUFFER, window.renderFramebufferID);
+}
+
+/**
+  Detaches the current context from this thread, so that it can be made current in another.
+*/
+static void headless_release_current()
+{
+  eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+}
+
+/**
+  The equivalent of presenting a frame, after which the image can be read back.
+*/
+static void headless_swap_buffers(const HeadlessWindow& window)
+{
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, window.renderFramebufferID);
+  glBindFramebuffer(GL_DRAW_FRAMEBUFFER, window.displayFramebufferID);
+  glBlitFramebuffer(0, 0, window.width, window.height, 0, 0, window.width, window.height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+  glBindFramebuffer(GL_FRAMEBUFFER, window.renderFramebufferID);
+}
+
+/**
+  Selects the last presented image as the source for glReadPixels().
+*/
+static void headless_read_displayed(const HeadlessWindow& window)
+{
+  glBindFramebuffer(GL_READ_FRAMEBUFFER, window.displayFramebufferID);
+}
+
+static void headless_destroy_window(HeadlessWindow& window)
+{
+  if (window.context == EGL_NO_CONTEXT)
+    return;
+
+  headless_make_current(window);
+  glBindFramebuffer(GL_FRAMEBUFFER, 0);
+  glDeleteFramebuffers(1, &window.renderFramebufferID);
+  glDeleteFramebuffers(1, &window.displayFramebufferID);
+  glDeleteRenderbuffers(3, window.renderbufferIDs);
+
+  eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(headlessDisplay, window.context);
+  window                    = HeadlessWindow();
+}
+
+static void headless_terminate()
+{
+  if (headlessDisplay == EGL_NO_DISPLAY)
+    return;
+  eglMakeCurrent(headlessDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglTerminate(headlessDisplay);
+  headlessDisplay           = EGL_NO_DISPLAY;
+}
+
+
+#else //VIRMEN_EGL
+
+struct HeadlessWindow {
+  int           width;
+  int           height;
+};
+
+static void headless_unavailable()
+{
+  mexErrMsgIdAndTxt("virmenOpenGLRoutines:headless", "Headless rendering requires virmenOpenGLRoutines to be compiled with -DVIRMEN_EGL.");
+}
+
+static void headless_init()                                                     { headless_unavailable(); }
+static void headless_create_context(HeadlessWindow&, const HeadlessWindow*)     { headless_unavailable(); }
+static void headless_create_framebuffer(HeadlessWindow&, int, int, int)         { headless_unavailable(); }
+static void headless_make_current(const HeadlessWindow&)                        { headless_unavailable(); }
+static void headless_release_current()                                          { }
+static void headless_swap_buffers(const HeadlessWindow&)                        { headless_unavailable(); }
+static void headless_read_displayed(const HeadlessWindow&)                      { headless_unavailable(); }
+static void headless_destroy_window(HeadlessWindow&)                            { }
+static void headless_terminate()                                                { }
+
+#endif //VIRMEN_EGL
+
+
+#endif //VIRMENHEADLESS_H
@@ -1,8 +1,13 @@
-function [w, trans] = virmenLoadWindows(exper)
+function [w, trans] = virmenLoadWindows(exper, isHeadless)
 
 w = zeros(5,length(exper.windows));
 trans = zeros(1,length(exper.windows));
-mnt = virmenOpenGLMonitors();
+if nargin > 1 && isHeadless
+    % No monitors without a display server, full screen windows are rendered at 1920 x 1080
+    mnt = [0; 0; 1920; 1080];
+else
+    mnt = virmenOpenGLMonitors();
+end
 
 for ndx = length(exper.windows):-1:1
     if exper.windows{ndx}.primaryMonitor
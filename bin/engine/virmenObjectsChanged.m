@@ -0,0 +1,37 @@
+function vrWorld = virmenObjectsChanged(vrWorld, objects, parts)
+% vrWorld = virmenObjectsChanged(vrWorld, objects, parts)
+%   Marks objects of a world as changed after their vertices, colors or visibility flags were
+%   modified in vrWorld.surface, so that the engine only uploads their part of the world instead
+%   of the whole world as when vrWorld.changed is set. objects are indices (as in
+%   vrWorld.objects.indices) or names, and parts any of 'vertices', 'colors' and 'visible' (a
+%   string or cell array of strings, by default all). The number of vertices and triangles must
+%   stay the same; otherwise vrWorld.changed should be set instead.
+%
+%   Example, to hide a tower at the start of a trial:
+%       tri = vr.worlds{1}.objects.triangles(iTower,:);
+%       vr.worlds{1}.surface.visible(tri(1):tri(2)) = false;
+%       vr.worlds{1} = virmenObjectsChanged(vr.worlds{1}, iTower, 'visible');
+
+if nargin < 3
+    parts = {'vertices','colors','visible'};
+elseif ischar(parts)
+    parts = {parts};
+end
+
+if ischar(objects)
+    objects = {objects};
+end
+if iscell(objects)
+    names = objects;
+    objects = zeros(0,1);
+    for ndx = 1:numel(names)
+        objects = [objects; vrWorld.objects.indices.(names{ndx})(:)]; %#ok<AGROW>
+    end
+end
+
+for ndx = 1:numel(parts)
+    if ~isfield(vrWorld.dirty, parts{ndx})
+        error('virmenObjectsChanged:parts', 'Unknown part ''%s'', which should be ''vertices'', ''colors'' or ''visible''.', parts{ndx});
+    end
+    vrWorld.dirty.(parts{ndx}) = unique([vrWorld.dirty.(parts{ndx}); objects(:)]);
+end
@@ -1,9 +1,25 @@
 #include <mex.h>
 #include "GLEW/glew.h"
 #include "GLFW/glfw3.h"
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <map>
+#include <cstdlib>
+#include "virmenFramePipeline.h"
+#include "virmenShaders.h"
+#include "virmenHeadless.h"
+#include "virmenCapture.h"
+#include "virmenFrameTiming.h"
+#include "virmenRenderThread.h"
 
 GLFWwindow *windows[100];
+int swapIntervals[100];
+HeadlessWindow headlessWindows[100];
+bool isHeadless = false;
+FrameCapture frameCaptures[100];
 mwSize numWindows;
+int currentContext = -1;      // window whose context is current
 int keyPressed = -1;
 int keyReleased = -1;
 int modifiers = -1;
@@ -11,35 +27,127 @@ int buttonPressed = -1;
 int buttonReleased = -1;
 int activeWindow = -1;
 
-static const GLsizeiptr NUM_BUFFERS = 3;
+// Keyboard and mouse events in order of occurrence since the last poll (command 18), as only the
+// last of each kind is kept above
+enum InputEventType { KEY_PRESS = 1, KEY_RELEASE, BUTTON_PRESS, BUTTON_RELEASE };
+struct InputEvent {
+  double  time;                 // s since initialization
+  int     type;
+  int     code;                 // GLFW key or mouse button
+  int     modifiers;
+  int     window;
+};
+static const int MAX_INPUT_EVENTS = 256;
+InputEvent inputEvents[MAX_INPUT_EVENTS];
+int firstInputEvent = 0;
+int numInputEvents = 0;
+int numDroppedEvents = 0;     // oldest events overwritten since the last poll
+double inputOrigin = 0;
+
+static const int MAX_BUFFERS = 8;
+int numBuffers = 3;           // ranges in each persistently mapped ring, set at initialization
 GLuint vertexBufferID = 0;
 GLuint colorBufferID = 0;
 GLuint triangleBufferID = 0;
-GLuint primitivesArrayID = 0;
+std::vector<GLuint> primitivesArrayIDs;   // per window
 GLsizei vertexBufferSize = -1;
 GLsizei triangleBufferSize = -1;
+GLsizei colorBufferDims = -1;
 
 struct GBufferRange {
   GLfloat*  vertex;
   GLubyte*  color;
   GLuint*   triangle;
   GLuint    indexOffset;
+  void*     vtxOffset;
   void*     triOffset;
   GLsync    gSync;
 };
-GBufferRange bufferRange[NUM_BUFFERS];
+GBufferRange bufferRange[MAX_BUFFERS];
 int bufferIndex = 0;
 
+// Graphics buffers that are kept per world, with static colors and streamed vertices/triangles
+// All windows share one context object space, except for vertex array objects (per window)
+struct WorldBuffers {
+  std::vector<GLuint>   vertexArrayIDs;
+  GLuint                vertexBufferID;
+  GLuint                colorBufferID;
+  GLuint                triangleBufferID;
+  GLsizei               numVertices;
+  GLsizei               numTriangles;
+  GLsizei               nColorDims;
+  std::vector<double>   colors;               // as last uploaded, to detect changes
+  std::vector<GLubyte>  colorBytes;
+  GBufferRange          range[MAX_BUFFERS];
+  int                   bufferIndex;
+
+  // World-space geometry for projections on the GPU
+  std::vector<GLuint>   gpuVertexArrayIDs;
+  GLuint                worldVertexBufferID;
+  GLuint                visibleBufferID;
+  GLsizei               numVisibleIndices;
+  std::vector<double>   vertices;             // as last uploaded, to detect changes
+  std::vector<GLfloat>  vertexFloats;
+  std::vector<mxLogical> visible;
+  std::vector<GLuint>   visibleIndices;
+};
+std::vector<WorldBuffers> worldBuffers;
+
+// Programs for camera transform and projection on the GPU, per transformation, if in use
+std::vector<ProjectionProgram> projectionPrograms;
+std::map<std::string, GLuint> linkedPrograms;   // by projection name, kept while any window may still reference them
+GLfloat projectionParameters[4] = {0, 0, 0, 0};
+
+// Policy for ring buffer ranges that are still in use by the GPU when they are next needed
+GLuint64 fenceTimeout = 100000000;  // ns, per wait in the driver
+bool skipStalledFrames = false;     // otherwise keep waiting
+struct FenceStatistics {
+  double numWaits;                  // ranges that were still in flight
+  double inFlight[MAX_BUFFERS];     // the same, per range index
+  double numTimeouts;
+  double numSkipped;                // draws that were dropped
+  double maxWait;                   // s
+};
+FenceStatistics fenceStatistics;
+
+FramePipeline framePipeline;
+
+// Presents frames submitted with command 17, if threaded rendering is enabled
+RenderThread renderThread;
+int renderQueueDepth = 0;     // frames that can be submitted ahead of presentation, 0 if disabled
+
+
+static void push_input_event(int type, int code, int mods, GLFWwindow* window)
+{
+    if (numInputEvents == MAX_INPUT_EVENTS) {
+        firstInputEvent = (firstInputEvent + 1) % MAX_INPUT_EVENTS;
+        --numInputEvents;
+        ++numDroppedEvents;
+    }
+    InputEvent& event = inputEvents[(firstInputEvent + numInputEvents++) % MAX_INPUT_EVENTS];
+    event.time = timing_now() - inputOrigin;
+    event.type = type;
+    event.code = code;
+    event.modifiers = mods;
+    event.window = -1;
+    for (int i = 0; i < numWindows; i++) {
+        if (windows[i] == window) {
+            event.window = i;
+        }
+    }
+}
 
 static void key_callback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
     if (action == GLFW_PRESS) {
         keyPressed = key;
         modifiers = mods;
+        push_input_event(KEY_PRESS, key, mods, window);
     }
     else if (action == GLFW_RELEASE) {
         keyReleased = key;
         modifiers = mods;
+        push_input_event(KEY_RELEASE, key, mods, window);
     }
 }
 
@@ -50,10 +158,12 @@ static void mouse_callback(GLFWwindow* window, int button, int action, int mods)
     if (action == GLFW_PRESS) {
         buttonPressed = button;
         modifiers = mods;
+        push_input_event(BUTTON_PRESS, button, mods, window);
     }
     if (action == GLFW_RELEASE) {
         buttonReleased = button;
         modifiers = mods;
+        push_input_event(BUTTON_RELEASE, button, mods, window);
     }
     for (i = 0; i < numWindows; i++) {
         if (windows[i] == window) {
@@ -62,20 +172,179 @@ static void mouse_callback(GLFWwindow* window, int button, int action, int mods)
     }
 }
 
+// Window operations that are emulated in headless mode
+static void make_current(int iWindow)
+{
+  if (isHeadless)   headless_make_current(headlessWindows[iWindow]);
+  else              glfwMakeContextCurrent(windows[iWindow]);
+  currentContext    = iWindow;
+}
+
+/**
+  Presents the rendered frame, which is also recorded if capture is active for this window.
+  Windows wait for vsync unless isSynced is false, which is for windows presented right after
+  another one that has waited; the current context must be that of the window.
+*/
+static void swap_buffers(int iWindow, bool isSynced = true)
+{
+  StageTimer timer(STAGE_SWAP, iWindow);
+  FrameCapture& capture = frameCaptures[iWindow];
+  if (isHeadless) {
+    headless_swap_buffers(headlessWindows[iWindow]);
+    if (capture.isActive()) {
+      headless_read_displayed(headlessWindows[iWindow]);
+      capture.record();
+      headless_make_current(headlessWindows[iWindow]);
+    }
+  }
+  else {
+    if (capture.isActive())
+      capture.record();
+    const int interval = isSynced ? 1 : 0;
+    if (swapIntervals[iWindow] != interval) {
+      glfwSwapInterval(interval);
+      swapIntervals[iWindow] = interval;
+    }
+    glfwSwapBuffers(windows[iWindow]);
+  }
+}
+
+// Detaches the context from the calling thread, so that another thread can use it
+static void release_current()
+{
+  if (isHeadless)   headless_release_current();
+  else              glfwMakeContextCurrent(NULL);
+  currentContext    = -1;
+}
+
+/**
+  Waits until all submitted frames have been presented, and takes the contexts back from the
+  render thread, for commands that use them on the engine thread.
+*/
+static void stop_render_thread()
+{
+  if (!renderThread.isRunning())
+    return;
+  renderThread.stop();
+  if (numWindows > 0)
+    make_current(0);
+}
+
+static void get_framebuffer_size(int iWindow, int* width, int* height)
+{
+  if (isHeadless) {
+    *width          = headlessWindows[iWindow].width;
+    *height         = headlessWindows[iWindow].height;
+  }
+  else glfwGetFramebufferSize(windows[iWindow], width, height);
+}
+
+static void poll_events()
+{
+  if (!isHeadless)  glfwPollEvents();
+}
+
+static bool window_should_close(int iWindow)
+{
+  return !isHeadless && glfwWindowShouldClose(windows[iWindow]);
+}
+
+static void get_cursor_pos(int iWindow, double* x, double* y)
+{
+  if (isHeadless)   *x = *y = 0;
+  else              glfwGetCursorPos(windows[iWindow], x, y);
+}
+
+static void destroy_window(int iWindow)
+{
+  if (isHeadless)   headless_destroy_window(headlessWindows[iWindow]);
+  else              glfwDestroyWindow(windows[iWindow]);
+}
+
+/**
+  Vertex array objects are not shared between contexts, so each window needs its own. Binds the
+  one for the current window, and returns true if it was just created and still needs to be
+  set up.
+*/
+static bool bind_window_array(std::vector<GLuint>& arrayIDs)
+{
+  if (arrayIDs.size() < numWindows)
+    arrayIDs.resize(numWindows, 0);
+  GLuint& arrayID   = arrayIDs[currentContext];
+  const bool isNew  = ( arrayID == 0 );
+  if (isNew)        glGenVertexArrays(1, &arrayID);
+  glBindVertexArray(arrayID);
+  return isNew;
+}
+
+/**
+  Deletes per-window vertex array objects in the context that owns each of them.
+*/
+static void delete_window_arrays(std::vector<GLuint>& arrayIDs)
+{
+  const int previous = currentContext;
+  for (size_t iWindow = 0; iWindow < arrayIDs.size(); ++iWindow)
+    if (arrayIDs[iWindow] > 0 && iWindow < numWindows) {
+      make_current(static_cast<int>(iWindow));
+      glDeleteVertexArrays(1, &arrayIDs[iWindow]);
+    }
+  arrayIDs.clear();
+  if (previous >= 0 && previous < static_cast<int>(numWindows) && previous != currentContext)
+    make_current(previous);
+}
+
 static void lock_buffer(GLsync& gSync)
 {
   if (gSync)  glDeleteSync(gSync);
   gSync = glFenceSync( GL_SYNC_GPU_COMMANDS_COMPLETE, 0 );
 }
 
-static void wait_buffer(GLsync& gSync)
+/**
+  Waits until the GPU is done with the given range of a ring buffer. Each wait blocks in the
+  driver for at most fenceTimeout; if that expires and skipStalledFrames is set, returns false so
+  that the caller can drop the draw instead of hanging. Buffers that are about to be deleted
+  must be waited for regardless (canSkip = false).
+*/
+static bool wait_buffer(GLsync& gSync, int iBuf, bool canSkip = true)
 {
-  if (!gSync) return;
-  while (true) {
-    GLenum  waitReturn  = glClientWaitSync(gSync, GL_SYNC_FLUSH_COMMANDS_BIT, 1);
-    if (waitReturn == GL_ALREADY_SIGNALED || waitReturn == GL_CONDITION_SATISFIED)
-      return;
+  if (!gSync) return true;
+  if (glClientWaitSync(gSync, GL_SYNC_FLUSH_COMMANDS_BIT, 0) != GL_TIMEOUT_EXPIRED)
+    return true;
+
+  StageTimer timer(STAGE_FENCE_WAIT);
+  const double start = timing_now();
+  ++fenceStatistics.numWaits;
+  ++fenceStatistics.inFlight[iBuf];
+  while (glClientWaitSync(gSync, 0, fenceTimeout) == GL_TIMEOUT_EXPIRED) {
+    ++fenceStatistics.numTimeouts;
+    if (canSkip && skipStalledFrames) {
+      if (fenceStatistics.numSkipped++ == 0 && !renderThread.isRenderThread())
+        mexWarnMsgIdAndTxt("virmenOpenGLRoutines:stall", "GPU did not release buffer range %d within %g ms, skipping draws until it does.", iBuf + 1, 1e-6*fenceTimeout);
+      break;
+    }
   }
+  fenceStatistics.maxWait = std::max(fenceStatistics.maxWait, timing_now() - start);
+  return glClientWaitSync(gSync, 0, 0) != GL_TIMEOUT_EXPIRED;
+}
+
+/**
+  Returns the fence wait policy and statistics as a struct.
+*/
+static mxArray* fence_statistics()
+{
+  static const char* fields[] = { "numBuffers", "timeout", "skipStalledFrames", "numWaits", "inFlight", "numTimeouts", "numSkipped", "maxWait" };
+  mxArray* stats = mxCreateStructMatrix(1, 1, sizeof(fields) / sizeof(fields[0]), fields);
+  mxArray* inFlight = mxCreateDoubleMatrix(1, numBuffers, mxREAL);
+  std::copy(fenceStatistics.inFlight, fenceStatistics.inFlight + numBuffers, mxGetPr(inFlight));
+  mxSetField(stats, 0, "numBuffers", mxCreateDoubleScalar(numBuffers));
+  mxSetField(stats, 0, "timeout", mxCreateDoubleScalar(1e-9*fenceTimeout));
+  mxSetField(stats, 0, "skipStalledFrames", mxCreateLogicalScalar(skipStalledFrames));
+  mxSetField(stats, 0, "numWaits", mxCreateDoubleScalar(fenceStatistics.numWaits));
+  mxSetField(stats, 0, "inFlight", inFlight);
+  mxSetField(stats, 0, "numTimeouts", mxCreateDoubleScalar(fenceStatistics.numTimeouts));
+  mxSetField(stats, 0, "numSkipped", mxCreateDoubleScalar(fenceStatistics.numSkipped));
+  mxSetField(stats, 0, "maxWait", mxCreateDoubleScalar(fenceStatistics.maxWait));
+  return stats;
 }
 
 static void delete_buffers()
@@ -99,12 +368,9 @@ static void delete_buffers()
     glDeleteBuffers(1, &triangleBufferID);
     triangleBufferID = 0;
   }
-  if (primitivesArrayID > 0) {
-    glDeleteVertexArrays(1, &primitivesArrayID);
-    primitivesArrayID = 0;
-  }
+  delete_window_arrays(primitivesArrayIDs);
 
-  for (int iBuf = 0; iBuf < NUM_BUFFERS; ++iBuf) {
+  for (int iBuf = 0; iBuf < numBuffers; ++iBuf) {
     bufferRange[iBuf].vertex      = 0;
     bufferRange[iBuf].triangle    = 0;
     bufferRange[iBuf].indexOffset = 0;
@@ -114,85 +380,135 @@ static void delete_buffers()
 
   vertexBufferSize = -1;
   triangleBufferSize = -1;
+  colorBufferDims = -1;
   bufferIndex = 0;
 }
 
+static void delete_world_buffers(WorldBuffers& world)
+{
+  for (int iBuf = 0; iBuf < numBuffers; ++iBuf)
+    if (world.range[iBuf].gSync)  glDeleteSync(world.range[iBuf].gSync);
+
+  if (world.vertexBufferID > 0) {
+    glBindBuffer(GL_ARRAY_BUFFER, world.vertexBufferID);
+    glUnmapBuffer(GL_ARRAY_BUFFER);
+    glDeleteBuffers(1, &world.vertexBufferID);
+  }
+  if (world.triangleBufferID > 0) {
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.triangleBufferID);
+    glUnmapBuffer(GL_ELEMENT_ARRAY_BUFFER);
+    glDeleteBuffers(1, &world.triangleBufferID);
+  }
+  if (world.colorBufferID > 0)    glDeleteBuffers(1, &world.colorBufferID);
+  if (world.worldVertexBufferID > 0)  glDeleteBuffers(1, &world.worldVertexBufferID);
+  if (world.visibleBufferID > 0)      glDeleteBuffers(1, &world.visibleBufferID);
+  delete_window_arrays(world.vertexArrayIDs);
+  delete_window_arrays(world.gpuVertexArrayIDs);
+
+  world                 = WorldBuffers();
+}
+
+static void delete_all_world_buffers()
+{
+  for (size_t iWorld = 0; iWorld < worldBuffers.size(); ++iWorld)
+    delete_world_buffers(worldBuffers[iWorld]);
+  worldBuffers.clear();
+}
+
+static void delete_projection_programs()
+{
+  for (std::map<std::string, GLuint>::iterator iProg = linkedPrograms.begin(); iProg != linkedPrograms.end(); ++iProg)
+    if (iProg->second > 0)
+      glDeleteProgram(iProg->second);
+  linkedPrograms.clear();
+  projectionPrograms.clear();
+}
+
+/**
+  Programs are shared between windows, and deleting one that was last used in another context
+  is not reliably deferred by all drivers. They are therefore linked once per projection and
+  only deleted when all windows are closed.
+*/
+static GLuint get_projection_program(const std::string& name)
+{
+  std::map<std::string, GLuint>::iterator iProg = linkedPrograms.find(name);
+  if (iProg != linkedPrograms.end())
+    return iProg->second;
+  const GLuint program = build_projection_program(*find_shader_projection(name.c_str()));
+  linkedPrograms[name] = program;
+  return program;
+}
+
 static void terminate()
 {
+  stop_render_thread();
+  delete_projection_programs();
+  delete_all_world_buffers();
   delete_buffers();
+  framePipeline.release();
+  for (int iWindow = 0; iWindow < 100; ++iWindow)
+    frameCaptures[iWindow].release();
   glfwTerminate();
+  headless_terminate();
 }
 
 
-void allocate_buffers(const mxArray* vertices, const mxArray* triangles, const mxArray* colors)
+void allocate_buffers(GLsizei numVertices, GLsizei numTriangles, GLsizei nColorDims)
 {
-  const mwSize* vertexDim     = mxGetDimensions(vertices);
-  const mwSize* triangleDim   = mxGetDimensions(triangles);
-
-  GLsizei       numVertices   = vertexDim[1];
-  GLsizei       numTriangles  = triangleDim[1];
-  const GLsizei nColorDims    = mxGetM(colors);
-  if (mxGetN(colors) != numVertices)
-    mexErrMsgIdAndTxt("virmenOpenGLRoutines:allocate_buffers"
-                      , "Number of colors (%d) must be equal to the number of vertices (%d)"
-                      , mxGetN(colors), numVertices);
-
   // Size in bytes to use for buffer allocation
-  GLsizei totVertices   = vertexDim[0] * vertexDim[1];        // 3rd dimension is by window
-  GLsizei totTriangles  = triangleDim[0] * triangleDim[1];
+  GLsizei totVertices   = 3 * numVertices;
+  GLsizei totTriangles  = 3 * numTriangles;
   GLsizei vertexSize    = totVertices  * sizeof(GLfloat) / sizeof(GLubyte);
   GLsizei triangleSize  = totTriangles * sizeof(GLuint)  / sizeof(GLubyte);
   GLsizei colorSize     = numVertices  * nColorDims;
 
   // If we already have buffers of the correct size, nothing to do
-  if (vertexSize <= vertexBufferSize && triangleSize <= triangleBufferSize)
+  if (vertexSize <= vertexBufferSize && triangleSize <= triangleBufferSize && nColorDims == colorBufferDims)
     return;
 
-  // Otherwise we will reallocate buffers and should store the new sizes
-  vertexBufferSize      = vertexSize;
-  triangleBufferSize    = triangleSize;
+  // Otherwise we will reallocate buffers
   mexPrintf("virmenOpenGLRoutines:  Reallocating graphics buffers for %d vertices and %d triangles.\n", numVertices, numTriangles);
 
   // Wait for GPU to be done with buffers so that we can delete them
-  for (int iBuf = 0; iBuf < NUM_BUFFERS; ++iBuf)
-    wait_buffer(bufferRange[iBuf].gSync);
+  for (int iBuf = 0; iBuf < numBuffers; ++iBuf)
+    wait_buffer(bufferRange[iBuf].gSync, iBuf, false);
   delete_buffers();
 
+  // ... and store the new sizes, which are used to set up vertex arrays per window
+  vertexBufferSize      = vertexSize;
+  triangleBufferSize    = triangleSize;
+  colorBufferDims       = nColorDims;
+
 
   static const GLbitfield bufferHints = GL_MAP_WRITE_BIT
                                       | GL_MAP_PERSISTENT_BIT
                                       | GL_MAP_COHERENT_BIT
                                       ;
 
-  // Setup VAO and associate the relevant attributes
-  glGenVertexArrays(1, &primitivesArrayID);
-  glBindVertexArray(primitivesArrayID);
+  // Vertex arrays are set up per window when first drawn
+  glBindVertexArray(0);
 
   // Vertices
   glGenBuffers(1, &vertexBufferID);
   glBindBuffer(GL_ARRAY_BUFFER, vertexBufferID);
-  glBufferStorage(GL_ARRAY_BUFFER, NUM_BUFFERS*vertexSize, NULL, bufferHints);
-  glEnableVertexAttribArray(0);
-  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
-  GLfloat* vertexBuffer = (GLfloat*) glMapBufferRange(GL_ARRAY_BUFFER, 0, NUM_BUFFERS*vertexSize, bufferHints);
+  glBufferStorage(GL_ARRAY_BUFFER, numBuffers*vertexSize, NULL, bufferHints);
+  GLfloat* vertexBuffer = (GLfloat*) glMapBufferRange(GL_ARRAY_BUFFER, 0, numBuffers*vertexSize, bufferHints);
           
   // Vertex and color indices must be identical
   glGenBuffers(1, &colorBufferID);
   glBindBuffer(GL_ARRAY_BUFFER, colorBufferID);
-  glBufferStorage(GL_ARRAY_BUFFER, NUM_BUFFERS*colorSize, NULL, bufferHints);
-  glEnableVertexAttribArray(3);
-  glVertexAttribPointer(3, nColorDims, GL_UNSIGNED_BYTE, GL_TRUE, 0, 0);
-  GLubyte* colorBuffer  = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, NUM_BUFFERS*colorSize, bufferHints);
+  glBufferStorage(GL_ARRAY_BUFFER, numBuffers*colorSize, NULL, bufferHints);
+  GLubyte* colorBuffer  = (GLubyte*) glMapBufferRange(GL_ARRAY_BUFFER, 0, numBuffers*colorSize, bufferHints);
 
   // Triangles (vertex indices)
   glGenBuffers(1, &triangleBufferID);
   glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangleBufferID);
-  glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, NUM_BUFFERS*triangleSize, NULL, bufferHints);
-  GLuint* triangleBuffer = (GLuint*) glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, NUM_BUFFERS*triangleSize, bufferHints);
+  glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, numBuffers*triangleSize, NULL, bufferHints);
+  GLuint* triangleBuffer = (GLuint*) glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, numBuffers*triangleSize, bufferHints);
           
   //glBindVertexArray(0);
 
-  for (int iBuf = 0; iBuf < NUM_BUFFERS; ++iBuf) {
+  for (int iBuf = 0; iBuf < numBuffers; ++iBuf) {
     bufferRange[iBuf].vertex      = vertexBuffer    + iBuf * totVertices ;
     bufferRange[iBuf].color       = colorBuffer     + iBuf * colorSize;
     bufferRange[iBuf].triangle    = triangleBuffer  + iBuf * totTriangles;
@@ -201,6 +517,688 @@ void allocate_buffers(const mxArray* vertices, const mxArray* triangles, const m
   }
 }
 
+/**
+  maxTriangles is the most that will be drawn per window, if triangles are compacted instead of
+  being laid out per transformation, and maxVertices the most vertices if only a subset of the
+  world is drawn in each frame (see virmenWorldGridQuery).
+*/
+void allocate_buffers(const mxArray* vertices, const mxArray* triangles, const mxArray* colors, GLsizei maxTriangles = 0, GLsizei maxVertices = 0)
+{
+  const GLsizei numVertices   = mxGetDimensions(vertices)[1];   // 3rd dimension is by window
+  const GLsizei numTriangles  = maxTriangles > 0 ? maxTriangles : mxGetDimensions(triangles)[1];
+  if (mxGetN(colors) != numVertices)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:allocate_buffers"
+                      , "Number of colors (%d) must be equal to the number of vertices (%d)"
+                      , static_cast<int>(mxGetN(colors)), numVertices);
+
+  allocate_buffers(std::max(numVertices, maxVertices), numTriangles, mxGetM(colors));
+}
+
+/**
+  Binds the vertex array for the streamed buffers in the current window, setting it up if new.
+*/
+static void bind_primitives_array()
+{
+  if (!bind_window_array(primitivesArrayIDs))
+    return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, vertexBufferID);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+  // Conventional color array, since only some drivers alias generic attribute 3 to gl_Color
+  glBindBuffer(GL_ARRAY_BUFFER, colorBufferID);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glColorPointer(colorBufferDims, GL_UNSIGNED_BYTE, 0, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangleBufferID);
+}
+
+
+/**
+  Creates a set of graphics buffers for the given world, unless one of the correct size already
+  exists. Colors are stored in a static buffer, while vertices and triangles are streamed into
+  persistently mapped ring buffers, numBuffers ranges at a time. Switching between registered
+  worlds therefore only requires binding the corresponding vertex array object. Buffers are
+  shared by all windows, which each get their own vertex array object when first drawn.
+*/
+void register_world_buffers(int iWorld, GLsizei numVertices, GLsizei numTriangles, const mxArray* colors)
+{
+  if (iWorld >= static_cast<int>(worldBuffers.size()))
+    worldBuffers.resize(iWorld + 1, WorldBuffers());
+
+  WorldBuffers& world         = worldBuffers[iWorld];
+  const GLsizei nColorDims    = mxGetM(colors);
+  if (mxGetN(colors) != numVertices)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:register_world_buffers"
+                      , "Number of colors (%d) must be equal to the number of vertices (%d)"
+                      , static_cast<int>(mxGetN(colors)), numVertices);
+
+  // Force colors and geometry to be uploaded
+  world.colors.clear();
+  world.vertices.clear();
+  world.visible.clear();
+
+  if  ( world.vertexBufferID > 0
+      && world.numVertices == numVertices && world.numTriangles == numTriangles && world.nColorDims == nColorDims
+      )
+    return;
+
+  // Wait for GPU to be done with buffers so that we can delete them
+  for (int iBuf = 0; iBuf < numBuffers; ++iBuf)
+    wait_buffer(world.range[iBuf].gSync, iBuf, false);
+  delete_world_buffers(world);
+  world.numVertices           = numVertices;
+  world.numTriangles          = numTriangles;
+  world.nColorDims            = nColorDims;
+  mexPrintf("virmenOpenGLRoutines:  Allocating graphics buffers for world %d with %d vertices and %d triangles.\n", iWorld + 1, numVertices, numTriangles);
+
+  // Size in bytes to use for buffer allocation
+  const GLsizei vertexSize    = 3 * numVertices  * sizeof(GLfloat);
+  const GLsizei triangleSize  = 3 * numTriangles * sizeof(GLuint);
+  const GLsizei colorSize     = numVertices * nColorDims;
+
+  static const GLbitfield bufferHints = GL_MAP_WRITE_BIT
+                                      | GL_MAP_PERSISTENT_BIT
+                                      | GL_MAP_COHERENT_BIT
+                                      ;
+
+  glBindVertexArray(0);
+
+  // Vertices; the attribute offset is moved to the current range before each draw
+  glGenBuffers(1, &world.vertexBufferID);
+  glBindBuffer(GL_ARRAY_BUFFER, world.vertexBufferID);
+  glBufferStorage(GL_ARRAY_BUFFER, numBuffers*vertexSize, NULL, bufferHints);
+  GLfloat* vertexBuffer = (GLfloat*) glMapBufferRange(GL_ARRAY_BUFFER, 0, numBuffers*vertexSize, bufferHints);
+
+  // Colors are only uploaded when they change
+  glGenBuffers(1, &world.colorBufferID);
+  glBindBuffer(GL_ARRAY_BUFFER, world.colorBufferID);
+  glBufferStorage(GL_ARRAY_BUFFER, colorSize, NULL, GL_DYNAMIC_STORAGE_BIT);
+
+  // Triangles (vertex indices)
+  glGenBuffers(1, &world.triangleBufferID);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.triangleBufferID);
+  glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, numBuffers*triangleSize, NULL, bufferHints);
+  GLuint* triangleBuffer = (GLuint*) glMapBufferRange(GL_ELEMENT_ARRAY_BUFFER, 0, numBuffers*triangleSize, bufferHints);
+
+  for (int iBuf = 0; iBuf < numBuffers; ++iBuf) {
+    world.range[iBuf].vertex      = vertexBuffer    + iBuf * 3 * numVertices;
+    world.range[iBuf].color       = 0;
+    world.range[iBuf].triangle    = triangleBuffer  + iBuf * 3 * numTriangles;
+    world.range[iBuf].indexOffset = 0;
+    world.range[iBuf].vtxOffset   = (void*) ( static_cast<GLintptr>(iBuf) * vertexSize );
+    world.range[iBuf].triOffset   = (void*) ( static_cast<GLintptr>(iBuf) * triangleSize );
+    world.range[iBuf].gSync       = 0;
+  }
+  world.bufferIndex           = 0;
+}
+
+/**
+  Binds the vertex array for this world in the current window, setting it up if new.
+*/
+static void bind_world_array(WorldBuffers& world)
+{
+  if (!bind_window_array(world.vertexArrayIDs))
+    return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, world.vertexBufferID);
+  glEnableVertexAttribArray(0);
+  // Conventional color array, since only some drivers alias generic attribute 3 to gl_Color
+  glBindBuffer(GL_ARRAY_BUFFER, world.colorBufferID);
+  glEnableClientState(GL_COLOR_ARRAY);
+  glColorPointer(world.nColorDims, GL_UNSIGNED_BYTE, 0, 0);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.triangleBufferID);
+}
+
+/**
+  Determines the range [first, last) in which source differs from cache, and copies that range
+  into the cache. Returns false if there are no differences. The comparison is much cheaper
+  than converting and transferring all data to the graphics card on every frame.
+*/
+template<typename T>
+static bool find_changes(const T* source, size_t count, std::vector<T>& cache, size_t& first, size_t& last)
+{
+  first                       = 0;
+  last                        = count;
+  if (cache.size() == count) {
+    while (first < count && source[first] == cache[first])              ++first;
+    if (first == count)       return false;
+    while (last > first && source[last-1] == cache[last-1])             --last;
+  }
+  else cache.resize(count);
+
+  std::copy(source + first, source + last, cache.begin() + first);
+  return true;
+}
+
+/**
+  Converts and uploads the colors [first, last) (elements) of the cache of this world.
+*/
+static void upload_world_colors(WorldBuffers& world, size_t first, size_t last)
+{
+  world.colorBytes.resize(world.colors.size());
+  for (size_t iClr = first; iClr < last; ++iClr)
+    world.colorBytes[iClr]    = static_cast<GLubyte>(world.colors[iClr] * 255);
+  glBindBuffer(GL_ARRAY_BUFFER, world.colorBufferID);
+  glBufferSubData(GL_ARRAY_BUFFER, first, last - first, &world.colorBytes[first]);
+}
+
+/**
+  Uploads the part of the color buffer that differs from what was last uploaded for this world.
+*/
+static void update_world_colors(WorldBuffers& world, const mxArray* colors)
+{
+  size_t          first, last;
+  if (find_changes(mxGetPr(colors), mxGetNumberOfElements(colors), world.colors, first, last))
+    upload_world_colors(world, first, last);
+}
+
+/**
+  Creates the buffers used to render this world with a projection on the GPU, i.e. a static
+  copy of the world-space vertices and of the triangle indices, in which hidden triangles are
+  degenerate so that visibility can be changed in place, and binds the vertex array for the
+  current window.
+*/
+static void setup_gpu_world(WorldBuffers& world)
+{
+  if (world.worldVertexBufferID == 0) {
+    glBindVertexArray(0);
+    glGenBuffers(1, &world.worldVertexBufferID);
+    glBindBuffer(GL_ARRAY_BUFFER, world.worldVertexBufferID);
+    glBufferStorage(GL_ARRAY_BUFFER, 3 * world.numVertices * sizeof(GLfloat), NULL, GL_DYNAMIC_STORAGE_BIT);
+
+    glGenBuffers(1, &world.visibleBufferID);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.visibleBufferID);
+    glBufferStorage(GL_ELEMENT_ARRAY_BUFFER, 3 * world.numTriangles * sizeof(GLuint), NULL, GL_DYNAMIC_STORAGE_BIT);
+
+    world.vertices.clear();
+    world.visible.clear();
+    world.numVisibleIndices   = 0;
+  }
+
+  if (!bind_window_array(world.gpuVertexArrayIDs))
+    return;
+
+  glBindBuffer(GL_ARRAY_BUFFER, world.worldVertexBufferID);
+  glEnableVertexAttribArray(0);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, 0);
+
+  glBindBuffer(GL_ARRAY_BUFFER, world.colorBufferID);
+  glEnableVertexAttribArray(3);
+  glVertexAttribPointer(3, world.nColorDims, GL_UNSIGNED_BYTE, GL_TRUE, 0, 0);
+}
+
+/**
+  Converts and uploads the world-space coordinates [first, last) (elements) of the cache.
+*/
+static void upload_world_vertices(WorldBuffers& world, size_t first, size_t last)
+{
+  world.vertexFloats.resize(world.vertices.size());
+  for (size_t iVtx = first; iVtx < last; ++iVtx)
+    world.vertexFloats[iVtx]  = static_cast<GLfloat>(world.vertices[iVtx]);
+  glBindBuffer(GL_ARRAY_BUFFER, world.worldVertexBufferID);
+  glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(GLfloat), (last - first) * sizeof(GLfloat), &world.vertexFloats[first]);
+}
+
+/**
+  Uploads the part of the world-space vertices that differs from what was last uploaded.
+  Experiments are allowed to move vertices at runtime, e.g. to displace cues.
+*/
+static void update_world_vertices(WorldBuffers& world, const mxArray* vertices)
+{
+  size_t          first, last;
+  if (find_changes(mxGetPr(vertices), mxGetNumberOfElements(vertices), world.vertices, first, last))
+    upload_world_vertices(world, first, last);
+}
+
+/**
+  Uploads the indices of triangles [first, last) according to the cached visibility flags,
+  with hidden triangles made degenerate.
+*/
+static void upload_world_visibility(int iWorld, WorldBuffers& world, size_t first, size_t last)
+{
+  const std::vector<GLuint>&  triangulation = framePipeline.world(iWorld).triangulation;
+  world.visibleIndices.resize(3 * world.numTriangles);
+  for (size_t iTri = first; iTri < last; ++iTri)
+    for (int iCorner = 0; iCorner < 3; ++iCorner)
+      world.visibleIndices[3*iTri + iCorner]  = world.visible[iTri] ? triangulation[3*iTri + iCorner] : 0;
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.visibleBufferID);
+  glBufferSubData(GL_ELEMENT_ARRAY_BUFFER, 3 * first * sizeof(GLuint), 3 * (last - first) * sizeof(GLuint), &world.visibleIndices[3*first]);
+  world.numVisibleIndices     = 3 * world.numTriangles;
+}
+
+/**
+  Updates the indices of triangles whose visibility flags have changed.
+*/
+static void update_world_visibility(int iWorld, WorldBuffers& world, const mxArray* visible)
+{
+  if (!mxIsLogical(visible) || mxGetNumberOfElements(visible) != static_cast<mwSize>(world.numTriangles))
+    mexErrMsgIdAndTxt ( "virmenOpenGLRoutines:framePipeline"
+                      , "Visibility flags must be a logical array with one entry per triangle (%d)."
+                      , world.numTriangles
+                      );
+
+  size_t          first, last;
+  if (find_changes(mxGetLogicals(visible), mxGetNumberOfElements(visible), world.visible, first, last))
+    upload_world_visibility(iWorld, world, first, last);
+}
+
+/**
+  Reads ranges of objects (N x 2, 1-based [first last] rows of vr.worlds{}.objects.vertices or
+  .triangles) as sorted and merged [first, last) ranges of elements, with scale elements per
+  vertex or triangle. Empty objects are skipped.
+*/
+static void object_ranges(const mxArray* ranges, size_t scale, size_t count, const char* name, std::vector<std::pair<size_t, size_t> >& elements)
+{
+  elements.clear();
+  if (mxIsEmpty(ranges))
+    return;
+  if (!mxIsDouble(ranges) || mxGetN(ranges) != 2)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:updateObjects", "Ranges of %s must be given as an N x 2 matrix of [first last] indices.", name);
+
+  const mwSize    numRanges   = mxGetM(ranges);
+  const double*   range       = mxGetPr(ranges);
+  for (mwSize iRange = 0; iRange < numRanges; ++iRange) {
+    const double  first       = range[iRange];
+    const double  last        = range[iRange + numRanges];
+    if (last < first)
+      continue;
+    if (!(first >= 1 && last * scale <= count))
+      mexErrMsgIdAndTxt("virmenOpenGLRoutines:updateObjects", "Range [%g %g] of %s exceeds the %d of the world.", first, last, name, static_cast<int>(count / scale));
+    elements.push_back(std::make_pair(static_cast<size_t>(first - 1) * scale, static_cast<size_t>(last) * scale));
+  }
+
+  std::sort(elements.begin(), elements.end());
+  size_t          numMerged   = 0;
+  for (size_t iRange = 0; iRange < elements.size(); ++iRange) {
+    if (numMerged > 0 && elements[iRange].first <= elements[numMerged-1].second)
+      elements[numMerged-1].second  = std::max(elements[numMerged-1].second, elements[iRange].second);
+    else
+      elements[numMerged++]   = elements[iRange];
+  }
+  elements.resize(numMerged);
+}
+
+/**
+  Uploads only the given ranges of vertices, colors and visibility flags of a registered world,
+  e.g. for objects that were moved, recolored or shown/hidden, instead of re-registering the
+  whole world. Vertices and visibility flags are only kept on the graphics card for projections
+  on the GPU; otherwise they are read in place on every frame. Data that has not been uploaded
+  yet is left to the comparison that is done on every frame, as is everything while frames are
+  rendered by the render thread, which then owns the contexts.
+*/
+static void update_world_objects( int iWorld, WorldBuffers& world
+                                , const mxArray* vertices, const mxArray* colors, const mxArray* visible
+                                , const mxArray* vertexRanges, const mxArray* colorRanges, const mxArray* triangleRanges
+                                )
+{
+  std::vector<std::pair<size_t, size_t> >     ranges;
+  if (renderThread.isRunning())
+    return;
+  make_current(0);
+
+  object_ranges(vertexRanges, 3, mxGetNumberOfElements(vertices), "vertices", ranges);
+  if (world.worldVertexBufferID > 0 && world.vertices.size() == mxGetNumberOfElements(vertices))
+    for (size_t iRange = 0; iRange < ranges.size(); ++iRange) {
+      std::copy(mxGetPr(vertices) + ranges[iRange].first, mxGetPr(vertices) + ranges[iRange].second, world.vertices.begin() + ranges[iRange].first);
+      upload_world_vertices(world, ranges[iRange].first, ranges[iRange].second);
+    }
+
+  object_ranges(colorRanges, world.nColorDims, mxGetNumberOfElements(colors), "colors", ranges);
+  if (world.colors.size() == mxGetNumberOfElements(colors))
+    for (size_t iRange = 0; iRange < ranges.size(); ++iRange) {
+      std::copy(mxGetPr(colors) + ranges[iRange].first, mxGetPr(colors) + ranges[iRange].second, world.colors.begin() + ranges[iRange].first);
+      upload_world_colors(world, ranges[iRange].first, ranges[iRange].second);
+    }
+
+  object_ranges(triangleRanges, 1, mxGetNumberOfElements(visible), "triangles", ranges);
+  if (world.visibleBufferID > 0 && world.visible.size() == mxGetNumberOfElements(visible))
+    for (size_t iRange = 0; iRange < ranges.size(); ++iRange) {
+      std::copy(mxGetLogicals(visible) + ranges[iRange].first, mxGetLogicals(visible) + ranges[iRange].second, world.visible.begin() + ranges[iRange].first);
+      upload_world_visibility(iWorld, world, ranges[iRange].first, ranges[iRange].second);
+    }
+}
+
+/**
+  Inputs for rendering a world from its world coordinates, as provided by virmenFramePipeline.
+*/
+struct WorldFrame {
+  int                   iWorld;
+  const mxArray*        vertices;
+  const mxArray*        visible;
+  const mxArray*        colors;
+  const double*         position;
+  const mxArray*        transformFunction;
+  const mxArray*        transformArgument;
+  int                   transformation;
+  double                iteration;
+};
+
+/**
+  Renders a world for which screen coordinates are computed on the CPU by the user
+  transformation function, streaming vertices and triangles through the mapped ring buffers.
+*/
+static void draw_world_cpu(WorldBuffers& world, const WorldFrame& frame)
+{
+  // Geometry processing is done once per iteration, for all windows
+  framePipeline.prepare(frame.iWorld, frame.vertices, frame.position, frame.transformFunction, frame.transformArgument, world.nColorDims == 4, frame.iteration);
+
+  // Switch to this world's buffers and upload colors only if they have changed
+  bind_world_array(world);
+  update_world_colors(world, frame.colors);
+  
+  // Wait until GPU is no longer using buffers
+  GBufferRange& range = world.range[world.bufferIndex];
+  if (!wait_buffer(range.gSync, world.bufferIndex))
+    return;
+
+  // Write vertices and visible triangles straight into the mapped buffers
+  GLsizei numIndices = 0;
+  if (frame.transformation >= 1 && frame.transformation <= framePipeline.numTransformations())
+    numIndices = framePipeline.write(frame.transformation - 1, frame.visible, range.vertex, range.triangle, range.indexOffset);
+
+  glBindBuffer(GL_ARRAY_BUFFER, world.vertexBufferID);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, range.vtxOffset);
+  glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, range.triOffset);
+
+  lock_buffer(range.gSync);
+  world.bufferIndex = (world.bufferIndex + 1) % numBuffers;
+}
+
+/**
+  Renders a world for which the camera transform and projection are performed by the given
+  shader program. Only vertices that have been moved since the last frame are uploaded.
+*/
+static void draw_world_gpu(WorldBuffers& world, const WorldFrame& frame, const ProjectionProgram& projection)
+{
+  setup_gpu_world(world);
+  update_world_colors(world, frame.colors);
+  update_world_vertices(world, frame.vertices);
+
+  const double* position = frame.position;
+  glUseProgram(projection.program);
+  glUniform4f(projection.animalPosition, position[0], position[1], position[2], position[3]);
+  glUniform4fv(projection.parameters, 1, projectionParameters);
+
+  // Transparent worlds require triangles to be sorted on the CPU, every frame
+  if (world.nColorDims == 4) {
+    framePipeline.prepareDepthOrder(frame.iWorld, frame.vertices, position, frame.iteration);
+    GBufferRange& range = world.range[world.bufferIndex];
+    if (wait_buffer(range.gSync, world.bufferIndex)) {
+      const GLsizei numIndices = framePipeline.writeVisible(frame.iWorld, frame.visible, range.triangle, true);
+      glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.triangleBufferID);
+      glDrawElements(GL_TRIANGLES, numIndices, GL_UNSIGNED_INT, range.triOffset);
+      lock_buffer(range.gSync);
+      world.bufferIndex = (world.bufferIndex + 1) % numBuffers;
+    }
+  }
+  else {
+    update_world_visibility(frame.iWorld, world, frame.visible);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, world.visibleBufferID);
+    glDrawElements(GL_TRIANGLES, world.numVisibleIndices, GL_UNSIGNED_INT, 0);
+  }
+
+  glUseProgram(0);
+}
+
+/**
+  Returns the shader program to use for the given (1-based) transformation, or 0 if the
+  projection should be performed on the CPU.
+*/
+static const ProjectionProgram* find_projection_program(int transformation)
+{
+  if (transformation < 1 || transformation > static_cast<int>(projectionPrograms.size()))
+    return 0;
+  const ProjectionProgram& projection = projectionPrograms[transformation - 1];
+  return projection.program > 0 ? &projection : 0;
+}
+
+/**
+  Parses the inputs common to commands that render a world, starting at prhs[first], i.e.
+  (world, vertices, visible, colors, position, transformFcn, transformArg). The world must have
+  been registered using command 6.
+*/
+static WorldBuffers& get_world_frame(WorldFrame& frame, const mxArray* prhs[], int first)
+{
+  frame.iWorld            = static_cast<int>( mxGetScalar(prhs[first]) ) - 1;
+  frame.vertices          = prhs[first + 1];
+  frame.visible           = prhs[first + 2];
+  frame.colors            = prhs[first + 3];
+  frame.position          = mxGetPr(prhs[first + 4]);
+  frame.transformFunction = prhs[first + 5];
+  frame.transformArgument = prhs[first + 6];
+
+  if (!framePipeline.isRegistered(frame.iWorld) || frame.iWorld >= static_cast<int>(worldBuffers.size()))
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:framePipeline", "World %d must be registered (command 6) before it can be rendered.", frame.iWorld + 1);
+  WorldBuffers& world = worldBuffers[frame.iWorld];
+  if (mxGetN(frame.colors) != world.numVertices || mxGetM(frame.colors) != world.nColorDims)
+    mexErrMsgIdAndTxt("virmenOpenGLRoutines:framePipeline"
+                      , "Colors (%d x %d) must be %d x %d as registered; the world should be marked as changed."
+                      , static_cast<int>(mxGetM(frame.colors)), static_cast<int>(mxGetN(frame.colors)), world.nColorDims, world.numVertices);
+  return world;
+}
+
+/**
+  Renders the given frame offscreen into an RGBA framebuffer of the given size, and reads back
+  the pixels. If projection is null, the CPU path is used.
+*/
+static void render_offscreen(WorldBuffers& world, const WorldFrame& frame, const ProjectionProgram* projection, int width, int height, std::vector<GLubyte>& pixels)
+{
+  GLint previousFramebufferID;
+  glGetIntegerv(GL_FRAMEBUFFER_BINDING, &previousFramebufferID);
+
+  GLuint framebufferID, renderbufferIDs[2];
+  glGenFramebuffers(1, &framebufferID);
+  glGenRenderbuffers(2, renderbufferIDs);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbufferIDs[0]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, renderbufferIDs[1]);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindFramebuffer(GL_FRAMEBUFFER, framebufferID);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, renderbufferIDs[0]);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT , GL_RENDERBUFFER, renderbufferIDs[1]);
+
+  glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  if (projection)   draw_world_gpu(world, frame, *projection);
+  else              draw_world_cpu(world, frame);
+
+  pixels.resize(4 * width * height);
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  glReadPixels(0, 0, width, height, GL_RGBA, GL_UNSIGNED_BYTE, &pixels[0]);
+
+  glBindFramebuffer(GL_FRAMEBUFFER, previousFramebufferID);
+  glDeleteRenderbuffers(2, renderbufferIDs);
+  glDeleteFramebuffers(1, &framebufferID);
+}
+
+/**
+  Draws a frame submitted with command 17 into all windows and presents them, on the render
+  thread. This is the CPU path of command 16, except that vertices were already projected on
+  the engine thread, with indices relative to the vertices of each window.
+*/
+static void render_submitted_frame(FrameSubmission& frame, FramePresentation& presentation)
+{
+  WorldBuffers& world = worldBuffers[frame.iWorld];
+  const double numSkipped = fenceStatistics.numSkipped;
+
+  // Colors are shared by all windows
+  make_current(0);
+  if (frame.lastColor > frame.firstColor) {
+    glBindBuffer(GL_ARRAY_BUFFER, world.colorBufferID);
+    glBufferSubData(GL_ARRAY_BUFFER, frame.firstColor, frame.lastColor - frame.firstColor, &frame.colorBytes[frame.firstColor]);
+  }
+
+  for (int iWindow = 0; iWindow < numWindows; ++iWindow) {
+    make_current(iWindow);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+    const WindowSubmission& window = frame.windows[iWindow];
+    if (window.transformation > 0) {
+      bind_world_array(world);
+      GBufferRange& range = world.range[world.bufferIndex];
+      if (wait_buffer(range.gSync, world.bufferIndex)) {
+        std::copy(window.vertices.begin(), window.vertices.end(), range.vertex);
+        std::copy(window.triangles.begin(), window.triangles.begin() + window.numIndices, range.triangle);
+        glBindBuffer(GL_ARRAY_BUFFER, world.vertexBufferID);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, range.vtxOffset);
+        glDrawElementsBaseVertex(GL_TRIANGLES, window.numIndices, GL_UNSIGNED_INT, range.triOffset, range.indexOffset);
+        lock_buffer(range.gSync);
+        world.bufferIndex = (world.bufferIndex + 1) % numBuffers;
+      }
+    }
+    glFlush();
+  }
+
+  for (int iWindow = 0; iWindow < numWindows; ++iWindow) {
+    make_current(iWindow);
+    swap_buffers(iWindow, iWindow == 0);
+    if (iWindow == 0)
+      presentation.presented = renderThread.now();
+  }
+  presentation.numSkipped = fenceStatistics.numSkipped - numSkipped;
+}
+
+/**
+  Projects a frame for all windows into the next slot of the render queue. The transformation
+  function is evaluated before waiting for a free slot, so that this overlaps with rendering.
+*/
+static void submit_frame(WorldBuffers& world, const WorldFrame& frame, const double* windowTransformations)
+{
+  framePipeline.prepare(frame.iWorld, frame.vertices, frame.position, frame.transformFunction, frame.transformArgument, world.nColorDims == 4, frame.iteration);
+
+  if (!renderThread.isRunning()) {
+    release_current();
+    renderThread.start(render_submitted_frame, release_current);
+  }
+  FrameSubmission& submission = *renderThread.beginSubmit();
+  submission.iWorld = frame.iWorld;
+  submission.iteration = frame.iteration;
+
+  submission.windows.resize(numWindows);
+  for (int iWindow = 0; iWindow < numWindows; ++iWindow) {
+    WindowSubmission& window = submission.windows[iWindow];
+    const double transformation = windowTransformations[iWindow];
+    window.transformation = 0;
+    window.numIndices = 0;
+    if (!mxIsNaN(transformation) && transformation >= 1 && transformation <= framePipeline.numTransformations()) {
+      window.transformation = static_cast<int>(transformation);
+      window.vertices.resize(3 * world.numVertices);
+      window.triangles.resize(3 * world.numTriangles);
+      window.numIndices = framePipeline.write(window.transformation - 1, frame.visible, &window.vertices[0], &window.triangles[0], 0);
+    }
+  }
+
+  // Colors are converted here, and only where they changed since the last submission
+  const GLdouble* colors = mxGetPr(frame.colors);
+  if (find_changes(colors, mxGetNumberOfElements(frame.colors), world.colors, submission.firstColor, submission.lastColor)) {
+    submission.colorBytes.resize(world.colors.size());
+    for (size_t iClr = submission.firstColor; iClr < submission.lastColor; ++iClr)
+      submission.colorBytes[iClr] = static_cast<GLubyte>(colors[iClr] * 255);
+  }
+  else submission.firstColor = submission.lastColor = 0;
+
+  renderThread.submit();
+}
+
+/**
+  Returns the frames presented by the render thread since the last call, as a struct array.
+*/
+static mxArray* collect_presentations()
+{
+  static const char* fields[] = { "iteration", "submitted", "queueWait", "drawStart", "presented", "latency", "numSkipped" };
+  static std::vector<FramePresentation> presented;
+  presented.clear();
+  for (FramePresentation* record; (record = renderThread.presentations.front()) != 0; renderThread.presentations.pop())
+    presented.push_back(*record);
+
+  mxArray* report = mxCreateStructMatrix(1, presented.size(), sizeof(fields) / sizeof(fields[0]), fields);
+  for (size_t iFrame = 0; iFrame < presented.size(); ++iFrame) {
+    const FramePresentation& frame = presented[iFrame];
+    mxSetField(report, iFrame, "iteration", mxCreateDoubleScalar(frame.iteration));
+    mxSetField(report, iFrame, "submitted", mxCreateDoubleScalar(frame.submitted));
+    mxSetField(report, iFrame, "queueWait", mxCreateDoubleScalar(frame.queueWait));
+    mxSetField(report, iFrame, "drawStart", mxCreateDoubleScalar(frame.drawStart));
+    mxSetField(report, iFrame, "presented", mxCreateDoubleScalar(frame.presented));
+    mxSetField(report, iFrame, "latency", mxCreateDoubleScalar(frame.presented - frame.submitted));
+    mxSetField(report, iFrame, "numSkipped", mxCreateDoubleScalar(frame.numSkipped));
+  }
+  return report;
+}
+
+static void copy_colors(const mxArray* colors, GLubyte* target)
+{
+  const GLdouble* source = mxGetPr(colors);
+  const mwSize    count  = mxGetNumberOfElements(colors);
+  for (mwSize iClr = 0; iClr < count; ++iClr)
+    target[iClr] = static_cast<GLubyte>(source[iClr] * 255);
+}
+
+/**
+  Returns cursor positions, as numWindows x 2 for all windows if wind is 0.
+*/
+static mxArray* cursor_positions(int wind)
+{
+    const int firstWindow = ( wind > 0 ? wind-1 : 0 );
+    const int numCursors  = ( wind > 0 ? 1 : static_cast<int>(numWindows) );
+    mxArray* cursors = mxCreateDoubleMatrix(numCursors, 2, mxREAL);
+    double* cursorPosition = mxGetPr(cursors);
+    for (int i = 0; i < numCursors; i++) {
+        get_cursor_pos(firstWindow + i, &(cursorPosition[i]), &(cursorPosition[i + numCursors]));
+    }
+    return cursors;
+}
+
+/**
+  Returns the last key pressed and released, mouse button pressed and released, modifier keys,
+  active window and cursor position(s), as far as there are outputs for them. Callers that
+  need every event should poll with command 18 instead.
+*/
+static void return_user_input(int nlhs, mxArray *plhs[], int wind)
+{
+    int i;
+
+    poll_events();
+    int input[] = { keyPressed, keyReleased, buttonPressed, buttonReleased, modifiers, activeWindow };
+    for (i = 0; i < numWindows; i++) {
+        if (window_should_close(i)) {
+            input[0] = 256;
+        }
+    }
+    keyPressed = keyReleased = buttonPressed = buttonReleased = modifiers = activeWindow = -1;
+
+    for (i = 0; i < 6 && i < nlhs; i++) {
+        plhs[i] = mxCreateDoubleScalar(input[i]);
+    }
+    if (nlhs > 6) {
+        plhs[6] = cursor_positions(wind);
+    }
+}
+
+/**
+  Returns all input events since the last call as a numEvents x 5 matrix, with rows of
+  [time type code modifiers window].
+*/
+static mxArray* take_input_events()
+{
+    if (numDroppedEvents > 0) {
+        mexWarnMsgIdAndTxt("virmenOpenGLRoutines:input", "%d input events were dropped since they were not polled in time.", numDroppedEvents);
+        numDroppedEvents = 0;
+    }
+
+    mxArray* events = mxCreateDoubleMatrix(numInputEvents, 5, mxREAL);
+    double* column = mxGetPr(events);
+    for (int iEvent = 0; iEvent < numInputEvents; ++iEvent, ++column) {
+        const InputEvent& event = inputEvents[(firstInputEvent + iEvent) % MAX_INPUT_EVENTS];
+        column[0]                   = event.time;
+        column[numInputEvents]      = event.type;
+        column[2*numInputEvents]    = event.code;
+        column[3*numInputEvents]    = event.modifiers;
+        column[4*numInputEvents]    = event.window + 1;
+    }
+    firstInputEvent = 0;
+    numInputEvents = 0;
+    return events;
+}
+
 
 void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
@@ -214,22 +1212,23 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
     const GLFWvidmode *mode;
     GLdouble *surfaceVertices;
     GLuint *surfaceIndices;
-    GLdouble *surfaceColors;
     GLdouble *lineVertices;
     GLuint *lineIndices;
     GLdouble *lineColors;
-    mwSize colorSize;
-    double *currentKey, *currentKeyReleased, *currentButton, *currentButtonReleased, *currentModifiers, *cursorPosition, *currentWindow;
     double *background;
     double *colorSize3;
     int i;
     int wind, transformation, numVertices,numTriangles;
     double isMac;
     double *data;
-    int dims[2];
+    int dims[3];
     
     command = mxGetScalar(prhs[0]);
 
+    // Other than submitting frames and timing, commands use the contexts on this thread
+    if (command != 13 && !(command == 14 && nrhs < 2) && command != 17 && command != 18 && command != 19)
+      stop_render_thread();
+
     // Initialize window
     if (command == 0) {
         // Call cleanup code just in case the previous round was not terminated properly
@@ -238,8 +1237,22 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         // Register OpenGL termination to occur on Matlab exit
         mexAtExit(terminate);
         
-        // Create new OpenGL window
-        dummy = glfwInit();
+        // Create new OpenGL window, or offscreen framebuffers if there is no display
+        isHeadless = ( nrhs > 3 && mxGetScalar(prhs[3]) != 0 );
+        
+        // Number of ranges in the ring buffers, i.e. how many frames can be in flight; the
+        // global is only set once valid since terminate() loops over it
+        const double requestedBuffers = ( nrhs > 4 && !mxIsEmpty(prhs[4]) ) ? mxGetScalar(prhs[4]) : 3;
+        if (!(requestedBuffers >= 1 && requestedBuffers <= MAX_BUFFERS))
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:numBuffers", "Number of graphics buffers must be between 1 and %d.", MAX_BUFFERS);
+        numBuffers = static_cast<int>(requestedBuffers);
+        fenceStatistics = FenceStatistics();
+        renderQueueDepth = 0;
+        if (isHeadless)   headless_init();
+        else              dummy = glfwInit();
+        numInputEvents = 0;
+        numDroppedEvents = 0;
+        inputOrigin = timing_now();
         
         // Read in windows information
         windowInfo = mxGetPr(prhs[1]);
@@ -252,32 +1265,43 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             // Create new windows
             // Set antialiasing
             antialiasing = windowInfo[5*i+4];
-            glfwWindowHint(GLFW_SAMPLES, antialiasing);
-            
-            glfwWindowHint(GLFW_DECORATED, GL_FALSE);
             width = windowInfo[5*i+2];
             height = windowInfo[5*i+3];
-            windows[i] = glfwCreateWindow(width, height, "ViRMEn", NULL, NULL);
-            
-            glfwMakeContextCurrent(windows[i]);
+            // All contexts share objects with the first, so that geometry is uploaded once
+            if (isHeadless) {
+                headless_create_context(headlessWindows[i], i > 0 ? &headlessWindows[0] : 0);
+            }
+            else {
+                glfwWindowHint(GLFW_SAMPLES, antialiasing);
+                glfwWindowHint(GLFW_DECORATED, GL_FALSE);
+                windows[i] = glfwCreateWindow(width, height, "ViRMEn", NULL, i > 0 ? windows[0] : NULL);
+                glfwMakeContextCurrent(windows[i]);
+            }
+            currentContext = i;
             
             // Initialize OpenGL extensions for this context
             GLenum glewStatus = glewInit();
-            if (glewStatus != GLEW_OK)
+            if (glewStatus != GLEW_OK && !(isHeadless && (glewStatus == GLEW_ERROR_GLX_VERSION_11_ONLY || glewStatus == GLEW_ERROR_NO_GLX_DISPLAY)))
               mexErrMsgIdAndTxt("virmenOpenGLRoutines:init", "Failed to initialize GLEW for window %d, error: %s", i, glewGetErrorString(glewStatus));
 
-            glfwGetFramebufferSize(windows[i], &width, &height);
-            glfwSwapInterval(1);
+            if (isHeadless) {
+                headless_create_framebuffer(headlessWindows[i], width, height, antialiasing);
+            }
+            else {
+                glfwGetFramebufferSize(windows[i], &width, &height);
+                glfwSwapInterval(1);
+                swapIntervals[i] = 1;
+                
+                xpos = windowInfo[5*i];
+                ypos = windowInfo[5*i+1];
+                glfwSetWindowPos(windows[i], xpos, ypos);
+                
+                // Callbacks for keyboard press and mouse clicks
+                glfwSetKeyCallback(windows[i], key_callback);
+                glfwSetMouseButtonCallback(windows[i], mouse_callback);
+            }
             glViewport(0, 0, width, height);
             
-            xpos = windowInfo[5*i];
-            ypos = windowInfo[5*i+1];
-            glfwSetWindowPos(windows[i], xpos, ypos);
-            
-            // Callbacks for keyboard press and mouse clicks
-            glfwSetKeyCallback(windows[i], key_callback);
-            glfwSetMouseButtonCallback(windows[i], mouse_callback);
-            
             // Initialize OpenGL properties
             aspectRatio = (double)width / (double)height;
             glOrtho(-aspectRatio, aspectRatio, -1, 1, -1000, 0);  // orthographic projection
@@ -289,7 +1313,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
             
             
-            if (!isMac) {
+            if (!isMac && !isHeadless) {
                 glfwIconifyWindow(windows[i]);
                 glfwRestoreWindow(windows[i]);
             }
@@ -308,7 +1332,6 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         // Get surface arrays from Matlab
         surfaceVertices = (GLdouble *)mxGetData(prhs[1]);
         surfaceIndices = (GLuint *)mxGetData(prhs[2]);
-        surfaceColors = (GLdouble *)mxGetData(prhs[3]);
         
         // Get line arrays from Matlab
         lineVertices = (GLdouble *)mxGetData(prhs[4]);
@@ -322,41 +1345,53 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         const int worldChanged = mxGetScalar(prhs[11]) > 0;
         const int iTransform = static_cast<int>( transformation-1 );
 
+        // Compacted triangles (from virmenVisibleTriangles with counts) start at the given index,
+        // and numTriangles is the number of indices to draw instead of that per transformation.
+        // Buffers are then sized for the world, i.e. [numTriangles numVertices] in the last input.
+        const bool isCompact = nrhs > 13;
+        const int firstIndex = isCompact ? static_cast<int>( mxGetScalar(prhs[12]) ) : numTriangles*iTransform;
+        if (isCompact && numTriangles > 0 && firstIndex + numTriangles > static_cast<int>( mxGetNumberOfElements(prhs[2]) ))
+            mexErrMsgIdAndTxt("virmenOpenGLRoutines:render", "Range of %d indices starting at %d exceeds the %d compacted triangle indices."
+                             , numTriangles, firstIndex, static_cast<int>(mxGetNumberOfElements(prhs[2])));
+
         // Ensure sufficient buffer size if geometry has changed
-        if (worldChanged)   allocate_buffers(prhs[1], prhs[2], prhs[3]);
+        if (worldChanged) {
+            const double* capacity = isCompact ? mxGetPr(prhs[13]) : 0;
+            const bool hasVertices = isCompact && mxGetNumberOfElements(prhs[13]) > 1;
+            allocate_buffers( prhs[1], prhs[2], prhs[3]
+                            , isCompact   ? static_cast<GLsizei>( capacity[0] ) : 0
+                            , hasVertices ? static_cast<GLsizei>( capacity[1] ) : 0
+                            );
+        }
 
         
-        glfwMakeContextCurrent(windows[wind-1]);
+        make_current(wind-1);
+        StageTimer drawTimer(STAGE_DRAW, wind-1);
         
         // Clear the screen
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
         
-        // Determine size of the surface color matrix
-        colorSize = mxGetNumberOfElements(prhs[3]);
-
-        // Wait until GPU is no longer using buffers
-        wait_buffer(bufferRange[bufferIndex].gSync);
+        // Wait until GPU is no longer using buffers, or skip drawing if it is stalled
+        if (wait_buffer(bufferRange[bufferIndex].gSync, bufferIndex)) {
+          GLdouble* vertices = surfaceVertices + numVertices*iTransform;
+          for (int iVtx = 0; iVtx < numVertices; ++iVtx, ++vertices)
+            bufferRange[bufferIndex].vertex[iVtx]   = float( *vertices );
 
-        GLdouble* vertices = surfaceVertices + numVertices*iTransform;
-        for (int iVtx = 0; iVtx < numVertices; ++iVtx, ++vertices)
-          bufferRange[bufferIndex].vertex[iVtx]   = float( *vertices );
+          copy_colors(prhs[3], bufferRange[bufferIndex].color);
 
-        GLdouble* colors = surfaceColors;
-        for (int iClr = 0; iClr < colorSize; ++iClr, ++colors)
-          bufferRange[bufferIndex].color[iClr]    = static_cast<GLubyte>((*colors) * 255);
+          GLuint* indices = surfaceIndices + firstIndex;
+          for (int iTri = 0; iTri < numTriangles; ++iTri, ++indices)
+            bufferRange[bufferIndex].triangle[iTri] = (*indices) + bufferRange[bufferIndex].indexOffset;
 
-        GLuint* indices = surfaceIndices + numTriangles*iTransform;
-        for (int iTri = 0; iTri < numTriangles; ++iTri, ++indices)
-          bufferRange[bufferIndex].triangle[iTri] = (*indices) + bufferRange[bufferIndex].indexOffset;
+          bind_primitives_array();
+          //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangleBufferID);
 
-        //glBindVertexArray(primitivesArrayID);
-        //glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, triangleBufferID);
+          glDrawElements(GL_TRIANGLES, numTriangles, GL_UNSIGNED_INT, bufferRange[bufferIndex].triOffset);
+          //glDrawElementsBaseVertex(GL_TRIANGLES, numTriangles, GL_UNSIGNED_INT, bufferRange[bufferIndex].triOffset, bufferRange[bufferIndex].indexOffset);
 
-        glDrawElements(GL_TRIANGLES, numTriangles, GL_UNSIGNED_INT, bufferRange[bufferIndex].triOffset);
-        //glDrawElementsBaseVertex(GL_TRIANGLES, numTriangles, GL_UNSIGNED_INT, bufferRange[bufferIndex].triOffset, bufferRange[bufferIndex].indexOffset);
-
-        lock_buffer(bufferRange[bufferIndex].gSync);
-        bufferIndex = (bufferIndex + 1) % NUM_BUFFERS;
+          lock_buffer(bufferRange[bufferIndex].gSync);
+          bufferIndex = (bufferIndex + 1) % numBuffers;
+        }
         
 
         //// Determine size of the line color matrix
@@ -373,67 +1408,41 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         
         // Let GPU work on this window
         glFlush();
+        drawTimer.stop();
 
         
-        // Return current pressed key
-        glfwPollEvents();
-        plhs[0] = mxCreateDoubleMatrix(1, 1, mxREAL);
-        currentKey = mxGetPr(plhs[0]);
-        
-        currentKey[0] = keyPressed;
-        for (i = 0; i < numWindows; i++) {
-            if (glfwWindowShouldClose(windows[i])) {
-                currentKey[0] = 256;
-            }
-        }
-        keyPressed = -1;
-        
-        // Return current clicked mouse button
-        plhs[1] = mxCreateDoubleMatrix(1, 1, mxREAL);
-        currentKeyReleased = mxGetPr(plhs[1]);
-        currentKeyReleased[0] = keyReleased;
-        keyReleased = -1;
-        
-        // Return current clicked mouse button
-        plhs[2] = mxCreateDoubleMatrix(1, 1, mxREAL);
-        currentButton = mxGetPr(plhs[2]);
-        currentButton[0] = buttonPressed;
-        buttonPressed = -1;
-        
-        // Return current clicked mouse button
-        plhs[3] = mxCreateDoubleMatrix(1, 1, mxREAL);
-        currentButtonReleased = mxGetPr(plhs[3]);
-        currentButtonReleased[0] = buttonReleased;
-        buttonReleased = -1;
-        
-        // Return modifier keys that are currently pressed
-        plhs[4] = mxCreateDoubleMatrix(1, 1, mxREAL);
-        currentModifiers = mxGetPr(plhs[4]);
-        currentModifiers[0] = modifiers;
-        modifiers = -1;
-        
-        // Return current window
-        plhs[5] = mxCreateDoubleMatrix(1, 1, mxREAL);
-        currentWindow = mxGetPr(plhs[5]);
-        currentWindow[0] = activeWindow;
-        activeWindow = -1;
-        
-        // Return cursor position
-        plhs[6] = mxCreateDoubleMatrix(1, 2, mxREAL);
-        cursorPosition = mxGetPr(plhs[6]);
-        glfwGetCursorPos(windows[wind-1], &(cursorPosition[0]), &(cursorPosition[1]));
+        // Return user input (keyboard and mouse)
+        return_user_input(nlhs, plhs, wind);
 
 
         // Swap buffers at the end since this blocks until the next vsync
-        glfwSwapBuffers(windows[wind-1]);
+        swap_buffers(wind-1);
     }
     
     // Terminate window
     else if (command == 2) {
+        // Release per-world buffers while their context still exists
+        if (numWindows > 0) {
+            make_current(0);
+            delete_projection_programs();
+            delete_all_world_buffers();
+            delete_buffers();
+        }
+        
+        // Finish writing captured frames
+        for (i = 0; i < numWindows; i++) {
+            if (frameCaptures[i].isActive()) {
+                make_current(i);
+                frameCaptures[i].stop();
+            }
+        }
+        
         // Destroy window
         for (i = 0; i < numWindows; i++) {
-            glfwDestroyWindow(windows[i]);
+            destroy_window(i);
         }
+        numWindows = 0;
+        currentContext = -1;
         
         // Delete buffers and terminate GLFW
         terminate();
@@ -444,7 +1453,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         // Get color matrix size (3 or 4) from Matlab
         colorSize3 = mxGetPr(prhs[1]);
         for (i = 0; i < numWindows; i++) {
-            glfwMakeContextCurrent(windows[i]);
+            make_current(i);
             if (colorSize3[0] == 3) {
                 glDisable(GL_BLEND);
             }
@@ -453,7 +1462,7 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
             }
         }
         glFlush();
-        glfwPollEvents();
+        poll_events();
     }
     
     // Change background color
@@ -461,18 +1470,18 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         // Get background color
         background = mxGetPr(prhs[1]);
         for (i = 0; i < numWindows; i++) {
-            glfwMakeContextCurrent(windows[i]);
+            make_current(i);
             glClearColor(background[0], background[1], background[2], 0.0);
         }
         glFlush();
-        glfwPollEvents();
+        poll_events();
     }
     
     // Get pixel data
     else if (command == 5) {
         wind = mxGetScalar(prhs[1]);
-        glfwMakeContextCurrent(windows[wind-1]);
-        glfwGetFramebufferSize(windows[wind-1], &width, &height);
+        make_current(wind-1);
+        get_framebuffer_size(wind-1, &width, &height);
         
         // allocate space to store the pixels
         dims[0] = 3;
@@ -482,8 +1491,337 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
         
         data = mxGetPr(plhs[0]);
         
+        if (isHeadless)   headless_read_displayed(headlessWindows[wind-1]);
         glReadPixels(0, 0, width, height, GL_RGB, GL_FLOAT, data);
+        if (isHeadless)   make_current(wind-1);
       
     }
+    
+    // Register world geometry (triangulation and colors)
+    else if (command == 6) {
+        const int iWorld = static_cast<int>( mxGetScalar(prhs[1]) ) - 1;
+        if (numWindows < 1)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:registerWorld", "OpenGL must be initialized (command 0) before registering worlds.");
+        framePipeline.registerWorld(iWorld, prhs[2], prhs[3]);
+
+        const ResidentWorld& world = framePipeline.world(iWorld);
+        make_current(0);
+        register_world_buffers(iWorld, world.numVertices, world.numTriangles, prhs[4]);
+        update_world_colors(worldBuffers[iWorld], prhs[4]);
+    }
+    
+    // Select projections to be performed on the GPU, or none for the CPU path
+    else if (command == 8) {
+        if (numWindows < 1)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:projection", "OpenGL must be initialized (command 0) before selecting a projection.");
+
+        // One projection per transformation, as a string or cell array of strings
+        std::vector<std::string> names;
+        if (mxIsCell(prhs[1])) {
+          for (size_t iName = 0; iName < mxGetNumberOfElements(prhs[1]); ++iName) {
+            char* name = mxArrayToString(mxGetCell(prhs[1], iName));
+            names.push_back(name ? name : "");
+            mxFree(name);
+          }
+        }
+        else {
+          char* name = mxArrayToString(prhs[1]);
+          if (name && name[0])  names.push_back(name);
+          mxFree(name);
+        }
+
+        // Rig-specific constants, e.g. for the parametrized toroidal projection
+        std::fill(projectionParameters, projectionParameters + 4, 0.f);
+        if (nrhs > 2)
+          for (size_t iPar = 0; iPar < mxGetNumberOfElements(prhs[2]) && iPar < 4; ++iPar)
+            projectionParameters[iPar] = static_cast<GLfloat>(mxGetPr(prhs[2])[iPar]);
+
+        make_current(0);
+        projectionPrograms.clear();
+        for (size_t iName = 0; iName < names.size(); ++iName)
+          if (!names[iName].empty() && !find_shader_projection(names[iName].c_str()))
+            mexErrMsgIdAndTxt("virmenOpenGLRoutines:projection", "No GPU implementation available for projection '%s'.", names[iName].c_str());
+
+        bool isComplete = true;
+        projectionPrograms.resize(names.size());
+        for (size_t iName = 0; iName < names.size(); ++iName) {
+          if (names[iName].empty())   continue;
+          ProjectionProgram& projection = projectionPrograms[iName];
+          projection.program = get_projection_program(names[iName]);
+          if (projection.program > 0) {
+            projection.animalPosition = glGetUniformLocation(projection.program, "animalPosition");
+            projection.parameters = glGetUniformLocation(projection.program, "projectionParameters");
+          }
+          else isComplete = false;
+        }
+        
+        // Return whether all requested projections are in use
+        if (nlhs > 0)
+          plhs[0] = mxCreateLogicalScalar(isComplete);
+    }
+    
+    // Render a world using both the CPU and GPU projections, and return how much they differ
+    else if (command == 9) {
+        WorldFrame frame;
+        WorldBuffers& world = get_world_frame(frame, prhs, 1);
+        wind = mxGetScalar(prhs[8]);
+        frame.transformation = static_cast<int>( mxGetScalar(prhs[9]) );
+        frame.iteration = mxGetNaN();         // forces geometry to be recomputed
+
+        const ProjectionProgram* projection = find_projection_program(frame.transformation);
+        if (!projection)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:projection", "No GPU projection has been selected (command 8) for transformation %d.", frame.transformation);
+
+        make_current(wind-1);
+        int width, height;
+        get_framebuffer_size(wind-1, &width, &height);
+
+        std::vector<GLubyte> cpuPixels, gpuPixels;
+        render_offscreen(world, frame, 0         , width, height, cpuPixels);
+        render_offscreen(world, frame, projection, width, height, gpuPixels);
+
+        // Maximum difference in any color channel, and number of pixels that differ at all
+        int maxDifference = 0;
+        int numDiffering = 0;
+        for (size_t iPix = 0; iPix < cpuPixels.size(); iPix += 4) {
+          int difference = 0;
+          for (int iClr = 0; iClr < 3; ++iClr)
+            difference = std::max(difference, std::abs(cpuPixels[iPix + iClr] - gpuPixels[iPix + iClr]));
+          maxDifference = std::max(maxDifference, difference);
+          if (difference > 0)   ++numDiffering;
+        }
+
+        plhs[0] = mxCreateDoubleScalar(maxDifference);
+        if (nlhs > 1)
+          plhs[1] = mxCreateDoubleScalar(numDiffering);
+
+        // Images as height x width x 3, top row first
+        for (int iOut = 2; iOut < nlhs && iOut < 4; ++iOut) {
+          const std::vector<GLubyte>& pixels = ( iOut == 2 ? cpuPixels : gpuPixels );
+          mwSize dims[] = {static_cast<mwSize>(height), static_cast<mwSize>(width), 3};
+          plhs[iOut] = mxCreateNumericArray(3, dims, mxUINT8_CLASS, mxREAL);
+          GLubyte* image = static_cast<GLubyte*>(mxGetData(plhs[iOut]));
+          for (int iClr = 0; iClr < 3; ++iClr)
+            for (int x = 0; x < width; ++x)
+              for (int y = 0; y < height; ++y)
+                image[(iClr*width + x)*height + (height-1 - y)] = pixels[4*(y*width + x) + iClr];
+        }
+    }
+    
+    // Start recording every frame presented in a window, optionally streaming to a raw file
+    else if (command == 10) {
+        wind = mxGetScalar(prhs[1]);
+        const int numCaptureBuffers = ( nrhs > 2 && !mxIsEmpty(prhs[2]) ) ? static_cast<int>(mxGetScalar(prhs[2])) : 3;
+        char* fileName = ( nrhs > 3 && mxIsChar(prhs[3]) ) ? mxArrayToString(prhs[3]) : 0;
+        if (wind < 1 || wind > numWindows)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:capture", "Invalid window %d for capture, must be 1 to %d.", wind, static_cast<int>(numWindows));
+        
+        make_current(wind-1);
+        get_framebuffer_size(wind-1, &width, &height);
+        frameCaptures[wind-1].start(width, height, numCaptureBuffers, fileName);
+        mxFree(fileName);
+    }
+    
+    // Return captured frames that have completed so far (3 x width x height x nFrames uint8)
+    else if (command == 11) {
+        wind = mxGetScalar(prhs[1]);
+        if (wind < 1 || wind > numWindows)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:capture", "Invalid window %d for capture, must be 1 to %d.", wind, static_cast<int>(numWindows));
+        FrameCapture& capture = frameCaptures[wind-1];
+        if (capture.isActive()) {
+          make_current(wind-1);
+          capture.collect(false);
+        }
+        plhs[0] = capture.takeFrames(nlhs > 1 ? &plhs[1] : 0);
+    }
+    
+    // Stop capture, returning all remaining frames and the total number of frames captured
+    else if (command == 12) {
+        wind = mxGetScalar(prhs[1]);
+        if (wind < 1 || wind > numWindows)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:capture", "Invalid window %d for capture, must be 1 to %d.", wind, static_cast<int>(numWindows));
+        FrameCapture& capture = frameCaptures[wind-1];
+        if (capture.isActive()) {
+          make_current(wind-1);
+          capture.collect(true);
+        }
+        plhs[0] = capture.takeFrames(nlhs > 1 ? &plhs[1] : 0);
+        if (nlhs > 2)
+          plhs[2] = mxCreateDoubleScalar(capture.count());
+        capture.stop();
+    }
+    
+    // Start timing a frame, given the durations of stages measured in Matlab (see virmenFrameTiming.h)
+    else if (command == 13) {
+        frameTiming.beginFrame(mxGetScalar(prhs[1]), nrhs > 2 ? mxGetPr(prhs[2]) : 0, nrhs > 2 ? mxGetNumberOfElements(prhs[2]) : 0);
+    }
+    
+    // Return timing of recorded frames as a struct array, or (re)allocate storage for the given number of frames
+    else if (command == 14) {
+        if (nrhs > 1)
+          frameTiming.configure(static_cast<size_t>(mxGetScalar(prhs[1])));
+        if (nlhs > 0 || nrhs < 2)
+          plhs[0] = frameTiming.report();
+    }
+    
+    // Return fence wait statistics, or set the timeout (in seconds) and whether to skip drawing when the GPU is stalled
+    else if (command == 15) {
+        if (nrhs > 1) {
+          fenceTimeout = static_cast<GLuint64>( 1e9 * mxGetScalar(prhs[1]) );
+          skipStalledFrames = ( nrhs > 2 && mxGetScalar(prhs[2]) != 0 );
+          fenceStatistics = FenceStatistics();
+        }
+        if (nlhs > 0 || nrhs < 2)
+          plhs[0] = fence_statistics();
+    }
+    
+    // Render a world into all windows, each with its own transformation (NaN for none), then present them together
+    else if (command == 16) {
+        WorldFrame frame;
+        WorldBuffers& world = get_world_frame(frame, prhs, 1);
+        
+        const double* windowTransformations = mxGetPr(prhs[8]);
+        if (mxGetNumberOfElements(prhs[8]) != numWindows)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:framePipeline", "Transformations (%d) must be specified for each of the %d windows.", static_cast<int>(mxGetNumberOfElements(prhs[8])), static_cast<int>(numWindows));
+        frame.iteration = mxGetScalar(prhs[9]);
+        
+        // Draw all windows before presenting any, so that none waits for the vsync of another
+        for (i = 0; i < numWindows; i++) {
+            make_current(i);
+            StageTimer drawTimer(STAGE_DRAW, i);
+            glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+            
+            if (!mxIsNaN(windowTransformations[i]) && windowTransformations[i] >= 1) {
+                frame.transformation = static_cast<int>(windowTransformations[i]);
+                const ProjectionProgram* projection = find_projection_program(frame.transformation);
+                if (projection)   draw_world_gpu(world, frame, *projection);
+                else              draw_world_cpu(world, frame);
+            }
+            glFlush();
+        }
+        
+        // Return user input (keyboard and mouse), with cursor positions for all windows
+        return_user_input(nlhs, plhs, 0);
+        
+        // The first window blocks until vsync, the others are presented right after
+        for (i = 0; i < numWindows; i++) {
+            make_current(i);
+            swap_buffers(i, i == 0);
+        }
+    }
+    
+    // Submit a frame to be rendered into all windows by the render thread, with the same inputs
+    // and outputs as command 16 plus the frames presented since the last submission. Also
+    // (17, queueDepth) to enable threaded rendering (0 to disable), or (17) to only collect
+    // presented frames
+    else if (command == 17) {
+        if (nrhs == 2) {
+            stop_render_thread();
+            const double depth = mxGetScalar(prhs[1]);
+            if (depth < 0 || depth > 16)
+              mexErrMsgIdAndTxt("virmenOpenGLRoutines:renderThread", "Render queue depth must be between 0 and 16.");
+            renderQueueDepth = static_cast<int>(depth);
+            if (renderQueueDepth > 0)         // otherwise keep presented frames until collected
+              renderThread.configure(renderQueueDepth);
+        }
+        else if (nrhs == 1) {
+            plhs[0] = collect_presentations();
+        }
+        else {
+            if (renderQueueDepth < 1)
+              mexErrMsgIdAndTxt("virmenOpenGLRoutines:renderThread", "Threaded rendering must be enabled with virmenOpenGLRoutines(17, queueDepth) before submitting frames.");
+            WorldFrame frame;
+            WorldBuffers& world = get_world_frame(frame, prhs, 1);
+            
+            const double* windowTransformations = mxGetPr(prhs[8]);
+            if (mxGetNumberOfElements(prhs[8]) != numWindows)
+              mexErrMsgIdAndTxt("virmenOpenGLRoutines:framePipeline", "Transformations (%d) must be specified for each of the %d windows.", static_cast<int>(mxGetNumberOfElements(prhs[8])), static_cast<int>(numWindows));
+            for (i = 0; i < numWindows; i++)
+              if (!mxIsNaN(windowTransformations[i]) && find_projection_program(static_cast<int>(windowTransformations[i])))
+                mexErrMsgIdAndTxt("virmenOpenGLRoutines:renderThread", "Projections on the GPU are not supported with threaded rendering.");
+            frame.iteration = mxGetScalar(prhs[9]);
+            
+            submit_frame(world, frame, windowTransformations);
+            
+            // User input is polled on this thread, as required by GLFW
+            return_user_input(nlhs, plhs, 0);
+            if (nlhs > 7)
+              plhs[7] = collect_presentations();
+        }
+    }
+    
+    // Upload only the given objects of a registered world, i.e. (19, world, vertices, colors,
+    // visible, vertexRanges, colorRanges, triangleRanges) where ranges are rows of
+    // vr.worlds{}.objects.vertices for the first two and of .triangles for the last
+    else if (command == 19) {
+        if (nrhs < 8)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:updateObjects", "Usage: virmenOpenGLRoutines(19, world, vertices, colors, visible, vertexRanges, colorRanges, triangleRanges).");
+        const int iWorld = static_cast<int>( mxGetScalar(prhs[1]) ) - 1;
+        if (!framePipeline.isRegistered(iWorld) || iWorld >= static_cast<int>(worldBuffers.size()))
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:updateObjects", "World %d must be registered (command 6) before objects can be updated.", iWorld + 1);
+        WorldBuffers& world = worldBuffers[iWorld];
+        if (mxGetN(prhs[3]) != world.numVertices || mxGetM(prhs[3]) != world.nColorDims || mxGetN(prhs[2]) != world.numVertices)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:updateObjects", "Vertices and colors must have the size with which world %d was registered; the world should be marked as changed.", iWorld + 1);
+        if (!mxIsLogical(prhs[4]) || mxGetNumberOfElements(prhs[4]) != world.numTriangles)
+          mexErrMsgIdAndTxt("virmenOpenGLRoutines:updateObjects", "Visibility flags must be a logical array with one entry per triangle (%d).", world.numTriangles);
+        
+        update_world_objects(iWorld, world, prhs[2], prhs[3], prhs[4], prhs[5], prhs[6], prhs[7]);
+    }
+    
+    // Poll keyboard and mouse events since the last call, as a numEvents x 5 matrix of
+    // [time type code modifiers window] where type is 1/2 for a key press/release and 3/4 for
+    // a mouse button press/release. Also returns cursor positions of all windows and the frames
+    // presented by the render thread since the last call
+    else if (command == 18) {
+        poll_events();
+        for (i = 0; i < numWindows; i++) {
+            if (window_should_close(i)) {
+                push_input_event(KEY_PRESS, GLFW_KEY_ESCAPE, 0, windows[i]);
+            }
+        }
+        plhs[0] = take_input_events();
+        if (nlhs > 1)   plhs[1] = cursor_positions(0);
+        if (nlhs > 2)   plhs[2] = collect_presentations();
+    }
+    
+    // Render directly from world coordinates (virmenFramePipeline)
+    else if (command == 7) {
+        WorldFrame frame;
+        WorldBuffers& world = get_world_frame(frame, prhs, 1);
+        
+        // Get line arrays from Matlab
+        lineVertices = (GLdouble *)mxGetData(prhs[8]);
+        lineIndices = (GLuint *)mxGetData(prhs[9]);
+        lineColors = (GLdouble *)mxGetData(prhs[10]);
+        
+        wind = mxGetScalar(prhs[11]);
+        transformation = mxGetScalar(prhs[12]);
+        frame.transformation = transformation;
+        frame.iteration = mxGetScalar(prhs[13]);
+
+        
+        make_current(wind-1);
+        StageTimer drawTimer(STAGE_DRAW, wind-1);
+        
+        // Clear the screen
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+
+        // Camera transform and projection on the GPU if available for this transformation
+        const ProjectionProgram* projection = find_projection_program(transformation);
+        if (projection)   draw_world_gpu(world, frame, *projection);
+        else              draw_world_cpu(world, frame);
+        
+        // Let GPU work on this window
+        glFlush();
+        drawTimer.stop();
+
+        
+        // Return user input (keyboard and mouse)
+        return_user_input(nlhs, plhs, wind);
+
+
+        // Swap buffers at the end since this blocks until the next vsync
+        swap_buffers(wind-1);
+    }
 
 }
\ No newline at end of file
@@ -0,0 +1,105 @@
+#include "mex.h"
+#include <stdint.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "virmenDepthSort.h"
+
+/*
+    sorted = virmenOrderTriangles(triangles, numTriangles, numTrans, ord)
+        Reorders the triangles (3 x numTriangles x numTrans, int32 or uint32) of each
+        transformation as triangles(:,ord,:), where ord holds 1-based indices.
+
+    sorted = virmenOrderTriangles(triangles, numTriangles, numTrans, dist, triangulation)
+        Same for the back-to-front order, i.e. that of sort(virmenTrianglesDistance(dist,
+        triangulation), 'descend'), computed here without an intermediate order array.
+*/
+
+struct DepthGreater {
+    const std::vector<double>&  depth;
+    DepthGreater(const std::vector<double>& depth) : depth(depth) {}
+    bool operator()(uint32_t a, uint32_t b) const {
+        // NaN is larger than any number, as in Matlab
+        return (std::isnan(depth[a]) && !std::isnan(depth[b])) || depth[a] > depth[b];
+    }
+};
+
+template<typename Index>
+static void back_to_front(const mxArray* distance, const mxArray* triangulation, mwSize numTriangles, std::vector<uint32_t>& order)
+{
+    const double*   dist        = mxGetPr(distance);
+    const mwSize    numVertices = mxGetNumberOfElements(distance);
+    const Index*    tria        = static_cast<const Index*>(mxGetData(triangulation));
+    if (mxGetN(triangulation) != numTriangles)
+        mexErrMsgIdAndTxt("virmenOrderTriangles:triangulation", "Triangulation must have numTriangles (%d) columns.", static_cast<int>(numTriangles));
+
+    std::vector<double> depth(numTriangles);
+    order.resize(numTriangles);
+    for (mwSize i = 0; i < numTriangles; i++) {
+        if (static_cast<mwSize>(tria[3*i]) >= numVertices || static_cast<mwSize>(tria[3*i+1]) >= numVertices || static_cast<mwSize>(tria[3*i+2]) >= numVertices)
+            mexErrMsgIdAndTxt("virmenOrderTriangles:triangulation", "Vertex indices of triangle %d exceed the number of distances (%d).", static_cast<int>(i+1), static_cast<int>(numVertices));
+        depth[i] = nearest_vertex(dist, tria + 3*i);
+        order[i] = static_cast<uint32_t>(i);
+    }
+    std::stable_sort(order.begin(), order.end(), DepthGreater(depth));
+}
+
+template<typename Index>
+static void gather(const mxArray* triangles, mwSize numTriangles, mwSize numTrans, const std::vector<uint32_t>& order, mxArray* output)
+{
+    const Index*    source      = static_cast<const Index*>(mxGetData(triangles));
+    Index*          sorted      = static_cast<Index*>(mxGetData(output));
+    for (mwSize d = 0; d < numTrans; d++) {
+        for (mwSize i = 0; i < numTriangles; i++) {
+            const mwSize indx = 3*order[i];
+            sorted[3*numTriangles*d+3*i] = source[3*numTriangles*d+indx];
+            sorted[3*numTriangles*d+3*i+1] = source[3*numTriangles*d+indx+1];
+            sorted[3*numTriangles*d+3*i+2] = source[3*numTriangles*d+indx+2];
+        }
+    }
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if (nrhs < 4)
+        mexErrMsgIdAndTxt("virmenOrderTriangles:arguments", "Usage: virmenOrderTriangles(triangles, numTriangles, numTrans, ord) or (triangles, numTriangles, numTrans, dist, triangulation).");
+
+    const mxClassID classID     = mxGetClassID(prhs[0]);
+    const mwSize    numTriangles= static_cast<mwSize>(mxGetScalar(prhs[1]));
+    const mwSize    numTrans    = static_cast<mwSize>(mxGetScalar(prhs[2]));
+    if (classID != mxINT32_CLASS && classID != mxUINT32_CLASS)
+        mexErrMsgIdAndTxt("virmenOrderTriangles:arguments", "Triangles must be of type int32 or uint32.");
+    if (mxGetNumberOfElements(prhs[0]) < 3*numTriangles*numTrans)
+        mexErrMsgIdAndTxt("virmenOrderTriangles:arguments", "Triangles must have at least 3 x %d x %d elements.", static_cast<int>(numTriangles), static_cast<int>(numTrans));
+
+    // Order as 0-based indices
+    std::vector<uint32_t> order;
+    if (nrhs > 4) {
+        switch (mxGetClassID(prhs[4])) {
+        case mxINT32_CLASS:     back_to_front<int32_t >(prhs[3], prhs[4], numTriangles, order);  break;
+        case mxUINT32_CLASS:    back_to_front<uint32_t>(prhs[3], prhs[4], numTriangles, order);  break;
+        default:
+            mexErrMsgIdAndTxt("virmenOrderTriangles:arguments", "Triangulation must be of type int32 or uint32.");
+        }
+    }
+    else {
+        const double* ord = mxGetPr(prhs[3]);
+        if (!mxIsDouble(prhs[3]) || mxGetNumberOfElements(prhs[3]) < numTriangles)
+            mexErrMsgIdAndTxt("virmenOrderTriangles:arguments", "ord must be a double array with at least %d elements.", static_cast<int>(numTriangles));
+        order.resize(numTriangles);
+        for (mwSize i = 0; i < numTriangles; i++) {
+            if (!(ord[i] >= 1 && ord[i] <= numTriangles))
+                mexErrMsgIdAndTxt("virmenOrderTriangles:arguments", "ord(%d) = %g is not a valid triangle index.", static_cast<int>(i+1), ord[i]);
+            order[i] = static_cast<uint32_t>(ord[i]) - 1;
+        }
+    }
+
+    mwSize dims[3];
+    dims[0] = 3;
+    dims[1] = numTriangles;
+    dims[2] = numTrans;
+    plhs[0] = mxCreateNumericArray(3, dims, classID, mxREAL);
+
+    if (classID == mxINT32_CLASS)   gather<int32_t >(prhs[0], numTriangles, numTrans, order, plhs[0]);
+    else                            gather<uint32_t>(prhs[0], numTriangles, numTrans, order, plhs[0]);
+}
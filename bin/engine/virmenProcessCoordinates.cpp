@@ -0,0 +1,40 @@
+#include <cstring>
+#include "mex.h"
+#include "virmenCoordinates.h"
+
+
+/**
+  [vertexArray, distance] = virmenProcessCoordinates(vertices, position, outputClass, numThreads)
+
+  Vertices relative to the animal position and rotated by its heading, and their distance from
+  it. outputClass is 'double' (default) or 'single'. numThreads = 0 (default) splits large worlds
+  over threads automatically; 1 forces a single thread.
+*/
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]) {
+    if (nrhs < 2 || !mxIsDouble(prhs[0]) || mxGetM(prhs[0]) != 3 || !mxIsDouble(prhs[1]) || mxGetNumberOfElements(prhs[1]) < 4)
+        mexErrMsgIdAndTxt("virmenProcessCoordinates:arguments", "Usage: virmenProcessCoordinates(vertices (3 x N double), position (1 x 4 double), [outputClass], [numThreads]).");
+
+    bool isSingle = false;
+    if (nrhs > 2 && !mxIsEmpty(prhs[2])) {
+        char outputClass[8];
+        if (mxGetString(prhs[2], outputClass, sizeof(outputClass)) != 0 || (strcmp(outputClass, "single") != 0 && strcmp(outputClass, "double") != 0))
+            mexErrMsgIdAndTxt("virmenProcessCoordinates:arguments", "outputClass must be 'double' or 'single'.");
+        isSingle = strcmp(outputClass, "single") == 0;
+    }
+    unsigned numThreads = 0;
+    if (nrhs > 3 && !mxIsEmpty(prhs[3]))
+        numThreads = static_cast<unsigned>(std::max(0.0, mxGetScalar(prhs[3])));
+
+    const mwSize ncols = mxGetN(prhs[0]);
+    const double* coord3 = mxGetPr(prhs[0]);
+    const double* pos = mxGetPr(prhs[1]);
+
+    const mxClassID classID = isSingle ? mxSINGLE_CLASS : mxDOUBLE_CLASS;
+    plhs[0] = mxCreateNumericMatrix(3, ncols, classID, mxREAL);
+    plhs[1] = mxCreateNumericMatrix(1, ncols, classID, mxREAL);
+
+    if (isSingle)
+        coordinates::relative(coord3, static_cast<float*>(mxGetData(plhs[0])), static_cast<float*>(mxGetData(plhs[1])), ncols, pos, numThreads);
+    else
+        coordinates::relative(coord3, mxGetPr(plhs[0]), mxGetPr(plhs[1]), ncols, pos, numThreads);
+}
@@ -0,0 +1,28 @@
+function frames = virmenReadCapture(fileName, range)
+% frames = virmenReadCapture(fileName, [range])
+%   Reads frames recorded by virmenCaptureFrames('start', w, fileName) as a
+%   height x width x 3 x nFrames uint8 array, with the same orientation as virmenGetFrame().
+%   If range = [first last] is given, only those (1-based) frames are read.
+
+fid = fopen(fileName, 'r');
+if fid < 0
+  error('virmenReadCapture:file', 'Could not open %s.', fileName);
+end
+cleanup = onCleanup(@() fclose(fid));
+
+magic = fread(fid, [1 8], '*char');
+if ~strcmp(magic, 'VRMNRGB8')
+  error('virmenReadCapture:format', '%s is not a ViRMEn capture file.', fileName);
+end
+frameSize = fread(fid, [1 2], 'int32');
+frameBytes = 3 * prod(frameSize);
+
+if nargin < 2
+  range = [1 inf];
+end
+fseek(fid, (range(1)-1) * frameBytes, 'cof');
+data = fread(fid, frameBytes * (range(2)-range(1)+1), '*uint8');
+numFrames = floor(numel(data) / frameBytes);
+
+frames = reshape(data(1:numFrames*frameBytes), [3 frameSize numFrames]);
+frames = permute(frames, [3 2 1 4]);
@@ -0,0 +1,250 @@
+#ifndef VIRMENRENDERTHREAD_H
+#define VIRMENRENDERTHREAD_H
+
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "virmenFrameTiming.h"
+
+
+/**
+  Bounded queue between exactly one producer and one consumer thread, which never locks or
+  allocates: slots are preallocated and reused, so that elements owning buffers keep their
+  capacity from frame to frame. The producer fills the slot returned by back() and publishes it
+  with push(); the consumer reads front() and releases it with pop().
+*/
+template<typename T>
+class SpscQueue
+{
+protected:
+  std::vector<T>              slots;                          // one more than the capacity
+  std::atomic<size_t>         head;                           // next slot to be read
+  std::atomic<size_t>         tail;                           // next slot to be written
+
+public:
+  SpscQueue() : head(0), tail(0) { }
+
+  /// Must not be called while either thread is using the queue
+  void reset(size_t capacity)
+  {
+    slots.resize(capacity + 1);
+    head.store(0);
+    tail.store(0);
+  }
+
+  bool empty() const
+  {
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_acquire);
+  }
+
+  /// Slot to be filled by the producer, or null if the queue is full
+  T* back()
+  {
+    const size_t              iTail         = tail.load(std::memory_order_relaxed);
+    if (slots.empty() || (iTail + 1) % slots.size() == head.load(std::memory_order_acquire))
+      return 0;
+    return &slots[iTail];
+  }
+
+  void push()
+  {
+    tail.store((tail.load(std::memory_order_relaxed) + 1) % slots.size(), std::memory_order_release);
+  }
+
+  /// Oldest slot published by the producer, or null if the queue is empty
+  T* front()
+  {
+    const size_t              iHead         = head.load(std::memory_order_relaxed);
+    if (iHead == tail.load(std::memory_order_acquire))
+      return 0;
+    return &slots[iHead];
+  }
+
+  void pop()
+  {
+    head.store((head.load(std::memory_order_relaxed) + 1) % slots.size(), std::memory_order_release);
+  }
+};
+
+
+/**
+  Projected geometry of one window, with triangle indices relative to its own vertices.
+*/
+struct WindowSubmission {
+  int                         transformation;                 // 0 to only clear the window
+  GLsizei                     numIndices;
+  std::vector<GLfloat>        vertices;
+  std::vector<GLuint>         triangles;
+};
+
+/**
+  Everything needed to draw a frame of a registered world into all windows, copied out of Matlab
+  arrays so that the engine can continue while the frame is rendered.
+*/
+struct FrameSubmission {
+  int                         iWorld;
+  double                      iteration;
+  double                      submitted;
+  double                      queueWait;                      // blocked because the queue was full
+  size_t                      firstColor;                     // range of colorBytes that changed
+  size_t                      lastColor;
+  std::vector<GLubyte>        colorBytes;
+  std::vector<WindowSubmission>   windows;
+};
+
+/**
+  Times (in seconds since threaded rendering was enabled) at which a frame was handled.
+*/
+struct FramePresentation {
+  double                      iteration;
+  double                      submitted;
+  double                      queueWait;
+  double                      drawStart;
+  double                      presented;                      // buffer swap of the first window returned
+  double                      numSkipped;                     // draws dropped because the GPU stalled
+};
+
+
+/**
+  Native thread that owns the OpenGL contexts of all windows and presents frames submitted by
+  the engine (Matlab) thread, so that the latter does not block until vsync. A submission that
+  finds the queue full waits for the render thread, which bounds the latency to the queue
+  depth. Presentation times are passed back through a second queue.
+
+  The contexts must not be current on the engine thread while the render thread is running;
+  release is called on the render thread once it has presented all frames and is stopping.
+*/
+class RenderThread
+{
+public:
+  typedef void (*RenderFunction)(FrameSubmission& frame, FramePresentation& presentation);
+  typedef void (*ReleaseFunction)();
+
+  SpscQueue<FrameSubmission>      submissions;
+  SpscQueue<FramePresentation>    presentations;
+
+protected:
+  std::thread                 thread;
+  std::atomic<bool>           stopping;
+  std::atomic<size_t>         numDropped;                     // presentations not collected in time
+  std::mutex                  mutex;                          // only to sleep until the other thread is done
+  std::condition_variable     changed;
+  RenderFunction              render;
+  ReleaseFunction             release;
+  double                      origin;
+
+
+public:
+  RenderThread() : stopping(false), numDropped(0), render(0), release(0), origin(0) { }
+  ~RenderThread()             { stop(); }
+
+  bool isRunning() const      { return thread.joinable(); }
+  bool isRenderThread() const { return isRunning() && std::this_thread::get_id() == thread.get_id(); }
+  double now() const          { return timing_now() - origin; }
+  size_t dropped() const      { return numDropped.load(); }
+
+
+  /**
+    Allocates the queues for the given number of frames in flight, discarding any that were not
+    collected. Must not be called while running.
+  */
+  void configure(size_t queueDepth)
+  {
+    submissions.reset(queueDepth);
+    presentations.reset(4 * queueDepth + 16);
+    numDropped                = 0;
+    origin                    = timing_now();
+  }
+
+  void start(RenderFunction renderFrame, ReleaseFunction releaseContext)
+  {
+    if (isRunning())
+      return;
+    render                    = renderFrame;
+    release                   = releaseContext;
+    stopping                  = false;
+    thread                    = std::thread(&RenderThread::run, this);
+  }
+
+  /**
+    Returns once all submitted frames have been presented.
+  */
+  void stop()
+  {
+    if (!isRunning())
+      return;
+    stopping                  = true;
+    notify();
+    thread.join();
+    stopping                  = false;
+  }
+
+  /**
+    Slot for the next frame, waiting for the render thread if the queue is full.
+  */
+  FrameSubmission* beginSubmit()
+  {
+    FrameSubmission*          frame         = submissions.back();
+    const double              start         = now();
+    if (!frame) {
+      std::unique_lock<std::mutex>  lock(mutex);
+      while (!(frame = submissions.back()))
+        changed.wait(lock);
+    }
+    frame->queueWait          = now() - start;
+    return frame;
+  }
+
+  void submit()
+  {
+    submissions.back()->submitted = now();
+    submissions.push();
+    notify();
+  }
+
+
+protected:
+  /// Taking the lock ensures that the other thread is either waiting or has yet to check the queue
+  void notify()
+  {
+    { std::lock_guard<std::mutex> lock(mutex); }
+    changed.notify_all();
+  }
+
+  void run()
+  {
+    while (true) {
+      FrameSubmission*        frame         = submissions.front();
+      if (!frame) {
+        if (stopping)
+          break;
+        std::unique_lock<std::mutex>  lock(mutex);
+        while (submissions.empty() && !stopping)
+          changed.wait(lock);
+        continue;
+      }
+
+      FramePresentation       presentation  = FramePresentation();
+      presentation.iteration  = frame->iteration;
+      presentation.submitted  = frame->submitted;
+      presentation.queueWait  = frame->queueWait;
+      presentation.drawStart  = now();
+      render(*frame, presentation);
+      submissions.pop();
+      notify();
+
+      FramePresentation*      record        = presentations.back();
+      if (record) {
+        *record               = presentation;
+        presentations.push();
+      }
+      else ++numDropped;
+    }
+    release();
+  }
+};
+
+
+#endif //VIRMENRENDERTHREAD_H
@@ -1,233 +1,68 @@
 #include <mex.h>
-#include <cmath>
+#include <map>
+#include <cstring>
+#include "virmenCollisions.h"
 
 
-const double  EPSILON   = 1e-10;
+/**
+  virmenResolveCollisions('register', world, endpoints, radius2, angle, border1, border2)
+    Packs the walls of a world (vrWorld.walls) and keeps them in memory until the world is
+    registered again, e.g. after vrWorld.changed was set.
 
+  [dp, collision] = virmenResolveCollisions(pos, dp, world, dpResolution)
+    Resolves dp against the registered walls of the world, which are neither passed nor checked.
 
-//=============================================================================
-//  Quick and dirty math functions
-//=============================================================================
+  [dp, collision] = virmenResolveCollisions(pos, dp, world, dpResolution, halfLength)
+    Resolves the motion of an animal that is a capsule of the given half length along its
+    heading, with pos and dp as [x y z heading] (vr.position and vr.dp). The returned dp has
+    the translation and rotation that were possible; z is unchanged.
 
-void copyTo(int n, double* a, const double* b, const double bScale = 1) {
-  for (int i = 0; i < n; ++i) a[i]  = b[i] * bScale;
-}
-void copyTo(int n, double* a, const double b) {
-  for (int i = 0; i < n; ++i) a[i]  = b;
-}
-void addTo(int n, double* a, const double* b, const double bScale = 1) {
-  for (int i = 0; i < n; ++i) a[i] += b[i] * bScale;
-}
-void multiplyTo(int n, double* a, const double* b, const double bScale = 1) {
-  for (int i = 0; i < n; ++i) a[i] *= b[i] * bScale;
-}
-void multiplyTo(int n, double* a, const double b) {
-  for (int i = 0; i < n; ++i) a[i] *= b;
-}
-double norm2(int n, const double* a) {
-  double sum2 = 0;
-  for (int i = 0; i < n; ++i) sum2 += a[i] * a[i];
-  return sum2;
-}
-double norm(int n, const double* a) {
-  return sqrt(norm2(n, a));
-}
-double dot(int n, const double* a, const double* b) {
-  double sumAB = 0;
-  for (int i = 0; i < n; ++i) sumAB += a[i] * b[i];
-  return sumAB;
-}
-double sqr(double x) { return x*x; }
+  [dp, collision] = virmenResolveCollisions(pos, dp, endpoints, radius2, angle, border1, border2, dpResolution)
+    Resolves dp against the given walls, which are packed again only if they differ from those
+    of the previous call of this form.
 
+  pos and dp are either 1 x 2 (1 x 4 with halfLength) for the animal, or N x 2 (N x 4) for a
+  batch of agents (e.g. replayed trajectories or multiple targets) that are resolved
+  independently against the same walls, in which case collision is N x 1.
+*/
 
-//=============================================================================
-//  Intersection of primitives
-//=============================================================================
-
-bool  isInSegment(double t) {
-  return ( t >= 0 && t <= 1 );
-}
-
-int   lineLineIntersection( const double*       pos
-                          , const double*       dp
-                          , const size_t        numWalls  
-                          , const double*       endpoints 
-                          , const double*       angle     
-                          ,       double&       crossingPt
-                          ,       double&       slope
-                          )
-{
-  const double*   e1        = endpoints;
-  const double*   e2        = endpoints +   numWalls;
-  const double*   e3        = endpoints + 2*numWalls;
-  const double*   e4        = endpoints + 3*numWalls;
-
-  int             iNearest  = -9;
-  for (int iWall = 0; iWall < numWalls; ++iWall) 
-  {
-    const double  x31[]     = { e1[iWall] - pos[0]   , e2[iWall] - pos[1]    };
-    const double  x34[]     = { e1[iWall] - e3[iWall], e2[iWall] - e4[iWall] };
-    const double  detM      = dp[0] * x34[1] - dp[1] * x34[0];
-
-    const double  t         = ( x31[0] * x34[1] - x31[1] * x34[0] ) / detM;
-    const double  s         = ( x31[1] * dp[0]  - x31[0] * dp[1]  ) / detM;
-    
-    if ( isInSegment(t) && isInSegment(s) && t < crossingPt ) {
-      crossingPt  = t;
-      slope       = angle[iWall];
-      iNearest    = iWall;
-    }
-  }
-
-  return iNearest;
-}
+static collisions::WallTable                callerWalls;        // tables passed with the last call
+static std::map<int, collisions::WallTable> registeredWalls;    // by world index
 
 
-int lineCircleIntersection( const double*       pos
-                          , const double*       dp
-                          , const size_t        numWalls  
-                          , const double*       endpoints 
-                          , const double*       radius2   
-                          ,       double&       crossingPt
-                          ,       double&       slope
-                          )
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
 {
-  const double*     e1[]      = { endpoints           , endpoints + 2*numWalls };
-  const double*     e2[]      = { endpoints + numWalls, endpoints + 3*numWalls };
-
-  int               iNearest  = -9;
-  for (int iWall = 0; iWall < numWalls; ++iWall) {
-    for (int iPt = 0; iPt < 2; ++iPt)
-    {
-      const double  x31[]     = { e1[iPt][iWall] - pos[0]   , e2[iPt][iWall] - pos[1]    };
-      const double  x31d31    = dot(2, x31, x31);
-      const double  x21d21    = dot(2, dp , dp );
-      const double  x31d21    = dot(2, x31, dp );
-      const double  discr     = 4*sqr(x31d21) - 4*x21d21*(x31d31 - radius2[iWall]);
-      if (discr < 0)          continue;
-
-      const double  sqDiscr   = sqrt(discr);
-      const double  root1     = (2*x31d21 - sqDiscr) / (2*x21d21);
-      const double  root2     = (2*x31d21 + sqDiscr) / (2*x21d21);
-    
-      if (isInSegment(root1)) {
-        if (root1 < crossingPt) {
-          iNearest            = iWall;
-          crossingPt          = root1;
-          double      newpt[] = { pos[0] + root1 * dp[0] - e1[iPt][iWall]
-                                , pos[1] + root1 * dp[1] - e2[iPt][iWall]
-                                };
-          slope       = atan(newpt[1] / newpt[0]) + 1.5707963267949;    // pi/2
-        }
-      }
-
-      else if (isInSegment(root2) && root2 < crossingPt) {
-        iNearest              = iWall;
-        crossingPt            = root2;
-        const double  newpt[] = { pos[0] + root2 * dp[0] - e1[iPt][iWall]
-                                , pos[1] + root2 * dp[1] - e2[iPt][iWall]
-                                };
-        slope         = atan(newpt[1] / newpt[0]) + 1.5707963267949;    // pi/2
-      }
+  //----- Registration of the walls of a world
+  if (nrhs > 0 && mxIsChar(prhs[0])) {
+    char              command[16];
+    mxGetString(prhs[0], command, sizeof(command));
+    if (strcmp(command, "register") != 0 || nrhs != 7)
+      mexErrMsgIdAndTxt ( "virmenResolveCollisions:arguments"
+                        , "Syntax should be: virmenResolveCollisions('register', world, endpoints, radius2, angle, border1, border2)"
+                        );
+    for (int iPar = 1; iPar < 7; ++iPar) {
+      if (mxGetClassID(prhs[iPar]) != mxDOUBLE_CLASS)
+        mexErrMsgIdAndTxt("virmenResolveCollisions:arguments", "Invalid data type for argument %d, must be of type double.", iPar + 1);
     }
-  }
-
-  return iNearest;
-}
-
-
-
-//=============================================================================
-//  Collision detection algorithms
-//=============================================================================
-
-bool nearestIntersection( const double*       pos
-                        , const double*       dp
-                        , const size_t        numWalls  
-                        , const double*       endpoints 
-                        , const double*       radius2   
-                        , const double*       angle     
-                        , const double*       border1   
-                        , const double*       border2   
-                        ,       double&       crossingFrac
-                        ,       double&       slope
-                        ,       double*       wallTangent
-                        )
-{
-  crossingFrac      = 1e308;
-    
-  // Line-line intersections
-  lineLineIntersection( pos, dp, numWalls, border1, angle, crossingFrac, slope );
-  lineLineIntersection( pos, dp, numWalls, border2, angle, crossingFrac, slope );
-
-  // Line-circle intersections
-  lineCircleIntersection( pos, dp, numWalls, endpoints, radius2, crossingFrac, slope );
-
-  if (crossingFrac <= 1) {
-    wallTangent[0]  = cos(slope);
-    wallTangent[1]  = sin(slope);
-    return true;
-  }
-  return false;
-}
-
-
-bool detectCollision( const double*       pos
-                    , const double*       dp
-                    , const size_t        numWalls  
-                    , const double*       endpoints 
-                    , const double*       radius2   
-                    , const double*       angle     
-                    , const double*       border1   
-                    , const double*       border2   
-                    , const double        epsilon
-                    ,       double*       slideDP
-                    , const int           maxIterations = 50
-                    )
-{
-  copyTo(2, slideDP, dp);
-
-  bool                collision = false;
-  for (int it = 0; it < maxIterations; ++it)
-  {
-    // If the displacement to resolve is too small, zero it out to prevent
-    // infinite loops with infinitesimal corrections
-    if (fabs(slideDP[0]) < epsilon && fabs(slideDP[1]) < epsilon)
-      break;          // slideDP is zeroed out later
 
+    const size_t      numWalls      = mxGetM(prhs[2]);
+    if ( mxGetNumberOfElements(prhs[2]) != 4*numWalls || mxGetNumberOfElements(prhs[5]) != 4*numWalls || mxGetNumberOfElements(prhs[6]) != 4*numWalls
+      || mxGetNumberOfElements(prhs[3]) < numWalls    || mxGetNumberOfElements(prhs[4]) < numWalls
+       )
+      mexErrMsgIdAndTxt("virmenResolveCollisions:arguments", "Endpoints and borders must be N x 4, radius2 and angle N x 1, for %d walls.", static_cast<int>(numWalls));
 
-    double            crossingFrac, slope;
-    double            wallTangent[2];
-    if (nearestIntersection( pos, slideDP, numWalls, endpoints, radius2, angle, border1, border2, crossingFrac, slope, wallTangent )) 
-    {
-      const double    projDP    = dot(2, slideDP, wallTangent);
-      copyTo(2, slideDP, wallTangent, projDP);
-      collision       = true;
-    }
-    else return collision;
+    const int         world         = static_cast<int>( mxGetScalar(prhs[1]) );
+    registeredWalls[world].pack(numWalls, mxGetPr(prhs[2]), mxGetPr(prhs[3]), mxGetPr(prhs[4]), mxGetPr(prhs[5]), mxGetPr(prhs[6]));
+    return;
   }
 
-
-  // If we've reached this point too many iterations have elapsed, so to be
-  // safe just set dp to zero
-  copyTo(2, slideDP, 0.);
-  return collision;
-}
-
-
-//=============================================================================
-//  Main logic
-//=============================================================================
-
-void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
-{
   //----- Input check
-  if (nrhs != 8)
+  if (nrhs != 8 && nrhs != 4 && nrhs != 5)
     mexErrMsgIdAndTxt ( "virmenResolveCollisions:arguments"
-                      , "Invalid number of arguments %d != 8, syntax should be: [dp, collision] = virmenResolveCollisions(pos, dp, endpoints, radius2, angle, border1, border2, dpResolution)"
+                      , "Invalid number of arguments %d, syntax should be: [dp, collision] = virmenResolveCollisions(pos, dp, endpoints, radius2, angle, border1, border2, dpResolution) or virmenResolveCollisions(pos, dp, world, dpResolution[, halfLength])"
                       , nrhs
                       );
-  for (size_t iPar = 0; iPar < 8; ++iPar) {
+  for (int iPar = 0; iPar < nrhs; ++iPar) {
     if (mxGetClassID(prhs[iPar]) != mxDOUBLE_CLASS)
       mexErrMsgIdAndTxt("virmenResolveCollisions:arguments", "Invalid data type for argument %d, must be of type double.", iPar + 1);
   }
@@ -235,86 +70,58 @@ void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
   //----- Parse arguments
   const double*       inPos         = mxGetPr    (prhs[0]);
   const double*       inDP          = mxGetPr    (prhs[1]);
-  const size_t        numWalls      = mxGetM     (prhs[2]);
-  const double*       endpoints     = mxGetPr    (prhs[2]);
-  const double*       radius2       = mxGetPr    (prhs[3]);
-  const double*       angle         = mxGetPr    (prhs[4]);
-  const double*       border1       = mxGetPr    (prhs[5]);
-  const double*       border2       = mxGetPr    (prhs[6]);
-  const double        dpResolution  = mxGetScalar(prhs[7]);
-
-  //----- Initial values for iterative algorithm
-  const double        epsilon       = 1e-2 * dpResolution;
-  const double        dpAngle       = atan2(inDP[1], inDP[0]);
-  double              pos[]         = {inPos[0], inPos[1]};
-  double              dp[]          = {inDP [0], inDP [1]};
-  bool                collision     = false;
-
-  
-  if (mxIsFinite(dpResolution)) {
-
-  //----- Iteratively resolve the remaining dp
-  while (fabs(dp[0]) > epsilon || fabs(dp[1]) > epsilon) 
-  {
-    // In case of no collisions, retain the entire displacement vector and stop
-    double            crossingFrac, slope;
-    double            wallTangent[2];
-    if (!nearestIntersection(pos, dp, numWalls, endpoints, radius2, angle, border1, border2, crossingFrac, slope, wallTangent)) {
-      addTo(2, pos, dp);
-      break;
-    }
-    collision         = true;
-
-    // Retain the piece of dp up to the collision point minus some small 
-    // distance so as not to be inside the wall
-    double            dpLength      = norm(2, dp);
-    const double      dpPerp        = dpLength * fabs(sin(dpAngle - slope));
-    double            remainFrac    = 1;
-    const double     noCollFrac    = crossingFrac - epsilon/dpPerp;
-    if (noCollFrac > 0) {
-      addTo(2, pos, dp, noCollFrac);
-      remainFrac -= noCollFrac;
-    }
-
-    // Compute the appropriate piece of dp to project along the wall so
-    // that the lost length (perpendicular component) is small enough
-    double            chunkDP[2];
-    double            collFrac      = remainFrac;
-    collFrac          = dpResolution / dpPerp;
-    if (collFrac > remainFrac)
-      collFrac        = remainFrac;
-
-
-    // Replace the colliding fragment of dp with the component parallel to the wall
-    copyTo(2, chunkDP, wallTangent, dot(2, dp, wallTangent) * collFrac);
-    remainFrac       -= collFrac;
-
-    // Resolve additional collisions using the original algorithm
-    double            slideDP[2];
-    collision        |= detectCollision(pos, chunkDP, numWalls, endpoints, radius2, angle, border1, border2, epsilon, slideDP);
-    addTo(2, pos, slideDP);
-
-
-    // Reduce dp to the remaining length
-    multiplyTo(2, dp, remainFrac);
+  const double        dpResolution  = mxGetScalar(prhs[nrhs == 5 ? 3 : nrhs - 1]);
+  const double        halfLength    = nrhs == 5 ? mxGetScalar(prhs[4]) : 0;
+  const size_t        numColumns    = nrhs == 5 ? 4 : 2;
+  const collisions::WallTable*      table   = &callerWalls;
+  if (nrhs < 8) {
+    const int         world         = static_cast<int>( mxGetScalar(prhs[2]) );
+    std::map<int, collisions::WallTable>::const_iterator registered = registeredWalls.find(world);
+    if (registered == registeredWalls.end())
+      mexErrMsgIdAndTxt("virmenResolveCollisions:world", "No walls were registered for world %d.", world);
+    table             = &registered->second;
   }
-
-  } else {
-    // User opt-out: use the original algorithm
-    double            slideDP[2];
-    collision         = detectCollision(pos, dp, numWalls, endpoints, radius2, angle, border1, border2, 0, slideDP);
-    addTo(2, pos, slideDP);
+  else {
+    const size_t      numWalls      = mxGetM     (prhs[2]);
+    const double*     endpoints     = mxGetPr    (prhs[2]);
+    const double*     radius2       = mxGetPr    (prhs[3]);
+    const double*     angle         = mxGetPr    (prhs[4]);
+    const double*     border1       = mxGetPr    (prhs[5]);
+    const double*     border2       = mxGetPr    (prhs[6]);
+    if (!callerWalls.equals(numWalls, endpoints, radius2, angle, border1, border2))
+      callerWalls.pack(numWalls, endpoints, radius2, angle, border1, border2);
   }
 
-  //----- Output 
-  if (nlhs > 0) {
-    plhs[0]           = mxCreateDoubleMatrix(mxGetM(prhs[1]), mxGetN(prhs[1]), mxREAL);
-    double*           outDP         = mxGetPr(plhs[0]);
-    copyTo(2, outDP, pos);
-    addTo(2, outDP, inPos, -1);
+  //----- Single agent
+  if (mxGetNumberOfElements(prhs[0]) == numColumns && mxGetNumberOfElements(prhs[1]) == numColumns) {
+    double            outDP[4];
+    const bool        collision     = numColumns > 2
+                                    ? collisions::resolveFootprint (inPos, inDP, *table, dpResolution, halfLength, outDP)
+                                    : collisions::resolveCollisions(inPos, inDP, *table, dpResolution, outDP)
+                                    ;
+    if (nlhs > 0) {
+      plhs[0]         = mxCreateDoubleMatrix(mxGetM(prhs[1]), mxGetN(prhs[1]), mxREAL);
+      std::memcpy(mxGetPr(plhs[0]), outDP, numColumns * sizeof(double));
+    }
+    if (nlhs > 1)     plhs[1]       = mxCreateLogicalScalar(collision);
+    return;
   }
-  if (nlhs > 1)       plhs[1]       = mxCreateLogicalScalar(collision);
 
-}
+  //----- Batch of agents
+  const size_t        numAgents     = mxGetM(prhs[0]);
+  if (mxGetN(prhs[0]) != numColumns || mxGetM(prhs[1]) != numAgents || mxGetN(prhs[1]) != numColumns)
+    mexErrMsgIdAndTxt ( "virmenResolveCollisions:arguments"
+                      , "Positions (%d x %d) and displacements (%d x %d) must both be 1 x %d or N x %d."
+                      , static_cast<int>(mxGetM(prhs[0])), static_cast<int>(mxGetN(prhs[0]))
+                      , static_cast<int>(mxGetM(prhs[1])), static_cast<int>(mxGetN(prhs[1]))
+                      , static_cast<int>(numColumns), static_cast<int>(numColumns)
+                      );
 
+  plhs[0]             = mxCreateDoubleMatrix(numAgents, numColumns, mxREAL);
+  mxArray*            collision     = mxCreateLogicalMatrix(numAgents, 1);
+  double*             outDP         = mxGetPr(plhs[0]);
+  collisions::resolveAgents(numAgents, numColumns, inPos, inDP, *table, dpResolution, halfLength, outDP, mxGetLogicals(collision));
 
+  if (nlhs > 1)       plhs[1]       = collision;
+  else                mxDestroyArray(collision);
+}
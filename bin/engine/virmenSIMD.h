@@ -0,0 +1,44 @@
+#ifndef VIRMENSIMD_H
+#define VIRMENSIMD_H
+
+/**
+  Compiler support for AVX2 kernels, which are compiled for AVX2 with a target attribute and
+  selected at runtime with has_avx2(), so that the rest of the code runs on any x86-64 CPU.
+*/
+#if defined(_M_X64) || defined(__x86_64__)
+  #define VIRMEN_AVX2
+  #include <immintrin.h>
+  #if defined(_MSC_VER)
+    #include <intrin.h>
+    #define VIRMEN_TARGET_AVX2
+  #else
+    #define VIRMEN_TARGET_AVX2      __attribute__((target("avx2")))
+  #endif
+#endif
+
+
+#ifdef VIRMEN_AVX2
+
+inline bool has_avx2()
+{
+#if defined(_MSC_VER)
+  int                         info[4];
+  __cpuid(info, 0);
+  if (info[0] < 7)            return false;
+  __cpuid(info, 1);
+  const bool                  osxsave       = ( info[2] & (1 << 27) ) != 0;
+  const bool                  avx           = ( info[2] & (1 << 28) ) != 0;
+  if (!osxsave || !avx || ( _xgetbv(0) & 6 ) != 6)
+    return false;
+  __cpuidex(info, 7, 0);
+  return ( info[1] & (1 << 5) ) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2") != 0;
+#endif
+}
+
+#endif //VIRMEN_AVX2
+
+
+#endif //VIRMENSIMD_H
@@ -0,0 +1,46 @@
+function ok = virmenShaderProjection(transformationFunction)
+% ok = virmenShaderProjection(transformationFunction)
+%   Selects the GPU implementation of the given transformation function, so that the camera
+%   transform and screen projection are performed in a vertex shader instead of in MATLAB.
+%   World-space vertices are then uploaded to the graphics card only when they change.
+%   Returns false (and issues a warning) if no such implementation is available or the shaders
+%   could not be built, in which case the CPU path remains in use for the affected
+%   transformations. Call with an empty transformationFunction to revert to the CPU path.
+%
+%   Use virmenValidateProjection() to check that the GPU implementation matches the CPU one.
+
+% Transformation function, and the GPU implementation of each of its outputs
+shaders = { 'transformPerspectiveMex'             , {'perspective'}               ...
+          ; 'transformToroidalMex'                , {'toroidal'}                  ...
+          ; 'transformToroidalParametrizedMex'    , {'toroidalParametrized'}      ...
+          ; 'transformConicalMex'                 , {'conical'}                   ...
+          ; 'transformPerspectiveAndToroidalMex'  , {'perspective', 'toroidal'}   ...
+          ; 'transformPerspectiveAndConicalMex'   , {'perspective', 'conical'}    ...
+          ; 'DomeProjection_cpp'                  , {'dome'}                      ...
+          };
+
+if isempty(transformationFunction)
+    ok = virmenOpenGLRoutines(8, '');
+    return;
+end
+
+if isa(transformationFunction, 'function_handle')
+    transformationFunction = func2str(transformationFunction);
+end
+iShader = find(strcmp(shaders(:,1), transformationFunction), 1);
+if isempty(iShader)
+    warning('virmenShaderProjection:unsupported', 'No GPU implementation of %s, projection will be performed on the CPU.', transformationFunction);
+    ok = false;
+    return;
+end
+
+% Rig-specific constants that are otherwise compiled into the MEX file
+parameters = [];
+if strcmp(transformationFunction, 'transformToroidalParametrizedMex')
+    parameters = [RigParameters.toroidXFormP1, RigParameters.toroidXFormP2];
+end
+
+ok = virmenOpenGLRoutines(8, shaders{iShader,2}, parameters);
+if ~ok
+    warning('virmenShaderProjection:failed', 'Could not build shaders for %s, projection will be performed on the CPU.', transformationFunction);
+end
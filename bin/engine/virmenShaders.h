@@ -0,0 +1,286 @@
+#ifndef VIRMENSHADERS_H
+#define VIRMENSHADERS_H
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <mex.h>
+
+
+/**
+  GLSL programs that perform the camera transform (translation and rotation about the animal
+  position) as well as the screen projection on the GPU, so that world-space vertices need to
+  be uploaded only once. The projections follow the semantics of the corresponding MEX
+  transformation functions: each vertex is given screen coordinates and a visibility flag, and
+  triangles for which none of the vertices is visible are dropped by the geometry shader.
+  The distance from the animal is used as the z coordinate, to be mapped by the same
+  orthographic projection that is set up for the fixed-function pipeline.
+
+  Only GLSL 1.50 (compatibility profile) features are used, so that this also runs on software
+  implementations like Mesa llvmpipe.
+*/
+
+
+//=============================================================================
+//  Shader sources
+//=============================================================================
+
+static const char* VERTEX_SHADER_HEADER =
+  "#version 150 compatibility\n"
+  "in vec3 worldPosition;\n"
+  "in vec4 vertexColor;\n"
+  "uniform vec4 animalPosition;\n"        // x, y, z, view angle
+  "uniform vec4 projectionParameters;\n"  // rig-specific constants, if any
+  "out VertexData {\n"
+  "  vec4  color;\n"
+  "  float visible;\n"
+  "} vtx;\n"
+  ;
+
+// transformPerspectiveMex
+static const char* PROJECTION_PERSPECTIVE =
+  "vec3 project(vec3 v) {\n"
+  "  if (v.y <= 0.0)\n"
+  "    return vec3((v.x > 0.0 ? 1.0 : -1.0) * 1.8, (v.z > 0.0 ? 1.0 : -1.0), 0.0);\n"
+  "  return vec3(v.x / v.y, v.z / v.y, 1.0);\n"
+  "}\n"
+  ;
+
+// Common to the toroidal transformations; vertices directly above the animal are left at the center
+#define TOROID_FUNCTION                                                         \
+  "vec3 toroid(vec3 v, float p1, float p2) {\n"                                 \
+  "  float r        = length(v.xy);\n"                                          \
+  "  if (r == 0.0)\n"                                                           \
+  "    return vec3(0.0, 0.0, 1.0);\n"                                           \
+  "  float rnew     = p1 * atan(v.z / r) + p2;\n"                               \
+  "  if (rnew < 0.0 || rnew > 1.0)\n"                                           \
+  "    return vec3(clamp(rnew, 0.0, 1.0) * v.xy / r, 0.0);\n"                   \
+  "  return vec3(rnew * v.xy / r, 1.0);\n"                                      \
+  "}\n"
+
+// transformToroidalMex
+static const char* PROJECTION_TOROIDAL =
+  TOROID_FUNCTION
+  "vec3 project(vec3 v) {\n"
+  "  return toroid(v, 0.4625, 0.4929);\n"
+  "}\n"
+  ;
+
+// transformToroidalParametrizedMex, with (TOROIDP1, TOROIDP2) as parameters
+static const char* PROJECTION_TOROIDAL_PARAMETRIZED =
+  TOROID_FUNCTION
+  "vec3 project(vec3 v) {\n"
+  "  return toroid(v, projectionParameters.x, projectionParameters.y);\n"
+  "}\n"
+  ;
+
+// transformConicalMex
+static const char* PROJECTION_CONICAL =
+  "vec3 project(vec3 v) {\n"
+  "  float r        = length(v.xy);\n"
+  "  float rinv     = 1.0 / r;\n"
+  "  float rnew     = 1.0 / (2.0349*r - 0.98988*v.z);\n"
+  "  if (rnew < 0.0 || rnew > rinv)\n"
+  "    return vec3(rinv * v.xy, 0.0);\n"
+  "  return vec3(rnew * v.xy, 1.0);\n"
+  "}\n"
+  ;
+
+// DomeProjection_cpp: ray from the animal to the spherical screen, reflected by the spherical
+// mirror into the projector. Constants are folded by the shader compiler.
+static const char* PROJECTION_DOME =
+  "vec3 project(vec3 v) {\n"
+  "  const float pi   = 3.1415926;\n"
+  "  float tanElevMax = abs(tan(45.0*pi/180.0));\n"
+  "  float tanAzimMax = abs(tan(125.0*pi/180.0));\n"
+  // spherical screen radius and coordinates relative to the animal head
+  "  float Rs         = 8.0;\n"
+  "  vec3  sm         = vec3(17.5/25.4, 0.0, 16.5/25.4);\n"
+  "  vec3  Om         = vec3(7.5*cos(58.0*pi/180.0), 0.0, -7.5*sin(58.0*pi/180.0));\n"
+  // radius of the spherical mirror, and projector position relative to the mirror center
+  "  float r          = 43.8/25.4;\n"
+  "  vec3  P1o        = vec3(11.30, 0.0, -1.25);\n"
+  "  float c          = dot(sm, sm) - Rs*Rs;\n"
+  "  float aab        = length(P1o.xz);\n"
+  "  float sinpsi     = P1o.z / aab;\n"
+  "  float cospsi     = P1o.x / aab;\n"
+  "  vec3  P1opsi     = vec3(cospsi*P1o.x + sinpsi*P1o.z, P1o.y, -sinpsi*P1o.x + cospsi*P1o.z);\n"
+  // the dome is oriented with x forward
+  "  vec3  m          = vec3(v.y, v.x, v.z);\n"
+  "  float a          = dot(m, m);\n"
+  "  float b          = -2.0 * dot(m, sm);\n"
+  "  float d          = sqrt(b*b - 4.0*a*c);\n"
+  "  float t1         = (-b + d) / (2.0*a);\n"
+  "  float t2         = (-b - d) / (2.0*a);\n"
+  "  float t          = 0.0;\n"
+  "  if (t1 >= 0.0)     t = t1;\n"
+  "  if (t2 >  0.0)     t = t2;\n"
+  "  vec3  P2o        = m*t - Om;\n"
+  "  vec3  P2opsi     = vec3(cospsi*P2o.x + sinpsi*P2o.z, P2o.y, -sinpsi*P2o.x + cospsi*P2o.z);\n"
+  "  float aac        = length(P2opsi.yz);\n"
+  "  float sinalpha   = P2opsi.y / aac;\n"
+  "  float cosalpha   = P2opsi.z / aac;\n"
+  "  vec3  P2         = vec3(P2opsi.x, cosalpha*P2opsi.y - sinalpha*P2opsi.z, sinalpha*P2opsi.y + cosalpha*P2opsi.z);\n"
+  "  vec3  P1         = vec3(P1opsi.x, cosalpha*P1opsi.y - sinalpha*P1opsi.z, sinalpha*P1opsi.y + cosalpha*P1opsi.z);\n"
+  "  vec3  P3         = P1 / length(P1) + P2 / length(P2);\n"
+  "  float norm       = length(P1) * length(P3);\n"
+  "  float sintheta   = length(cross(P1, P3)) / norm;\n"
+  "  float costheta   = dot(P1, P3) / norm;\n"
+  "  float sinphi     = r*sintheta / sqrt(r*sintheta*r*sintheta + (P1.x - r*costheta)*(P1.x - r*costheta));\n"
+  "  vec2  screen     = vec2(1.1*5.5122*(sinphi*sinalpha - 0.019), 5.5122*(sinphi*cosalpha - 0.0931));\n"
+  "  if ( sqrt(v.z*v.z / dot(v.xy, v.xy)) > tanElevMax\n"
+  "     || (v.y < 0.0 && abs(v.y / v.x) > tanAzimMax)\n"
+  "     )\n"
+  "    return vec3(screen, 0.0);\n"
+  "  return vec3(screen, 1.0);\n"
+  "}\n"
+  ;
+
+static const char* VERTEX_SHADER_MAIN =
+  "void main() {\n"
+  "  vec3  relative = worldPosition - animalPosition.xyz;\n"
+  "  float c        = cos(-animalPosition.w);\n"
+  "  float s        = sin(-animalPosition.w);\n"
+  "  vec3  screen   = project(vec3(c*relative.x - s*relative.y, s*relative.x + c*relative.y, relative.z));\n"
+  "  gl_Position    = gl_ModelViewProjectionMatrix * vec4(screen.xy, length(relative), 1.0);\n"
+  "  vtx.color      = vertexColor;\n"
+  "  vtx.visible    = screen.z;\n"
+  "}\n"
+  ;
+
+static const char* GEOMETRY_SHADER =
+  "#version 150 compatibility\n"
+  "layout(triangles) in;\n"
+  "layout(triangle_strip, max_vertices = 3) out;\n"
+  "in VertexData {\n"
+  "  vec4  color;\n"
+  "  float visible;\n"
+  "} vtx[];\n"
+  "flat out vec4 fragmentColor;\n"
+  "void main() {\n"
+  "  if (vtx[0].visible != 1.0 && vtx[1].visible != 1.0 && vtx[2].visible != 1.0)\n"
+  "    return;\n"
+  "  for (int i = 0; i < 3; ++i) {\n"
+  "    gl_Position    = gl_in[i].gl_Position;\n"
+  "    fragmentColor  = vtx[i].color;\n"
+  "    EmitVertex();\n"
+  "  }\n"
+  "  EndPrimitive();\n"
+  "}\n"
+  ;
+
+static const char* FRAGMENT_SHADER =
+  "#version 150 compatibility\n"
+  "flat in vec4 fragmentColor;\n"
+  "void main() {\n"
+  "  gl_FragColor = fragmentColor;\n"
+  "}\n"
+  ;
+
+
+//=============================================================================
+//  Projections that are available on the GPU
+//=============================================================================
+
+struct ShaderProjection {
+  const char*   name;
+  const char*   source;
+};
+
+static const ShaderProjection SHADER_PROJECTIONS[] = {
+  { "perspective"           , PROJECTION_PERSPECTIVE            },
+  { "toroidal"              , PROJECTION_TOROIDAL               },
+  { "toroidalParametrized"  , PROJECTION_TOROIDAL_PARAMETRIZED  },
+  { "conical"               , PROJECTION_CONICAL                },
+  { "dome"                  , PROJECTION_DOME                   },
+};
+static const int NUM_SHADER_PROJECTIONS = sizeof(SHADER_PROJECTIONS) / sizeof(SHADER_PROJECTIONS[0]);
+
+static const ShaderProjection* find_shader_projection(const char* name)
+{
+  for (int iProj = 0; iProj < NUM_SHADER_PROJECTIONS; ++iProj)
+    if (strcmp(SHADER_PROJECTIONS[iProj].name, name) == 0)
+      return &SHADER_PROJECTIONS[iProj];
+  return 0;
+}
+
+
+//=============================================================================
+//  Compilation
+//=============================================================================
+
+/**
+  A linked program together with the locations of its uniforms.
+*/
+struct ProjectionProgram {
+  GLuint        program;
+  GLint         animalPosition;
+  GLint         parameters;
+
+  ProjectionProgram() : program(0), animalPosition(-1), parameters(-1) { }
+};
+
+static GLuint compile_shader(GLenum type, const std::vector<const char*>& sources)
+{
+  GLuint        shader      = glCreateShader(type);
+  glShaderSource(shader, static_cast<GLsizei>(sources.size()), &sources[0], NULL);
+  glCompileShader(shader);
+
+  GLint         status      = GL_FALSE;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+  if (status != GL_TRUE) {
+    char        log[2048];
+    glGetShaderInfoLog(shader, sizeof(log), NULL, log);
+    glDeleteShader(shader);
+    mexWarnMsgIdAndTxt("virmenOpenGLRoutines:shader", "Shader compilation failed:\n%s", log);
+    return 0;
+  }
+  return shader;
+}
+
+/**
+  Returns a linked program for the given projection, or 0 if it could not be built (in which
+  case a warning is issued). Attribute locations are the same as for the fixed-function path,
+  i.e. 0 for vertices and 3 for colors.
+*/
+static GLuint build_projection_program(const ShaderProjection& projection)
+{
+  std::vector<const char*>    vertexSource;
+  vertexSource.push_back(VERTEX_SHADER_HEADER);
+  vertexSource.push_back(projection.source);
+  vertexSource.push_back(VERTEX_SHADER_MAIN);
+
+  GLuint        vertexShader    = compile_shader(GL_VERTEX_SHADER  , vertexSource);
+  GLuint        geometryShader  = compile_shader(GL_GEOMETRY_SHADER, std::vector<const char*>(1, GEOMETRY_SHADER));
+  GLuint        fragmentShader  = compile_shader(GL_FRAGMENT_SHADER, std::vector<const char*>(1, FRAGMENT_SHADER));
+
+  GLuint        program         = 0;
+  if (vertexShader && geometryShader && fragmentShader) {
+    program     = glCreateProgram();
+    glAttachShader(program, vertexShader);
+    glAttachShader(program, geometryShader);
+    glAttachShader(program, fragmentShader);
+    glBindAttribLocation(program, 0, "worldPosition");
+    glBindAttribLocation(program, 3, "vertexColor");
+    glLinkProgram(program);
+
+    GLint       status          = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status != GL_TRUE) {
+      char      log[2048];
+      glGetProgramInfoLog(program, sizeof(log), NULL, log);
+      mexWarnMsgIdAndTxt("virmenOpenGLRoutines:shader", "Linking of '%s' projection failed:\n%s", projection.name, log);
+      glDeleteProgram(program);
+      program   = 0;
+    }
+  }
+
+  // Shaders are no longer needed once linked into a program
+  if (vertexShader)     glDeleteShader(vertexShader);
+  if (geometryShader)   glDeleteShader(geometryShader);
+  if (fragmentShader)   glDeleteShader(fragmentShader);
+  return program;
+}
+
+
+#endif //VIRMENSHADERS_H
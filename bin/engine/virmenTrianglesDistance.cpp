@@ -0,0 +1,42 @@
+#include "mex.h"
+#include <stdint.h>
+#include "virmenDepthSort.h"
+
+/*
+    minDist = virmenTrianglesDistance(dist, triangles)
+        Distance of the nearest vertex of each triangle, where triangles is a 3 x N array of
+        0-based vertex indices of class int32 or uint32 and dist is per vertex.
+*/
+
+template<typename Index>
+static void triangles_distance(const mxArray* distance, const mxArray* triangulation, double* minDist)
+{
+    const double*   dist        = mxGetPr(distance);
+    const mwSize    numVertices = mxGetNumberOfElements(distance);
+    const mwSize    numTriangles= mxGetN(triangulation);
+    const Index*    triangles   = static_cast<const Index*>(mxGetData(triangulation));
+
+    for (mwSize index = 0; index < 3*numTriangles; index++) {
+        if (static_cast<mwSize>(triangles[index]) >= numVertices)
+            mexErrMsgIdAndTxt("virmenTrianglesDistance:triangles", "Vertex index %d exceeds the number of distances (%d).", static_cast<int>(triangles[index]), static_cast<int>(numVertices));
+    }
+    for (mwSize i = 0; i < numTriangles; i++) {
+        minDist[i] = nearest_vertex(dist, triangles + 3*i);
+    }
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+    if (nrhs < 2 || !mxIsDouble(prhs[0]) || mxGetM(prhs[1]) != 3)
+        mexErrMsgIdAndTxt("virmenTrianglesDistance:arguments", "Usage: virmenTrianglesDistance(dist (double), triangles (3 x N int32 or uint32)).");
+
+    plhs[0] = mxCreateDoubleMatrix(1, mxGetN(prhs[1]), mxREAL);
+    double* minDist = mxGetPr(plhs[0]);
+
+    switch (mxGetClassID(prhs[1])) {
+    case mxINT32_CLASS:     triangles_distance<int32_t >(prhs[0], prhs[1], minDist);    break;
+    case mxUINT32_CLASS:    triangles_distance<uint32_t>(prhs[0], prhs[1], minDist);    break;
+    default:
+        mexErrMsgIdAndTxt("virmenTrianglesDistance:arguments", "Triangles must be of type int32 or uint32.");
+    }
+}
@@ -0,0 +1,22 @@
+function [maxDifference, numDiffering, cpuImage, gpuImage] = virmenValidateProjection(vr, world, wind, transformation, transformArg)
+% [maxDifference, numDiffering, cpuImage, gpuImage] = virmenValidateProjection(vr, world, wind, transformation, transformArg)
+%   Renders vr.worlds{world} offscreen at the size of ViRMEn window wind, once with the
+%   transformation function evaluated on the CPU and once with the GPU implementation selected
+%   by virmenShaderProjection(). Returns the maximum disagreement (0-255) in any color channel,
+%   the number of pixels that differ at all, and optionally both images (height x width x 3).
+%   The GPU path is computed in single precision, so that small differences along triangle
+%   edges are expected.
+%
+%   The world must have been registered with virmenOpenGLRoutines(6, ...).
+
+if nargin < 4
+    transformation = 1;
+end
+if nargin < 5
+    transformArg = [];
+end
+
+[maxDifference, numDiffering, cpuImage, gpuImage] = ...
+    virmenOpenGLRoutines(9, world, vr.worlds{world}.surface.vertices, vr.worlds{world}.surface.visible ...
+                        , vr.worlds{world}.surface.colors, vr.position, vr.exper.transformationFunction, transformArg ...
+                        , wind, transformation);
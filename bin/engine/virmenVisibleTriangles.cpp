@@ -0,0 +1,117 @@
+#include "mex.h"
+#include <cstdint>
+#include <vector>
+
+/*
+    triangles = virmenVisibleTriangles(tria, vertexArray, nDim, nVert, isVisible)
+        3 x nTria x nDim array in which culled triangles are replaced by [0 0 0].
+
+    [triangles, counts, firstTriangle] = virmenVisibleTriangles(tria, vertexArray, nDim, nVert, isVisible, order)
+        Only the visible triangles, compacted into a 3 x sum(counts) array where those of
+        transformation d start at column firstTriangle(d)+1 (an exclusive prefix sum of counts).
+        If order (1-based triangle indices, e.g. back-to-front) is given and not empty, triangles
+        are listed in that order.
+*/
+
+static inline bool is_drawn( const int32_t* tria, const double* vertices, const bool* isVisible, mwSize index )
+{
+    return isVisible[index]==1 && (vertices[3*tria[3*index]+2]==1 || vertices[3*tria[3*index+1]+2]==1 || vertices[3*tria[3*index+2]+2]==1);
+}
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+
+    mwSize          nTria       = mxGetN(prhs[0]);
+
+    const int32_t*  tria        = (const int32_t*) mxGetPr(prhs[0]);
+    const double*   vertexArray = mxGetPr(prhs[1]);
+    const mwSize    nDim        = static_cast<mwSize>(mxGetScalar(prhs[2]));
+    const double    nVert       = mxGetScalar(prhs[3]);
+    const bool*     isVisible   = (const bool*) mxGetPr(prhs[4]);
+
+    const mwSize    nCoord      = static_cast<mwSize>( 3*nVert );
+
+    if (nlhs < 2) {
+        mwSize          dims[3];
+        dims[0]                     = 3;
+        dims[1]                     = nTria;
+        dims[2]                     = nDim;
+        plhs[0]                     = mxCreateNumericArray(3, dims, mxINT32_CLASS, mxREAL);
+        int32_t*        newTria     = (int32_t*) mxGetPr(plhs[0]);
+
+        for ( mwSize d = 0; d < nDim; d++ ) {
+            for ( mwSize index = 0; index < nTria; index++ ) {
+                newTria[3*nTria*d+3*index] = 0;
+                newTria[3*nTria*d+3*index+1] = 0;
+                newTria[3*nTria*d+3*index+2] = 0;
+                if (is_drawn(tria, vertexArray + nCoord*d, isVisible, index)) {
+                    newTria[3*nTria*d+3*index] = tria[3*index];
+                    newTria[3*nTria*d+3*index+1] = tria[3*index+1];
+                    newTria[3*nTria*d+3*index+2] = tria[3*index+2];
+                }
+            }
+        }
+        return;
+    }
+
+
+    // Optional drawing order, converted to 0-based indices
+    std::vector<mwSize>     order;
+    if (nrhs > 5 && !mxIsEmpty(prhs[5])) {
+        if (!mxIsDouble(prhs[5]) || mxGetNumberOfElements(prhs[5]) != nTria)
+            mexErrMsgIdAndTxt("virmenVisibleTriangles:order", "order must be a double array with one index per triangle (%d).", static_cast<int>(nTria));
+        const double*   ord         = mxGetPr(prhs[5]);
+        order.resize(nTria);
+        for ( mwSize index = 0; index < nTria; index++ ) {
+            if (!(ord[index] >= 1 && ord[index] <= nTria))
+                mexErrMsgIdAndTxt("virmenVisibleTriangles:order", "order(%d) = %g is not a valid triangle index.", static_cast<int>(index+1), ord[index]);
+            order[index]            = static_cast<mwSize>(ord[index]) - 1;
+        }
+    }
+
+    // First pass: visibility flags in drawing order and count per transformation
+    std::vector<unsigned char>  drawn(nTria*nDim);
+    plhs[1]                     = mxCreateDoubleMatrix(1, nDim, mxREAL);
+    double*         counts      = mxGetPr(plhs[1]);
+    for ( mwSize d = 0; d < nDim; d++ ) {
+        mwSize          count       = 0;
+        for ( mwSize k = 0; k < nTria; k++ ) {
+            const mwSize    index       = order.empty() ? k : order[k];
+            drawn[nTria*d+k]            = is_drawn(tria, vertexArray + nCoord*d, isVisible, index);
+            count                      += drawn[nTria*d+k];
+        }
+        counts[d]                   = static_cast<double>(count);
+    }
+
+    // Exclusive prefix sum gives where each transformation starts
+    std::vector<mwSize>     first(nDim);
+    mwSize          total       = 0;
+    for ( mwSize d = 0; d < nDim; d++ ) {
+        first[d]                    = total;
+        total                      += static_cast<mwSize>(counts[d]);
+    }
+    if (nlhs > 2) {
+        plhs[2]                     = mxCreateDoubleMatrix(1, nDim, mxREAL);
+        double*         firstTriangle = mxGetPr(plhs[2]);
+        for ( mwSize d = 0; d < nDim; d++ )
+            firstTriangle[d]        = static_cast<double>(first[d]);
+    }
+
+    // Second pass: copy the visible triangles
+    plhs[0]                     = mxCreateNumericMatrix(3, total, mxINT32_CLASS, mxREAL);
+    int32_t*        newTria     = (int32_t*) mxGetData(plhs[0]);
+    for ( mwSize d = 0; d < nDim; d++ ) {
+        int32_t*        target      = newTria + 3*first[d];
+        for ( mwSize k = 0; k < nTria; k++ ) {
+            if (!drawn[nTria*d+k])
+                continue;
+            const mwSize    index       = order.empty() ? k : order[k];
+            target[0]                   = tria[3*index];
+            target[1]                   = tria[3*index+1];
+            target[2]                   = tria[3*index+2];
+            target                     += 3;
+        }
+    }
+
+    return;
+}
@@ -0,0 +1,239 @@
+function varargout = virmenWorldCache(action, varargin)
+% file = virmenWorldCache('file', world, cacheDir)
+%   Cache file for the world definition (a virmenWorld), named by a SHA-1 hash of all the
+%   properties that the geometry depends on. Returns '' if the hash cannot be computed (no Java).
+%
+% vrWorld = virmenWorldCache('read', file, vrWorld)
+%   Fills the geometry of vrWorld (as built by loadVirmenWorld) from the cache file, memory
+%   mapping its arrays. Returns [] if the file does not exist, is not of the current version or
+%   cannot be read (e.g. truncated), so that the world is triangulated again.
+%
+% virmenWorldCache('write', file, vrWorld)
+%   Writes the geometry of vrWorld to the cache file. The file is first written under a
+%   temporary name and then renamed, so that concurrent sessions never read a partial file;
+%   files that could not be completely written are deleted instead.
+%
+%   The cache holds all numeric and logical fields of vrWorld.surface, objects, edges, walls
+%   and grid. Files start with a header (magic, version, key, number of arrays, offset of
+%   the data) followed by one entry per array (name, class, size, offset), all little-endian;
+%   array data is stored column-major and aligned to 8 bytes. CACHE_VERSION must be increased
+%   whenever the format or the way that worlds are triangulated changes, which invalidates all
+%   existing files.
+
+CACHE_VERSION = 2;
+MAGIC = 'VIRMENWC';
+GROUPS = {'surface','objects','edges','walls','grid'};
+CLASSES = {'double','single','int32','uint32','uint8','logical'};
+NAME_LENGTH = 48;
+HEADER_SIZE = 8 + 4 + 4 + 40 + 8;
+ENTRY_SIZE = NAME_LENGTH + 4 + 4 + 3*8;
+
+switch action
+    case 'file'
+        [world, cacheDir] = varargin{:};
+        key = worldHash(world, CACHE_VERSION);
+        if isempty(key)
+            varargout{1} = '';
+        else
+            varargout{1} = fullfile(cacheDir, [key '.vwc']);
+        end
+
+    case 'read'
+        [file, vrWorld] = varargin{:};
+        varargout{1} = [];
+        % Files that cannot be read are ignored, so that the world is triangulated again
+        fid = -1;
+        try
+            fid = fopen(file, 'r', 'ieee-le');
+            if fid < 0
+                return
+            end
+            magic = fread(fid, [1 8], 'uint8=>char');
+            fileVersion = fread(fid, 1, 'uint32');
+            numArrays = fread(fid, 1, 'uint32');
+            key = fread(fid, [1 40], 'uint8=>char');
+            dataStart = fread(fid, 1, 'uint64');
+            [~, name] = fileparts(file);
+            if ~strcmp(magic, MAGIC) || fileVersion ~= CACHE_VERSION || ~strcmp(key, name)
+                fclose(fid);
+                return
+            end
+            names = cell(numArrays, 1);
+            classes = cell(numArrays, 1);
+            sizes = zeros(numArrays, 2);
+            offsets = zeros(numArrays, 1);
+            for iArray = 1:numArrays
+                names{iArray} = deblank(fread(fid, [1 NAME_LENGTH], 'uint8=>char'));
+                code = fread(fid, 2, 'uint32');
+                classes{iArray} = CLASSES{code(1)};
+                sizes(iArray,:) = fread(fid, [1 2], 'uint64');
+                offsets(iArray) = fread(fid, 1, 'uint64');
+            end
+            fclose(fid);
+            fid = -1;
+
+            % All non-empty arrays are mapped at once, with padding between them
+            format = cell(0, 3);
+            position = 0;
+            for iArray = 1:numArrays
+                if prod(sizes(iArray,:)) == 0
+                    continue
+                end
+                if offsets(iArray) > position
+                    format(end+1,:) = {'uint8', [1 offsets(iArray)-position], sprintf('pad%d',iArray)}; %#ok<AGROW>
+                end
+                storage = strrep(classes{iArray}, 'logical', 'uint8');
+                format(end+1,:) = {storage, sizes(iArray,:), sprintf('array%d',iArray)}; %#ok<AGROW>
+                position = offsets(iArray) + prod(sizes(iArray,:)) * bytesPerElement(storage);
+            end
+            if ~isempty(format)
+                mapped = memmapfile(file, 'Format', format, 'Offset', dataStart, 'Repeat', 1);
+                data = mapped.Data;
+            end
+
+            for iArray = 1:numArrays
+                group = strtok(names{iArray}, '.');
+                field = names{iArray}(numel(group)+2:end);
+                if prod(sizes(iArray,:)) == 0
+                    value = zeros(sizes(iArray,:), strrep(classes{iArray}, 'logical', 'uint8'));
+                else
+                    value = data.(sprintf('array%d',iArray));
+                end
+                if strcmp(classes{iArray}, 'logical')
+                    value = logical(value);
+                end
+                vrWorld.(group).(field) = value;
+            end
+        catch ME
+            if fid >= 0
+                fclose(fid);
+            end
+            warning('virmenWorldCache:read', 'Ignoring the world cache %s: %s', file, ME.message);
+            return
+        end
+        varargout{1} = vrWorld;
+
+    case 'write'
+        [file, vrWorld] = varargin{:};
+        [cacheDir, key] = fileparts(file);
+        if ~exist(cacheDir, 'dir')
+            mkdir(cacheDir);
+        end
+
+        % Arrays to store, with their classes and offsets relative to the start of the data
+        names = cell(0, 1);
+        values = cell(0, 1);
+        for iGroup = 1:numel(GROUPS)
+            group = vrWorld.(GROUPS{iGroup});
+            fields = fieldnames(group);
+            for iField = 1:numel(fields)
+                value = group.(fields{iField});
+                if ismember(class(value), CLASSES) && ismatrix(value)
+                    names{end+1,1} = [GROUPS{iGroup} '.' fields{iField}]; %#ok<AGROW>
+                    values{end+1,1} = value; %#ok<AGROW>
+                end
+            end
+        end
+        numArrays = numel(names);
+        offsets = zeros(numArrays, 1);
+        position = 0;
+        for iArray = 1:numArrays
+            offsets(iArray) = position;
+            storage = strrep(class(values{iArray}), 'logical', 'uint8');
+            position = position + ceil(numel(values{iArray}) * bytesPerElement(storage) / 8) * 8;
+        end
+
+        temporary = [tempname(cacheDir) '.tmp'];
+        fid = fopen(temporary, 'w', 'ieee-le');
+        if fid < 0
+            warning('virmenWorldCache:write', 'Could not write the world cache in %s.', cacheDir);
+            return
+        end
+        % Elements written are counted so that partial files (e.g. on a full disk) are discarded
+        numExpected = numel(MAGIC) + 2 + numel(key) + 1 + numArrays*(NAME_LENGTH + 2 + 3);
+        numWritten = fwrite(fid, MAGIC, 'uint8');
+        numWritten = numWritten + fwrite(fid, [CACHE_VERSION numArrays], 'uint32');
+        numWritten = numWritten + fwrite(fid, key, 'uint8');
+        numWritten = numWritten + fwrite(fid, HEADER_SIZE + numArrays*ENTRY_SIZE, 'uint64');
+        for iArray = 1:numArrays
+            name = zeros(1, NAME_LENGTH);
+            name(1:numel(names{iArray})) = names{iArray};
+            numWritten = numWritten + fwrite(fid, name, 'uint8');
+            numWritten = numWritten + fwrite(fid, [find(strcmp(class(values{iArray}), CLASSES)) 0], 'uint32');
+            numWritten = numWritten + fwrite(fid, [size(values{iArray}) offsets(iArray)], 'uint64');
+        end
+        for iArray = 1:numArrays
+            storage = strrep(class(values{iArray}), 'logical', 'uint8');
+            count = numel(values{iArray});
+            padding = ceil(count * bytesPerElement(storage) / 8) * 8 - count * bytesPerElement(storage);
+            numExpected = numExpected + count + padding;
+            numWritten = numWritten + fwrite(fid, values{iArray}, storage);
+            numWritten = numWritten + fwrite(fid, zeros(1, padding), 'uint8');
+        end
+        isClosed = fclose(fid) == 0;
+        if ~isClosed || numWritten ~= numExpected
+            delete(temporary);
+            warning('virmenWorldCache:write', 'Could not write the world cache %s (%d of %d elements written).', file, numWritten, numExpected);
+            return
+        end
+        [isMoved, message] = movefile(temporary, file, 'f');
+        if ~isMoved
+            delete(temporary);
+            warning('virmenWorldCache:write', 'Could not write the world cache %s: %s', file, message);
+        end
+end
+
+
+function bytes = bytesPerElement(storage)
+switch storage
+    case 'double',  bytes = 8;
+    case 'uint8',   bytes = 1;
+    otherwise,      bytes = 4;
+end
+
+
+function key = worldHash(world, version)
+% SHA-1 of the class, properties and values of the world and its descendants, excluding those
+% that only matter to the GUI
+key = '';
+if ~usejava('jvm')
+    return
+end
+digest = java.security.MessageDigest.getInstance('SHA-1');
+digest.update(uint8(sprintf('virmenWorldCache %d', version)));
+hashValue(digest, world);
+key = lower(reshape(dec2hex(typecast(digest.digest, 'uint8'), 2)', 1, []));
+
+
+function hashValue(digest, value)
+exclude = {'name','parent','items','symbolic','variables','userdata','iconLocations','helpString'};
+
+digest.update(uint8([class(value) 0]));
+digest.update(typecast(double(size(value)), 'uint8'));
+if isobject(value)
+    props = setdiff(unique(properties(value)), exclude);
+    for iValue = 1:numel(value)
+        for ndx = 1:length(props)
+            digest.update(uint8([props{ndx} 0]));
+            hashValue(digest, value(iValue).(props{ndx}));
+        end
+    end
+elseif iscell(value)
+    for ndx = 1:numel(value)
+        hashValue(digest, value{ndx});
+    end
+elseif isstruct(value)
+    fields = sort(fieldnames(value));
+    for iValue = 1:numel(value)
+        for ndx = 1:length(fields)
+            digest.update(uint8([fields{ndx} 0]));
+            hashValue(digest, value(iValue).(fields{ndx}));
+        end
+    end
+elseif ischar(value)
+    digest.update(uint8(value(:)'));
+elseif (isnumeric(value) || islogical(value)) && ~isempty(value)
+    digest.update(typecast(double(value(:)'), 'uint8'));
+elseif isa(value, 'function_handle')
+    digest.update(uint8(func2str(value)));
+end
@@ -0,0 +1,83 @@
+function grid = virmenWorldGrid(vrWorld, trianglesPerChunk)
+% grid = virmenWorldGrid(vrWorld, trianglesPerChunk)
+%   Uniform grid over the x-y extent of a world as returned by loadVirmenWorld, used by
+%   virmenWorldGridQuery to select the triangles near the animal. The triangles of each object
+%   are split into chunks of up to trianglesPerChunk (default 64) consecutive triangles, each
+%   with its bounding box, and every cell lists the chunks that overlap it. Cells are sized for
+%   a few chunks each.
+%
+%   Bounding boxes are computed from vrWorld.surface.vertices, so the grid must be rebuilt if
+%   objects are moved at runtime; the engine does so whenever vr.worlds{}.changed is set.
+
+if nargin < 2
+    trianglesPerChunk = 64;
+end
+
+vertices = vrWorld.surface.vertices;
+numTriangles = size(vrWorld.surface.triangulation,2);
+objTriangles = vrWorld.objects.triangles;
+
+% Chunks of consecutive triangles within each object
+chunkTriangles = zeros(0,2);
+chunkObject = zeros(0,1);
+for obj = 1:size(objTriangles,1)
+    first = objTriangles(obj,1):trianglesPerChunk:objTriangles(obj,2);
+    last = min(first + trianglesPerChunk - 1, objTriangles(obj,2));
+    chunkTriangles = [chunkTriangles; first(:) last(:)]; %#ok<AGROW>
+    chunkObject = [chunkObject; repmat(obj,numel(first),1)]; %#ok<AGROW>
+end
+numChunks = size(chunkTriangles,1);
+
+% Bounding box [xmin ymin xmax ymax] of each chunk
+chunkBounds = zeros(numChunks,4);
+if numChunks > 0
+    tria = double(vrWorld.surface.triangulation) + 1;
+    x = reshape(vertices(1,tria),3,numTriangles);
+    y = reshape(vertices(2,tria),3,numTriangles);
+    isFirst = zeros(numTriangles,1);
+    isFirst(chunkTriangles(:,1)) = 1;
+    chunkOf = max(cumsum(isFirst),1);
+    chunkBounds = [ accumarray(chunkOf, min(x,[],1)', [numChunks 1], @min) ...
+                  , accumarray(chunkOf, min(y,[],1)', [numChunks 1], @min) ...
+                  , accumarray(chunkOf, max(x,[],1)', [numChunks 1], @max) ...
+                  , accumarray(chunkOf, max(y,[],1)', [numChunks 1], @max) ...
+                  ];
+end
+
+% Cells of about 4 chunks each
+if numChunks > 0
+    origin = min(chunkBounds(:,1:2),[],1);
+    extent = max(chunkBounds(:,3:4),[],1) - origin;
+else
+    origin = [0 0];
+    extent = [0 0];
+end
+cellSize = sqrt(prod(extent) / max(1,numChunks/4));
+if ~(cellSize > 0)                          % all geometry along a line
+    cellSize = max(extent) / max(1,numChunks/4);
+end
+if ~(cellSize > 0)
+    cellSize = 1;
+end
+numCells = max(1, ceil(extent / cellSize));
+
+% Cells overlapped by each chunk, listed per cell
+lo = min(max(floor((chunkBounds(:,1:2) - repmat(origin,numChunks,1)) / cellSize), 0), repmat(numCells-1,numChunks,1));
+hi = min(max(floor((chunkBounds(:,3:4) - repmat(origin,numChunks,1)) / cellSize), 0), repmat(numCells-1,numChunks,1));
+pairs = cell(numChunks,1);
+for iChunk = 1:numChunks
+    [ix, iy] = ndgrid(lo(iChunk,1):hi(iChunk,1), lo(iChunk,2):hi(iChunk,2));
+    pairs{iChunk} = [ix(:) + iy(:)*numCells(1) + 1, repmat(iChunk,numel(ix),1)];
+end
+pairs = sortrows(vertcat(zeros(0,2), pairs{:}));
+
+grid = struct;
+grid.origin = origin;
+grid.cellSize = cellSize;
+grid.numCells = numCells;
+grid.cellStart = [1; cumsum(accumarray(pairs(:,1), 1, [prod(numCells) 1])) + 1];
+grid.cellChunks = pairs(:,2);
+grid.chunkTriangles = chunkTriangles;
+grid.chunkBounds = chunkBounds;
+grid.chunkObject = chunkObject;
+grid.numVertices = size(vertices,2);
@@ -0,0 +1,351 @@
+#include <mex.h>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+
+
+/**
+  [triangleIndex, vertexIndex, triangulation, objects] = virmenWorldGridQuery(grid, triangulation, position, maxDistance, viewAngle)
+  [..., visible] = virmenWorldGridQuery(..., visible, lod, lodAngle)
+
+  Selects the triangles of a world that may be seen from the given position, using the grid
+  built by virmenWorldGrid. A chunk of triangles is selected if its (x-y) bounding box is within
+  maxDistance of the animal and overlaps the wedge of full angle viewAngle (radians) centered
+  on its heading; maxDistance = Inf and viewAngle >= 2*pi disable the respective test.
+
+  Outputs are the 1-based indices of the selected triangles and of the vertices that they use
+  (both in increasing order), the triangulation of the selected triangles as 0-based indices
+  into vertexIndex (int32, as vr.worlds{}.surface.triangulation), and the selected objects.
+
+  If the levels of detail built by virmenWorldLOD are given, selected objects are replaced by
+  their coarsest level whose levelSize is seen under an angle smaller than lodAngle (radians)
+  at the distance of the object's bounding box. Coarse triangles and vertices are then listed
+  after the full ones, with indices offset by the number of triangles and of vertices in the
+  world, i.e. they refer to [surface.vertices, lod.vertices] and so on. The visible flags of the
+  selected triangles are also returned; a coarse level is visible if any triangle of its object
+  is.
+*/
+
+
+static const double   PI          = 3.14159265358979323846;
+
+static double wrap(double angle)
+{
+  angle               = fmod(angle + PI, 2*PI);
+  if (angle < 0)      angle      += 2*PI;
+  return angle - PI;
+}
+
+
+/**
+  View region: a disk of radius maxDistance intersected with a wedge of half angle halfAngle
+  about the forward direction.
+*/
+struct ViewRegion
+{
+  double              x, y;
+  double              maxDistance;
+  double              forward;
+  double              halfAngle;
+
+  bool overlaps(const double* bounds) const
+  {
+    // Distance from the animal to the box, zero if inside
+    const double      dx          = std::max(0.0, std::max(bounds[0] - x, x - bounds[2]));
+    const double      dy          = std::max(0.0, std::max(bounds[1] - y, y - bounds[3]));
+    if (dx*dx + dy*dy > maxDistance*maxDistance)
+      return false;
+    if (halfAngle >= PI || (dx == 0 && dy == 0))
+      return true;
+
+    // Angular extent of the box as seen from the animal, which is less than pi since the box
+    // does not contain it, relative to the direction of its center
+    const double      center      = atan2(0.5*(bounds[1] + bounds[3]) - y, 0.5*(bounds[0] + bounds[2]) - x);
+    double            lo          = 0;
+    double            hi          = 0;
+    for (int iCorner = 0; iCorner < 4; ++iCorner) {
+      const double    cx          = bounds[(iCorner & 1) ? 2 : 0];
+      const double    cy          = bounds[(iCorner & 2) ? 3 : 1];
+      const double    delta       = wrap(atan2(cy - y, cx - x) - center);
+      lo              = std::min(lo, delta);
+      hi              = std::max(hi, delta);
+    }
+
+    const double      offset      = wrap(center - forward);
+    for (int shift = -1; shift <= 1; ++shift) {
+      const double    first       = offset + lo + 2*PI*shift;
+      const double    last        = offset + hi + 2*PI*shift;
+      if (last >= -halfAngle && first <= halfAngle)
+        return true;
+    }
+    return false;
+  }
+};
+
+
+static const mxArray* get_field(const mxArray* grid, const char* name, mwSize numel = 0, bool isLOD = false)
+{
+  const mxArray*      field       = mxGetField(grid, 0, name);
+  if (!field || !(isLOD && !strcmp(name, "triangulation") ? mxIsInt32(field) : mxIsDouble(field)) || (numel > 0 && mxGetNumberOfElements(field) != numel)) {
+    if (isLOD)
+      mexErrMsgIdAndTxt("virmenWorldGridQuery:lod", "lod.%s is missing or invalid; lod should be built by virmenWorldLOD().", name);
+    mexErrMsgIdAndTxt("virmenWorldGridQuery:grid", "grid.%s is missing or invalid; grid should be built by virmenWorldGrid().", name);
+  }
+  return field;
+}
+
+/// Distance from (x,y) to the box [xmin ymin xmax ymax], zero if inside
+static double box_distance(double x, double y, const double* bounds)
+{
+  const double        dx          = std::max(0.0, std::max(bounds[0] - x, x - bounds[2]));
+  const double        dy          = std::max(0.0, std::max(bounds[1] - y, y - bounds[3]));
+  return sqrt(dx*dx + dy*dy);
+}
+
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[])
+{
+  if (nrhs < 5 || !mxIsStruct(prhs[0]) || !mxIsInt32(prhs[1]) || mxGetM(prhs[1]) != 3 || mxGetNumberOfElements(prhs[2]) < 4)
+    mexErrMsgIdAndTxt("virmenWorldGridQuery:arguments", "Usage: virmenWorldGridQuery(grid, triangulation (3 x N int32), position, maxDistance, viewAngle[, visible, lod, lodAngle]).");
+
+  const mxArray*      grid        = prhs[0];
+  const double*       origin      = mxGetPr(get_field(grid, "origin", 2));
+  const double        cellSize    = mxGetScalar(get_field(grid, "cellSize", 1));
+  const double*       numCells    = mxGetPr(get_field(grid, "numCells", 2));
+  const mwSize        nx          = static_cast<mwSize>(numCells[0]);
+  const mwSize        ny          = static_cast<mwSize>(numCells[1]);
+  const double*       cellStart   = mxGetPr(get_field(grid, "cellStart", nx*ny + 1));
+  const mxArray*      chunkList   = get_field(grid, "cellChunks");
+  const double*       cellChunks  = mxGetPr(chunkList);
+  const mxArray*      chunkTriangles= get_field(grid, "chunkTriangles");
+  const mwSize        numChunks   = mxGetM(chunkTriangles);
+  const double*       chunkFirst  = mxGetPr(chunkTriangles);
+  const double*       chunkLast   = chunkFirst + numChunks;
+  const double*       chunkBounds = mxGetPr(get_field(grid, "chunkBounds", 4*numChunks));
+  const double*       chunkObject = mxGetPr(get_field(grid, "chunkObject", numChunks));
+  const mwSize        numVertices = static_cast<mwSize>(mxGetScalar(get_field(grid, "numVertices", 1)));
+
+  const mwSize        numTriangles= mxGetN(prhs[1]);
+  const int32_t*      tria        = (const int32_t*) mxGetData(prhs[1]);
+  const double*       pos         = mxGetPr(prhs[2]);
+
+  ViewRegion          region;
+  region.x            = pos[0];
+  region.y            = pos[1];
+  region.maxDistance  = mxGetScalar(prhs[3]);
+  region.forward      = pos[3] + PI/2;                // heading 0 faces +y
+  region.halfAngle    = 0.5 * mxGetScalar(prhs[4]);
+
+  const mxLogical*    visible     = 0;
+  if (nrhs > 5 && !mxIsEmpty(prhs[5])) {
+    if (!mxIsLogical(prhs[5]) || mxGetNumberOfElements(prhs[5]) != numTriangles)
+      mexErrMsgIdAndTxt("virmenWorldGridQuery:visible", "visible must be a logical array with one flag per triangle (%d).", static_cast<int>(numTriangles));
+    visible           = mxGetLogicals(prhs[5]);
+  }
+  if (nlhs > 4 && !visible)
+    mexErrMsgIdAndTxt("virmenWorldGridQuery:visible", "visible flags must be provided in order to be returned.");
+
+
+  // Levels of detail, listed by object
+  const bool          hasLOD      = nrhs > 7 && !mxIsEmpty(prhs[6]);
+  const mxArray*      lod         = hasLOD ? prhs[6] : 0;
+  const double        lodAngle    = hasLOD ? mxGetScalar(prhs[7]) : 0;
+  mwSize              numLevels   = 0, numObjects = 0, numLODTriangles = 0, numLODVertices = 0;
+  const double*       levelObject = 0;
+  const double*       levelSize   = 0;
+  const double*       levelTriangles= 0;
+  const double*       objectBounds= 0;
+  const double*       objectTriangles= 0;
+  const int32_t*      lodTria     = 0;
+  if (hasLOD) {
+    if (!mxIsStruct(lod))
+      mexErrMsgIdAndTxt("virmenWorldGridQuery:lod", "lod should be a structure built by virmenWorldLOD().");
+    levelObject       = mxGetPr(get_field(lod, "levelObject", 0, true));
+    numLevels         = mxGetNumberOfElements(get_field(lod, "levelObject", 0, true));
+    levelSize         = mxGetPr(get_field(lod, "levelSize", numLevels, true));
+    levelTriangles    = mxGetPr(get_field(lod, "levelTriangles", 2*numLevels, true));
+    numObjects        = mxGetM(get_field(lod, "objectBounds", 0, true));
+    objectBounds      = mxGetPr(get_field(lod, "objectBounds", 4*numObjects, true));
+    objectTriangles   = mxGetPr(get_field(lod, "objectTriangles", 2*numObjects, true));
+    const mxArray*    triangulation = get_field(lod, "triangulation", 0, true);
+    lodTria           = (const int32_t*) mxGetData(triangulation);
+    numLODTriangles   = mxGetN(triangulation);
+    numLODVertices    = mxGetN(get_field(lod, "vertices", 0, true));
+    if (mxGetM(triangulation) != 3 && numLODTriangles > 0)
+      mexErrMsgIdAndTxt("virmenWorldGridQuery:lod", "lod.triangulation should be 3 x N.");
+  }
+  std::vector<mwSize> objectLevel(numObjects, numLevels);   // first level of each object
+  std::vector<mwSize> objectLevels(numObjects, 0);
+  for (mwSize iLevel = 0; iLevel < numLevels; ++iLevel) {
+    const mwSize      iObject     = static_cast<mwSize>(levelObject[iLevel]) - 1;
+    if (iObject >= numObjects)
+      mexErrMsgIdAndTxt("virmenWorldGridQuery:lod", "lod.levelObject(%d) = %g is not a valid object index.", static_cast<int>(iLevel + 1), levelObject[iLevel]);
+    objectLevel[iObject]          = std::min(objectLevel[iObject], iLevel);
+    ++objectLevels[iObject];
+  }
+
+
+  // Range of cells that can be within maxDistance
+  mwSize              ix0         = 0, iy0 = 0, ix1 = nx - 1, iy1 = ny - 1;
+  bool                inRange     = numChunks > 0;
+  if (inRange && mxIsFinite(region.maxDistance)) {
+    const double      fx0         = floor((region.x - region.maxDistance - origin[0]) / cellSize);
+    const double      fy0         = floor((region.y - region.maxDistance - origin[1]) / cellSize);
+    const double      fx1         = floor((region.x + region.maxDistance - origin[0]) / cellSize);
+    const double      fy1         = floor((region.y + region.maxDistance - origin[1]) / cellSize);
+    inRange           = !(fx1 < 0 || fy1 < 0 || fx0 >= nx || fy0 >= ny);
+    if (inRange) {
+      ix0             = static_cast<mwSize>(std::max(0.0, fx0));
+      iy0             = static_cast<mwSize>(std::max(0.0, fy0));
+      ix1             = static_cast<mwSize>(std::min(nx - 1.0, fx1));
+      iy1             = static_cast<mwSize>(std::min(ny - 1.0, fy1));
+    }
+  }
+
+  // Chunks in cells that overlap the view region, each tested once. Flags are kept between
+  // calls and cleared after use, so that the cost is proportional to what is near the animal.
+  static std::vector<unsigned char> isTested;
+  std::vector<mwSize> tested;
+  std::vector<mwSize> selected;
+  isTested.resize(numChunks, 0);
+  for (mwSize iy = iy0; inRange && iy <= iy1; ++iy)
+    for (mwSize ix = ix0; ix <= ix1; ++ix) {
+      const double    cell[]      = { origin[0] + ix*cellSize, origin[1] + iy*cellSize, origin[0] + (ix+1)*cellSize, origin[1] + (iy+1)*cellSize };
+      if (!region.overlaps(cell))
+        continue;
+
+      const mwSize    iCell       = ix + iy*nx;
+      const mwSize    kEnd        = std::min<mwSize>(static_cast<mwSize>(cellStart[iCell+1]) - 1, mxGetNumberOfElements(chunkList));
+      for (mwSize k = static_cast<mwSize>(cellStart[iCell]) - 1; k < kEnd; ++k) {
+        const mwSize  iChunk      = static_cast<mwSize>(cellChunks[k]) - 1;
+        if (iChunk >= numChunks || isTested[iChunk])
+          continue;
+        isTested[iChunk]          = 1;
+        tested.push_back(iChunk);
+        const double  bounds[]    = { chunkBounds[iChunk], chunkBounds[iChunk + numChunks], chunkBounds[iChunk + 2*numChunks], chunkBounds[iChunk + 3*numChunks] };
+        if (region.overlaps(bounds))
+          selected.push_back(iChunk);
+      }
+    }
+  for (size_t iTested = 0; iTested < tested.size(); ++iTested)
+    isTested[tested[iTested]]     = 0;
+  std::sort(selected.begin(), selected.end());
+
+
+  // Level drawn for each selected object, the coarsest that is small enough at its distance
+  const int           UNKNOWN     = -2;
+  const int           FULL        = -1;
+  std::vector<int>    drawnLevel(hasLOD ? numObjects : 0, UNKNOWN);
+  std::vector<mwSize> levels;
+  for (size_t iSel = 0; iSel < selected.size() && hasLOD; ++iSel) {
+    const mwSize      iObject     = static_cast<mwSize>(chunkObject[selected[iSel]]) - 1;
+    if (iObject >= numObjects || drawnLevel[iObject] != UNKNOWN)
+      continue;
+    drawnLevel[iObject]           = FULL;
+    const double      bounds[]    = { objectBounds[iObject], objectBounds[iObject + numObjects], objectBounds[iObject + 2*numObjects], objectBounds[iObject + 3*numObjects] };
+    const double      reach       = lodAngle * box_distance(region.x, region.y, bounds);
+    for (mwSize iLevel = objectLevel[iObject]; iLevel < objectLevel[iObject] + objectLevels[iObject]; ++iLevel)
+      if (levelSize[iLevel] <= reach)
+        drawnLevel[iObject]       = static_cast<int>(iLevel);
+    if (drawnLevel[iObject] != FULL)
+      levels.push_back(drawnLevel[iObject]);
+  }
+  std::sort(levels.begin(), levels.end());
+
+
+  // Selected triangles and the vertices that they use; coarse ones are offset by the size of
+  // the full world
+  static std::vector<int32_t>  vertexMap;                   // -1 if not (yet) used
+  vertexMap.resize(numVertices + numLODVertices, -1);
+  std::vector<mwSize> triangles;
+  std::vector<int32_t>  vertices;
+  std::vector<double>   objects;
+  std::vector<mxLogical>  isVisible;
+  auto                add_triangle= [&](const int32_t* source, mwSize iTri, mwSize offset, mwSize count, mxLogical flag)
+  {
+    triangles.push_back(iTri);
+    isVisible.push_back(flag);
+    for (int iCorner = 0; iCorner < 3; ++iCorner) {
+      const int32_t   iVtx        = source[iCorner];
+      if (iVtx < 0 || static_cast<mwSize>(iVtx) >= count) {
+        for (size_t iUsed = 0; iUsed < vertices.size(); ++iUsed)
+          vertexMap[vertices[iUsed]]  = -1;
+        if (offset > 0)
+          mexErrMsgIdAndTxt("virmenWorldGridQuery:lod", "Vertex index %d of coarse triangle %d exceeds the %d vertices of lod.", iVtx, static_cast<int>(iTri - numTriangles + 1), static_cast<int>(count));
+        mexErrMsgIdAndTxt("virmenWorldGridQuery:triangulation", "Vertex index %d of triangle %d exceeds the %d vertices of the grid.", iVtx, static_cast<int>(iTri + 1), static_cast<int>(count));
+      }
+      const int32_t   iIndex      = static_cast<int32_t>(iVtx + offset);
+      if (vertexMap[iIndex] < 0) {
+        vertexMap[iIndex]         = 0;
+        vertices.push_back(iIndex);
+      }
+    }
+  };
+
+  for (size_t iSel = 0; iSel < selected.size(); ++iSel) {
+    const mwSize      iChunk      = selected[iSel];
+    if (objects.empty() || objects.back() != chunkObject[iChunk])
+      objects.push_back(chunkObject[iChunk]);
+    const mwSize      iObject     = static_cast<mwSize>(chunkObject[iChunk]) - 1;
+    if (hasLOD && iObject < numObjects && drawnLevel[iObject] != FULL)
+      continue;
+    for (mwSize iTri = static_cast<mwSize>(chunkFirst[iChunk]) - 1; iTri < static_cast<mwSize>(chunkLast[iChunk]) && iTri < numTriangles; ++iTri)
+      add_triangle(tria + 3*iTri, iTri, 0, numVertices, visible ? visible[iTri] : 1);
+  }
+
+  for (size_t iLevel = 0; iLevel < levels.size(); ++iLevel) {
+    const mwSize      level       = levels[iLevel];
+    const mwSize      iObject     = static_cast<mwSize>(levelObject[level]) - 1;
+    mxLogical         isShown     = visible ? 0 : 1;
+    for (mwSize iTri = static_cast<mwSize>(objectTriangles[iObject]) - 1; !isShown && iTri < static_cast<mwSize>(objectTriangles[iObject + numObjects]) && iTri < numTriangles; ++iTri)
+      isShown         = visible[iTri];
+    for (mwSize iTri = static_cast<mwSize>(levelTriangles[level]) - 1; iTri < static_cast<mwSize>(levelTriangles[level + numLevels]) && iTri < numLODTriangles; ++iTri)
+      add_triangle(lodTria + 3*iTri, numTriangles + iTri, numVertices, numLODVertices, isShown);
+  }
+
+  std::sort(vertices.begin(), vertices.end());
+  for (size_t iSel = 0; iSel < vertices.size(); ++iSel)
+    vertexMap[vertices[iSel]]     = static_cast<int32_t>(iSel);
+
+
+  plhs[0]             = mxCreateDoubleMatrix(1, triangles.size(), mxREAL);
+  double*             triangleIndex = mxGetPr(plhs[0]);
+  for (size_t iSel = 0; iSel < triangles.size(); ++iSel)
+    triangleIndex[iSel]           = triangles[iSel] + 1.0;
+
+  if (nlhs > 1) {
+    plhs[1]           = mxCreateDoubleMatrix(1, vertices.size(), mxREAL);
+    double*           vertexIndex = mxGetPr(plhs[1]);
+    for (size_t iSel = 0; iSel < vertices.size(); ++iSel)
+      vertexIndex[iSel]           = vertices[iSel] + 1.0;
+  }
+
+  if (nlhs > 2) {
+    plhs[2]           = mxCreateNumericMatrix(3, triangles.size(), mxINT32_CLASS, mxREAL);
+    int32_t*          subset      = (int32_t*) mxGetData(plhs[2]);
+    for (size_t iSel = 0; iSel < triangles.size(); ++iSel, subset += 3) {
+      const bool      isCoarse    = triangles[iSel] >= numTriangles;
+      const int32_t*  source      = isCoarse ? lodTria + 3*(triangles[iSel] - numTriangles) : tria + 3*triangles[iSel];
+      const int32_t   offset      = isCoarse ? static_cast<int32_t>(numVertices) : 0;
+      subset[0]                   = vertexMap[source[0] + offset];
+      subset[1]                   = vertexMap[source[1] + offset];
+      subset[2]                   = vertexMap[source[2] + offset];
+    }
+  }
+  for (size_t iSel = 0; iSel < vertices.size(); ++iSel)
+    vertexMap[vertices[iSel]]     = -1;
+
+  if (nlhs > 3) {
+    std::sort(objects.begin(), objects.end());
+    objects.erase(std::unique(objects.begin(), objects.end()), objects.end());
+    plhs[3]           = mxCreateDoubleMatrix(1, objects.size(), mxREAL);
+    std::copy(objects.begin(), objects.end(), mxGetPr(plhs[3]));
+  }
+
+  if (nlhs > 4) {
+    plhs[4]           = mxCreateLogicalMatrix(1, isVisible.size());
+    std::copy(isVisible.begin(), isVisible.end(), mxGetLogicals(plhs[4]));
+  }
+}
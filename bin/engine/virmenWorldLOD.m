@@ -0,0 +1,151 @@
+function lod = virmenWorldLOD(vrWorld, maxLevels, previous, objects)
+% lod = virmenWorldLOD(vrWorld, maxLevels)
+%   Coarser versions of the objects of a world as returned by loadVirmenWorld, drawn instead of
+%   the full objects when they are far enough from the animal (see virmenWorldGridQuery). Each
+%   level is obtained by clustering the vertices of an object on a grid anchored at its lower
+%   corner, starting at twice the mean edge length of the object and doubling at every level
+%   until the cells are larger than the object, with the position and color of each cluster
+%   averaged over its vertices; degenerate and duplicate triangles are dropped. Only levels that
+%   at least halve the number of triangles of the previous one are kept, up to maxLevels
+%   (default 4) per object, so that finely textured objects have a few levels and simple ones
+%   none.
+%
+%   Levels are listed by object and then by increasing cell size (levelSize), which is the
+%   size of the detail that is lost: a level is used once levelSize is seen under an angle
+%   smaller than vr.lodAngle. levelTriangles are ranges into lod.triangulation, whose 0-based
+%   indices refer to lod.vertices and lod.colors. As for the grid, levels are computed from
+%   vrWorld.surface and have to be rebuilt if objects are changed at runtime. The engine only
+%   builds them once vr.lodAngle > 0.
+%
+% lod = virmenWorldLOD(vrWorld, maxLevels, previous, objects)
+%   Recomputes only the levels of the given objects (e.g. those marked by virmenObjectsChanged)
+%   and takes those of the other objects from previous levels of the same world.
+
+if nargin < 2 || isempty(maxLevels)
+    maxLevels = 4;
+end
+
+vertices = vrWorld.surface.vertices;
+colors = vrWorld.surface.colors;
+objTriangles = vrWorld.objects.triangles;
+numObjects = size(objTriangles,1);
+if nargin < 4
+    previous = [];
+    objects = 1:numObjects;
+end
+isComputed = false(numObjects,1);
+isComputed(objects) = true;
+
+lod = struct;
+lod.vertices = zeros(3,0);
+lod.colors = zeros(size(colors,1),0);
+lod.triangulation = zeros(3,0,'int32');
+lod.levelObject = zeros(0,1);
+lod.levelSize = zeros(0,1);
+lod.levelTriangles = zeros(0,2);
+lod.objectTriangles = objTriangles;
+lod.objectBounds = NaN(numObjects,4);
+for obj = 1:numObjects
+    if isComputed(obj)
+        [level, lod.objectBounds(obj,:)] = objectLevels(vrWorld.surface.triangulation, objTriangles(obj,:), vertices, colors, maxLevels);
+    else
+        [level, lod.objectBounds(obj,:)] = previousLevels(previous, obj);
+    end
+    if isempty(level.size)
+        continue
+    end
+
+    numLevels = numel(level.size);
+    lod.levelTriangles = [lod.levelTriangles; size(lod.triangulation,2) + [cumsum([1; level.numTriangles(1:end-1)]) cumsum(level.numTriangles)]]; %#ok<AGROW>
+    lod.levelObject = [lod.levelObject; repmat(obj, numLevels, 1)]; %#ok<AGROW>
+    lod.levelSize = [lod.levelSize; level.size]; %#ok<AGROW>
+    lod.triangulation = [lod.triangulation level.triangulation + int32(size(lod.vertices,2))]; %#ok<AGROW>
+    lod.vertices = [lod.vertices level.vertices]; %#ok<AGROW>
+    lod.colors = [lod.colors level.colors]; %#ok<AGROW>
+end
+
+
+function [level, bounds] = objectLevels(triangulation, triangles, vertices, colors, maxLevels)
+% Levels of one object, with a triangulation that is 0-based within its own vertices
+level = struct('vertices',zeros(3,0), 'colors',zeros(size(colors,1),0), 'triangulation',zeros(3,0,'int32') ...
+              ,'size',zeros(0,1), 'numTriangles',zeros(0,1));
+bounds = NaN(1,4);
+objTria = double(triangulation(:,triangles(1):triangles(2))) + 1;
+if isempty(objTria)
+    return
+end
+[objVertices, ~, local] = unique(objTria(:));
+local = reshape(local,3,[]);
+pos = vertices(:,objVertices);
+col = colors(:,objVertices);
+corner = min(pos,[],2);
+extent = max(pos,[],2) - corner;
+bounds = [corner(1:2)' corner(1:2)'+extent(1:2)'];
+
+edges = [pos(:,local(1,:)) - pos(:,local(2,:)), pos(:,local(2,:)) - pos(:,local(3,:)), pos(:,local(3,:)) - pos(:,local(1,:))];
+cellSize = mean(sqrt(sum(edges.^2,1)));
+if ~(cellSize > 0)
+    return
+end
+
+% Past the size of the object, all vertices fall into a single cluster
+numTriangles = size(local,2);
+offset = bsxfun(@minus, pos, corner);
+while numel(level.size) < maxLevels && numTriangles > 1 && cellSize < max(extent)
+    cellSize = 2*cellSize;
+    [~, ~, cluster] = unique(floor(offset' / cellSize), 'rows');
+    numClusters = max(cluster);
+    cTria = reshape(cluster(local),3,[]);
+    cTria = cTria(:, cTria(1,:) ~= cTria(2,:) & cTria(2,:) ~= cTria(3,:) & cTria(3,:) ~= cTria(1,:));
+    [~, first] = unique(sort(cTria,1)', 'rows', 'first');
+    cTria = cTria(:,sort(first));
+    if isempty(cTria)
+        break
+    end
+    if size(cTria,2) > numTriangles/2
+        continue
+    end
+
+    % Only clusters that are still used by a triangle
+    [used, ~, cTria] = unique(cTria);
+    cTria = reshape(cTria,3,[]);
+    cPos = zeros(3,numClusters);
+    cCol = zeros(size(col,1),numClusters);
+    for row = 1:3
+        cPos(row,:) = accumarray(cluster, pos(row,:)', [numClusters 1], @mean)';
+    end
+    for row = 1:size(col,1)
+        cCol(row,:) = accumarray(cluster, col(row,:)', [numClusters 1], @mean)';
+    end
+
+    level.triangulation = [level.triangulation int32(cTria - 1 + size(level.vertices,2))];
+    level.vertices = [level.vertices cPos(:,used)];
+    level.colors = [level.colors cCol(:,used)];
+    level.size(end+1,1) = cellSize;
+    level.numTriangles(end+1,1) = size(cTria,2);
+    numTriangles = size(cTria,2);
+end
+
+
+function [level, bounds] = previousLevels(previous, obj)
+% Levels of one object as stored in previously built levels, whose vertices are contiguous
+bounds = previous.objectBounds(obj,:);
+iLevel = find(previous.levelObject == obj);
+triangles = zeros(1,0);
+for ndx = 1:numel(iLevel)
+    triangles = [triangles previous.levelTriangles(iLevel(ndx),1):previous.levelTriangles(iLevel(ndx),2)]; %#ok<AGROW>
+end
+level.triangulation = previous.triangulation(:,triangles);
+first = min(level.triangulation(:));
+if isempty(first)
+    first = int32(0);
+end
+level.triangulation = level.triangulation - first;
+numVertices = double(max(level.triangulation(:))) + 1;
+if isempty(numVertices)
+    numVertices = 0;
+end
+level.vertices = previous.vertices(:,double(first) + (1:numVertices));
+level.colors = previous.colors(:,double(first) + (1:numVertices));
+level.size = previous.levelSize(iLevel);
+level.numTriangles = previous.levelTriangles(iLevel,2) - previous.levelTriangles(iLevel,1) + 1;
@@ -46,16 +46,9 @@ for i = 1:length(dirArray)
         
         wasCopied = false;   % flag so we remember to delete copies
         
-        % check if this file requires GLFW
-        fid = fopen(f, 'r'); 
-        isGLFW=false; 
-        for ndx = 1:5 
-            str = fgetl(fid); 
-            if ~isempty(strfind(str,'GLFW')) || ~isempty(strfind(str,'GLEW'))
-                isGLFW = true;
-            end
-        end
-        fclose(fid);
+        % check if this file requires GLFW, i.e. includes it or GLEW anywhere
+        str = fileread(f);
+        isGLFW = ~isempty(regexp(str, '#include\s*["<](GLFW|GLEW)/', 'once'));
         
         % compile the file
         if ~isGLFW
@@ -82,6 +75,9 @@ for i = 1:length(dirArray)
 %                         mex('-O', '-LGLFW','-lglfw3','-lopengl32','-outdir', currentDir, f);
                     elseif strcmp(computer, 'MACI64') % '-Duint16_t=uint16_T',
                         mex('-O', '-L./GLFW','-v','-lglfw.3','LDFLAGS="\$LDFLAGS','-framework','Cocoa','-framework','OpenGL','-framework','IOKit','-framework','CoreVideo"','-outdir',currentDir,f);
+                    elseif strcmp(computer, 'GLNXA64')
+                        % system GLFW, GLEW (>= 2.1) and EGL; the latter enables headless rendering
+                        mex('-O','-DVIRMEN_EGL','-lglfw','-lGLEW','-lGL','-lEGL','-outdir',currentDir,f);
                     else
                         if wasCopied == true
                             delete(f);
@@ -17,10 +17,20 @@ function vr = initializationCodeFun(vr)
   vr.posIndex   = 0;
   vr.positions  = vr.exper.userdata.positions;
 
+  % Optionally record every frame to a raw file (see virmenReadCapture)
+  vr.captureFile= '';
+  if isfield(vr.exper.userdata, 'captureFile')
+    vr.captureFile  = vr.exper.userdata.captureFile;
+    virmenCaptureFrames('start', 1, vr.captureFile);
+  end
+
 % --- RUNTIME code: executes on every iteration of the ViRMEn engine.
 function vr = runtimeCodeFun(vr)
 
-  pause(1);
+  % Frames are captured as they are presented, otherwise allow time for an external capture
+  if isempty(vr.captureFile)
+    pause(1);
+  end
   vr.posIndex   = vr.posIndex + 1;
   if vr.posIndex > size(vr.positions,1);
     vr.experimentEnded  = true;
@@ -28,4 +38,11 @@ function vr = runtimeCodeFun(vr)
   end
   
   vr.position   = vr.positions(vr.posIndex,:);
-  
\ No newline at end of file
+  
+
+% --- TERMINATION code: executes after the ViRMEn engine stops.
+function vr = terminationCodeFun(vr)
+
+  if ~isempty(vr.captureFile)
+    virmenCaptureFrames('stop', 1);
+  end
@@ -17,39 +17,47 @@ end
 linearScale = 30;
 rotationScale = 2;
 
-switch vr.keyPressed
-    case 262
-        if vr.modifiers == 0
-            keyboardControl.rotation = -rotationScale;
-        elseif vr.modifiers == 2
-            keyboardControl.sideways = linearScale;
+% Apply all key events since the last frame in order, so that quick taps are not lost
+for iEvent = 1:size(vr.inputEvents,1)
+    key = vr.inputEvents(iEvent,3);
+    modifiers = vr.inputEvents(iEvent,4);
+    if vr.inputEvents(iEvent,2) == 1          % pressed
+        switch key
+            case 262
+                if modifiers == 0
+                    keyboardControl.rotation = -rotationScale;
+                elseif modifiers == 2
+                    keyboardControl.sideways = linearScale;
+                end
+            case 263
+                if modifiers == 0
+                    keyboardControl.rotation = rotationScale;
+                elseif modifiers == 2
+                    keyboardControl.sideways = -linearScale;
+                end
+            case 264
+                if modifiers == 0
+                    keyboardControl.forward = -linearScale;
+                elseif modifiers == 2
+                    keyboardControl.vertical = -linearScale;
+                end
+            case 265
+                if modifiers == 0
+                    keyboardControl.forward = linearScale;
+                elseif modifiers == 2
+                    keyboardControl.vertical = linearScale;
+                end
         end
-    case 263
-        if vr.modifiers == 0
-            keyboardControl.rotation = rotationScale;
-        elseif vr.modifiers == 2
-            keyboardControl.sideways = -linearScale;
+    elseif vr.inputEvents(iEvent,2) == 2      % released
+        switch key
+            case {262, 263}
+                keyboardControl.rotation = 0;
+                keyboardControl.sideways = 0;
+            case {264, 265}
+                keyboardControl.forward = 0;
+                keyboardControl.vertical = 0;
         end
-    case 264
-        if vr.modifiers == 0
-            keyboardControl.forward = -linearScale;
-        elseif vr.modifiers == 2
-            keyboardControl.vertical = -linearScale;
-        end
-    case 265
-        if vr.modifiers == 0
-            keyboardControl.forward = linearScale;
-        elseif vr.modifiers == 2
-            keyboardControl.vertical = linearScale;
-        end
-end
-switch vr.keyReleased
-    case {262, 263}
-        keyboardControl.rotation = 0;
-        keyboardControl.sideways = 0;
-    case {264, 265}
-        keyboardControl.forward = 0;
-        keyboardControl.vertical = 0;
+    end
 end
 
 velocity = [keyboardControl.forward*[sin(-vr.position(4)) cos(-vr.position(4))]+keyboardControl.sideways*[cos(vr.position(4)) sin(vr.position(4))] ...
@@ -0,0 +1,333 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <chrono>
+#include <algorithm>
+#include "virmenCollisions.h"
+
+
+/**
+  Compares the AVX2 intersection kernels of virmenCollisions.h with the scalar ones, which they
+  must reproduce exactly: the same wall, type and crossing point (bit for bit) for random tables
+  and for degenerate ones (parallel walls, zero radius, fewer than 4 candidates, ties between
+  lanes and displacements that are zero or miss every circle). Whole collision resolutions are
+  then compared, and the speedup of the AVX2 kernels is reported for a dense table.
+
+  Returns 77 (skipped) if the CPU does not support AVX2.
+*/
+
+using namespace collisions;
+
+static int          numFailures     = 0;
+
+static double urand()               { return rand() / (RAND_MAX + 1.0); }
+
+
+/// Wall between two points with borders as computed by loadVirmenWorld
+static Wall makeWall(double x1, double y1, double x2, double y2, double radius)
+{
+  Wall              wall;
+  const double      endpoints[]     = { x1, y1, x2, y2 };
+  std::copy(endpoints, endpoints + 4, wall.endpoints);
+  wall.radius2      = radius * radius;
+  wall.angle        = atan2(y2 - y1, x2 - x1);
+  const double      normal[]        = { radius * cos(wall.angle + M_PI/2), radius * sin(wall.angle + M_PI/2) };
+  for (int iCol = 0; iCol < 4; ++iCol) {
+    wall.border[0][iCol]            = endpoints[iCol] + normal[iCol % 2];
+    wall.border[1][iCol]            = endpoints[iCol] - normal[iCol % 2];
+  }
+  return wall;
+}
+
+static bool sameHit(const Hit& a, const Hit& b)
+{
+  return a.iWall == b.iWall && a.type == b.type && std::memcmp(&a.crossingPt, &b.crossingPt, sizeof(double)) == 0;
+}
+
+/// Runs each kernel in both versions from the same initial hit, and then all three in sequence
+static void compareKernels(const char* name, const std::vector<Wall>& wall, const std::vector<int>& walls, const double* pos, const double* dp, const Hit& initial = Hit())
+{
+  const Wall*       data            = wall.empty() ? 0 : &wall[0];
+  Hit               scalar[4], vector[4];
+  for (int iKernel = 0; iKernel < 4; ++iKernel)
+    scalar[iKernel] = vector[iKernel] = initial;
+
+  lineLineIntersection        (pos, dp, data, 0, walls, scalar[0]);
+  avx2::lineLineIntersection  (pos, dp, data, 0, walls, vector[0]);
+  lineLineIntersection        (pos, dp, data, 1, walls, scalar[1]);
+  avx2::lineLineIntersection  (pos, dp, data, 1, walls, vector[1]);
+  lineCircleIntersection      (pos, dp, data, walls, scalar[2]);
+  avx2::lineCircleIntersection(pos, dp, data, walls, vector[2]);
+
+  lineLineIntersection        (pos, dp, data, 0, walls, scalar[3]);
+  lineLineIntersection        (pos, dp, data, 1, walls, scalar[3]);
+  lineCircleIntersection      (pos, dp, data, walls, scalar[3]);
+  avx2::lineLineIntersection  (pos, dp, data, 0, walls, vector[3]);
+  avx2::lineLineIntersection  (pos, dp, data, 1, walls, vector[3]);
+  avx2::lineCircleIntersection(pos, dp, data, walls, vector[3]);
+
+  for (int iKernel = 0; iKernel < 4; ++iKernel)
+    if (!sameHit(scalar[iKernel], vector[iKernel])) {
+      if (++numFailures <= 20)
+        printf( "FAILED %s, kernel %d, %d candidates: scalar wall %d type %d at %.17g, AVX2 wall %d type %d at %.17g\n"
+              , name, iKernel, static_cast<int>(walls.size())
+              , scalar[iKernel].iWall, scalar[iKernel].type, scalar[iKernel].crossingPt
+              , vector[iKernel].iWall, vector[iKernel].type, vector[iKernel].crossingPt
+              );
+    }
+}
+
+static std::vector<int> allWalls(size_t numWalls)
+{
+  std::vector<int>  walls(numWalls);
+  for (size_t iWall = 0; iWall < numWalls; ++iWall)
+    walls[iWall]    = static_cast<int>(iWall);
+  return walls;
+}
+
+
+//=============================================================================
+//  Degenerate tables
+//=============================================================================
+
+static void testDegenerate()
+{
+  // Walls parallel to the displacement, whose determinant is zero
+  {
+    std::vector<Wall> wall;
+    for (int iWall = 0; iWall < 9; ++iWall)
+      wall.push_back(makeWall(0, iWall - 4.0, 10, iWall - 4.0, 0.5));
+    const double    pos[]           = { -5, 0 }, dp[] = { 20, 0 };
+    compareKernels("parallel walls", wall, allWalls(wall.size()), pos, dp);
+    const double    along[]         = { -5, 0.5 };
+    compareKernels("along a border", wall, allWalls(wall.size()), along, dp);
+  }
+
+  // Zero radius, where borders are the wall itself and circles are points
+  {
+    std::vector<Wall> wall;
+    for (int iWall = 0; iWall < 11; ++iWall)
+      wall.push_back(makeWall(iWall, -1, iWall, 1, 0));
+    const double    pos[]           = { -0.5, 0 }, dp[] = { 12, 0 };
+    compareKernels("zero radius", wall, allWalls(wall.size()), pos, dp);
+    const double    endpoint[]      = { -0.5, 1 };
+    compareKernels("zero radius through endpoints", wall, allWalls(wall.size()), endpoint, dp);
+  }
+
+  // Fewer than 4 candidates, which are only tested by the scalar loop
+  for (size_t numWalls = 0; numWalls < 9; ++numWalls) {
+    std::vector<Wall> wall;
+    for (size_t iWall = 0; iWall < numWalls; ++iWall)
+      wall.push_back(makeWall(1 + iWall, -1, 1.5 + iWall, 1, 0.25));
+    const double    pos[]           = { 0, 0 }, dp[] = { 10, 0.1 };
+    compareKernels("few candidates", wall, allWalls(numWalls), pos, dp);
+  }
+
+  // Ties between identical walls in the same lane, in different lanes and across the scalar tail
+  {
+    std::vector<Wall> wall;
+    for (int iWall = 0; iWall < 10; ++iWall)
+      wall.push_back(makeWall(5, -2, 5, 2, 0.5));
+    const double    pos[]           = { 0, 0 }, dp[] = { 10, 0 };
+    const double    corner[]        = { 0, 2.5 }, diagonal[] = { 10, -5 };
+    std::vector<int> walls          = allWalls(wall.size());
+    compareKernels("identical walls", wall, walls, pos, dp);
+    compareKernels("identical circles", wall, walls, corner, diagonal);
+    std::reverse(walls.begin(), walls.end());
+    compareKernels("identical walls, reversed", wall, walls, pos, dp);
+    for (size_t iTail = 0; iTail < walls.size(); ++iTail) {
+      std::vector<Wall> tied(10, makeWall(20, -2, 20, 2, 0.5));
+      tied[iTail]   = wall[0];
+      tied[(iTail + 4) % tied.size()] = wall[0];
+      compareKernels("tie at lane and tail", tied, allWalls(tied.size()), pos, dp);
+    }
+  }
+
+  // Previous hit that is nearer, farther or at the same crossing point
+  {
+    std::vector<Wall> wall;
+    for (int iWall = 0; iWall < 8; ++iWall)
+      wall.push_back(makeWall(2 + iWall, -1, 2 + iWall, 1, 0.5));
+    const double    pos[]           = { 0, 0 }, dp[] = { 10, 0 };
+    Hit             previous;
+    previous.iWall  = 99;
+    const double    crossing[]      = { 0.1, 0.15, 0.5, 2 };
+    for (int iPrev = 0; iPrev < 4; ++iPrev) {
+      previous.crossingPt           = crossing[iPrev];
+      compareKernels("previous hit", wall, allWalls(wall.size()), pos, dp, previous);
+    }
+  }
+
+  // Zero displacement, and circles that are missed with a negative discriminant
+  {
+    std::vector<Wall> wall;
+    for (int iWall = 0; iWall < 12; ++iWall)
+      wall.push_back(makeWall(iWall, 3, iWall + 0.5, 4, 0.25));
+    const double    pos[]           = { 0, 0 }, still[] = { 0, 0 }, dp[] = { 12, 0 };
+    compareKernels("zero displacement", wall, allWalls(wall.size()), pos, still);
+    compareKernels("missed circles", wall, allWalls(wall.size()), pos, dp);
+    const double    inside[]        = { 0, 3 };
+    compareKernels("zero displacement in circle", wall, allWalls(wall.size()), inside, still);
+  }
+}
+
+
+//=============================================================================
+//  Random tables
+//=============================================================================
+
+static std::vector<Wall> randomWalls(size_t numWalls, double size, bool isAxisAligned)
+{
+  std::vector<Wall> wall;
+  for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+    const double    x               = urand() * size;
+    const double    y               = urand() * size;
+    const double    angle           = isAxisAligned ? (rand() % 4) * M_PI/2 : urand() * 2*M_PI;
+    const double    length          = urand() * size / 4;
+    const double    radius          = (rand() % 5 == 0) ? 0 : 0.1 + urand();
+    wall.push_back(makeWall(x, y, x + length * cos(angle), y + length * sin(angle), radius));
+  }
+  return wall;
+}
+
+static void testRandom()
+{
+  const size_t      numWalls[]      = { 1, 2, 3, 4, 5, 7, 8, 13, 64, 500 };
+  for (int iTable = 0; iTable < 200; ++iTable) {
+    const double    size            = 20 + urand() * 100;
+    std::vector<Wall> wall          = randomWalls(numWalls[iTable % 10], size, iTable % 3 == 0);
+    std::vector<int> walls          = allWalls(wall.size());
+    for (int iQuery = 0; iQuery < 100; ++iQuery) {
+      if (iQuery % 10 == 0)
+        std::random_shuffle(walls.begin(), walls.end());
+      const double  pos[]           = { urand() * size, urand() * size };
+      const double  scale           = (iQuery % 4 == 0) ? size : 3;
+      const double  dp[]            = { (urand() - 0.5) * scale, (urand() - 0.5) * scale };
+      compareKernels("random", wall, walls, pos, dp);
+    }
+  }
+}
+
+
+//=============================================================================
+//  Whole resolution and speed
+//=============================================================================
+
+static WallTable packTable(const std::vector<Wall>& wall)
+{
+  const size_t      numWalls        = wall.size();
+  std::vector<double> endpoints(4*numWalls), radius2(numWalls), angle(numWalls), border1(4*numWalls), border2(4*numWalls);
+  for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+    for (int iCol = 0; iCol < 4; ++iCol) {
+      endpoints[iWall + iCol*numWalls]  = wall[iWall].endpoints[iCol];
+      border1  [iWall + iCol*numWalls]  = wall[iWall].border[0][iCol];
+      border2  [iWall + iCol*numWalls]  = wall[iWall].border[1][iCol];
+    }
+    radius2[iWall]  = wall[iWall].radius2;
+    angle  [iWall]  = wall[iWall].angle;
+  }
+  WallTable         table;
+  table.pack(numWalls, &endpoints[0], &radius2[0], &angle[0], &border1[0], &border2[0]);
+  return table;
+}
+
+static void testResolution()
+{
+  const double      EPSILON         = 1e-12;
+  int               numCollisions   = 0;
+  for (int iTable = 0; iTable < 20; ++iTable) {
+    const double    size            = 50;
+    const WallTable table           = packTable(randomWalls(10 + rand() % 300, size, iTable % 2 == 0));
+    for (int iQuery = 0; iQuery < 500; ++iQuery) {
+      const double  pos[]           = { urand() * size, urand() * size };
+      const double  dp[]            = { (urand() - 0.5) * 10, (urand() - 0.5) * 10 };
+      const double  dpResolution    = (iQuery % 2) ? HUGE_VAL : 0.01;
+      double        scalarDP[2], vectorDP[2];
+      avx2::enabled()               = false;
+      const bool    scalarHit       = resolveCollisions(pos, dp, table, dpResolution, scalarDP);
+      avx2::enabled()               = true;
+      const bool    vectorHit       = resolveCollisions(pos, dp, table, dpResolution, vectorDP);
+      numCollisions                += scalarHit;
+      if (scalarHit != vectorHit || fabs(scalarDP[0] - vectorDP[0]) > EPSILON || fabs(scalarDP[1] - vectorDP[1]) > EPSILON)
+        if (++numFailures <= 20)
+          printf( "FAILED resolution from (%.17g, %.17g) by (%.17g, %.17g): scalar (%.17g, %.17g) %d, AVX2 (%.17g, %.17g) %d\n"
+                , pos[0], pos[1], dp[0], dp[1], scalarDP[0], scalarDP[1], scalarHit, vectorDP[0], vectorDP[1], vectorHit
+                );
+    }
+  }
+  printf("Resolutions compared: 10000, %d with collisions\n", numCollisions);
+}
+
+static double timeKernels(const std::vector<Wall>& wall, const std::vector<int>& walls, const std::vector<double>& queries, bool useAVX2)
+{
+  const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+  double            checksum        = 0;
+  for (size_t iQuery = 0; iQuery + 4 <= queries.size(); iQuery += 4) {
+    Hit             nearest;
+    if (useAVX2) {
+      avx2::lineLineIntersection  (&queries[iQuery], &queries[iQuery+2], &wall[0], 0, walls, nearest);
+      avx2::lineLineIntersection  (&queries[iQuery], &queries[iQuery+2], &wall[0], 1, walls, nearest);
+      avx2::lineCircleIntersection(&queries[iQuery], &queries[iQuery+2], &wall[0], walls, nearest);
+    }
+    else {
+      lineLineIntersection        (&queries[iQuery], &queries[iQuery+2], &wall[0], 0, walls, nearest);
+      lineLineIntersection        (&queries[iQuery], &queries[iQuery+2], &wall[0], 1, walls, nearest);
+      lineCircleIntersection      (&queries[iQuery], &queries[iQuery+2], &wall[0], walls, nearest);
+    }
+    checksum       += nearest.iWall;
+  }
+  const double      elapsed         = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  if (checksum == -1)
+    printf("%g\n", checksum);       // keeps the loop from being optimized away
+  return elapsed;
+}
+
+static void benchmark()
+{
+  const std::vector<Wall> wall      = randomWalls(64, 50, false);
+  const std::vector<int>  walls     = allWalls(wall.size());
+  std::vector<double>     queries;
+  for (int iQuery = 0; iQuery < 200000; ++iQuery) {
+    queries.push_back(urand() * 50);
+    queries.push_back(urand() * 50);
+    queries.push_back(urand() - 0.5);
+    queries.push_back(urand() - 0.5);
+  }
+  timeKernels(wall, walls, queries, false);
+  const double      scalarTime      = timeKernels(wall, walls, queries, false);
+  const double      vectorTime      = timeKernels(wall, walls, queries, true);
+  const double      numCalls        = queries.size() / 4;
+  printf( "Kernels for %d candidates: scalar %.1f ns/query, AVX2 %.1f ns/query, speedup %.2fx\n"
+        , static_cast<int>(walls.size()), 1e9 * scalarTime / numCalls, 1e9 * vectorTime / numCalls, scalarTime / vectorTime
+        );
+}
+
+
+int main()
+{
+#ifdef VIRMEN_AVX2
+  if (!has_avx2()) {
+    printf("AVX2 is not supported by this CPU, skipped.\n");
+    return 77;
+  }
+
+  srand(1);
+  testDegenerate();
+  testRandom();
+  testResolution();
+  benchmark();
+  avx2::enabled()   = has_avx2();
+
+  if (numFailures > 0) {
+    printf("%d comparisons FAILED.\n", numFailures);
+    return 1;
+  }
+  printf("AVX2 kernels are identical to the scalar ones.\n");
+  return 0;
+#else
+  printf("AVX2 kernels are not compiled for this architecture, skipped.\n");
+  return 77;
+#endif
+}
@@ -0,0 +1,223 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <chrono>
+#include "virmenCollisions.h"
+
+
+/**
+  testCollisionReplay [--max-tunnelling N] [--max-stuck N] [--max-iteration-limits N] fixture...
+
+  Replays recorded positions and displacements (see writeCollisionFixture.m) against the walls
+  saved with them, and checks each step for:
+    - mismatches with the recorded result, i.e. changes in behavior;
+    - tunnelling, a final position within the radius of a wall that the start was not, or a
+      path that crosses the wall itself;
+    - corner sticking, no motion at all although sliding along either axis would have made
+      some progress in the direction of the displacement;
+    - iteration limits, where detectCollision gave up and zeroed the displacement.
+  Fails if there is any mismatch, or more tunnelling, stuck steps or iteration limits than
+  allowed (none by default; limits apply to the fixtures that follow them). The time per call
+  of resolveCollisions is reported.
+*/
+
+using namespace collisions;
+
+
+struct Fixture
+{
+  size_t                      numWalls;
+  std::vector<double>         endpoints, radius2, angle, border1, border2;      // columns of vrWorld.walls
+  double                      dpResolution;
+  std::vector<double>         steps;                                            // x y dx dy outDx outDy collision
+};
+
+/// Reads a number as written by Matlab, which includes Inf and NaN
+static bool readNumber(std::istream& input, double& value)
+{
+  std::string                 token;
+  if (!(input >> token))
+    return false;
+  char*                       end;
+  value                       = std::strtod(token.c_str(), &end);
+  return *end == 0;
+}
+
+static bool readFixture(const char* file, Fixture& fixture)
+{
+  std::ifstream               input(file);
+  std::string                 tag;
+  int                         version       = 0;
+  bool                        isValid       = true;
+  if (!(input >> tag >> version) || tag != "virmenCollisionFixture" || version != 1)
+    return false;
+
+  if (!(input >> tag >> fixture.numWalls) || tag != "walls")
+    return false;
+  const size_t                numWalls      = fixture.numWalls;
+  fixture.endpoints.resize(4*numWalls);
+  fixture.radius2  .resize(numWalls);
+  fixture.angle    .resize(numWalls);
+  fixture.border1  .resize(4*numWalls);
+  fixture.border2  .resize(4*numWalls);
+  for (size_t iWall = 0; iWall < numWalls; ++iWall) {
+    for (int iCol = 0; iCol < 4; ++iCol)      isValid = readNumber(input, fixture.endpoints[iWall + iCol*numWalls]) && isValid;
+    isValid                   = readNumber(input, fixture.radius2[iWall]) && readNumber(input, fixture.angle[iWall]) && isValid;
+    for (int iCol = 0; iCol < 4; ++iCol)      isValid = readNumber(input, fixture.border1[iWall + iCol*numWalls]) && isValid;
+    for (int iCol = 0; iCol < 4; ++iCol)      isValid = readNumber(input, fixture.border2[iWall + iCol*numWalls]) && isValid;
+  }
+
+  size_t                      numSteps      = 0;
+  if (!(input >> tag) || tag != "dpResolution" || !readNumber(input, fixture.dpResolution))
+    return false;
+  if (!(input >> tag >> numSteps) || tag != "steps")
+    return false;
+  fixture.steps.resize(7*numSteps);
+  for (size_t index = 0; index < fixture.steps.size(); ++index)
+    isValid                   = readNumber(input, fixture.steps[index]) && isValid;
+  return isValid;
+}
+
+
+static double segmentDistance(const double* p, const double* e)
+{
+  const double                ab[]          = { e[2] - e[0], e[3] - e[1] };
+  const double                ap[]          = { p[0] - e[0], p[1] - e[1] };
+  const double                length2       = ab[0]*ab[0] + ab[1]*ab[1];
+  const double                t             = length2 > 0 ? std::max(0.0, std::min(1.0, (ap[0]*ab[0] + ap[1]*ab[1]) / length2)) : 0;
+  return hypot(ap[0] - t*ab[0], ap[1] - t*ab[1]);
+}
+
+/// Whether the segments p0-p1 and the wall e cross each other, excluding touching ends
+static bool crosses(const double* p0, const double* p1, const double* e)
+{
+  const double                d[]           = { p1[0] - p0[0], p1[1] - p0[1] };
+  const double                w[]           = { e[2] - e[0], e[3] - e[1] };
+  const double                det           = d[0]*w[1] - d[1]*w[0];
+  if (det == 0)
+    return false;
+  const double                q[]           = { e[0] - p0[0], e[1] - p0[1] };
+  const double                t             = ( q[0]*w[1] - q[1]*w[0] ) / det;
+  const double                s             = ( q[0]*d[1] - q[1]*d[0] ) / det;
+  return t > 0 && t < 1 && s > 0 && s < 1;
+}
+
+static bool isTunnelling(const WallTable& table, const double* pos, const double* outDP)
+{
+  const double                end[]         = { pos[0] + outDP[0], pos[1] + outDP[1] };
+  for (size_t iWall = 0; iWall < table.size(); ++iWall) {
+    const Wall&               wall          = table.data()[iWall];
+    const double              radius        = sqrt(wall.radius2);
+    if (segmentDistance(pos, wall.endpoints) >= radius && segmentDistance(end, wall.endpoints) < radius * (1 - 1e-9))
+      return true;
+    if (crosses(pos, end, wall.endpoints))
+      return true;
+  }
+  return false;
+}
+
+static bool isStuck(const WallTable& table, const double* pos, const double* dp, const double dpResolution, const double* outDP)
+{
+  const double                length        = hypot(dp[0], dp[1]);
+  if (!(length > 0) || hypot(outDP[0], outDP[1]) > 1e-9 * length)
+    return false;
+  for (int iAxis = 0; iAxis < 2; ++iAxis) {
+    const double              probe[]       = { iAxis == 0 ? dp[0] : 0, iAxis == 1 ? dp[1] : 0 };
+    double                    probeDP[2];
+    resolveCollisions(pos, probe, table, dpResolution, probeDP);
+    if (probeDP[0]*dp[0] + probeDP[1]*dp[1] > 0.25 * hypot(probe[0], probe[1]) * length)
+      return true;
+  }
+  return false;
+}
+
+
+struct Limits
+{
+  size_t                      tunnelling, stuck, iterationLimits;
+
+  Limits() : tunnelling(0), stuck(0), iterationLimits(0) { }
+};
+
+static bool replay(const char* file, const Limits& limits)
+{
+  Fixture                     fixture;
+  if (!readFixture(file, fixture)) {
+    printf("FAILED to read %s\n", file);
+    return false;
+  }
+  WallTable                   table;
+  table.pack( fixture.numWalls, fixture.endpoints.data(), fixture.radius2.data(), fixture.angle.data()
+            , fixture.border1.data(), fixture.border2.data()
+            );
+
+  const size_t                numSteps      = fixture.steps.size() / 7;
+  size_t                      numCollisions = 0, numMismatches = 0, numTunnelling = 0, numStuck = 0, numLimits = 0;
+  double                      elapsed       = 0;
+  for (size_t iStep = 0; iStep < numSteps; ++iStep) {
+    const double*             step          = &fixture.steps[7*iStep];
+    const double*             pos           = step;
+    const double*             dp            = step + 2;
+    const double*             recorded      = step + 4;
+    double                    outDP[2];
+
+    const size_t              numPrevious   = diagnostics().iterationLimits;
+    const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    const bool                collision     = resolveCollisions(pos, dp, table, fixture.dpResolution, outDP);
+    elapsed                  += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    numLimits                += diagnostics().iterationLimits - numPrevious;
+    numCollisions            += collision;
+
+    const double              tolerance     = 1e-9 * (1 + hypot(dp[0], dp[1]));
+    if (collision != (recorded[2] != 0) || fabs(outDP[0] - recorded[0]) > tolerance || fabs(outDP[1] - recorded[1]) > tolerance) {
+      if (++numMismatches <= 5)
+        printf( "  step %d from (%.17g, %.17g) by (%.17g, %.17g): (%.17g, %.17g) instead of (%.17g, %.17g)\n"
+              , static_cast<int>(iStep + 1), pos[0], pos[1], dp[0], dp[1], outDP[0], outDP[1], recorded[0], recorded[1]
+              );
+    }
+    if (isTunnelling(table, pos, outDP)) {
+      if (++numTunnelling <= 5)
+        printf("  step %d tunnels from (%.17g, %.17g) by (%.17g, %.17g)\n", static_cast<int>(iStep + 1), pos[0], pos[1], outDP[0], outDP[1]);
+    }
+    numStuck                 += isStuck(table, pos, dp, fixture.dpResolution, outDP);
+  }
+
+  const bool                  isPassed      = numMismatches == 0 && numTunnelling <= limits.tunnelling && numStuck <= limits.stuck
+                                            && numLimits <= limits.iterationLimits;
+  printf( "%s %s: %d walls, %d steps, %d collisions, %d mismatches, %d tunnelling, %d stuck, %d iteration limits, %.0f ns/call\n"
+        , isPassed ? "Passed" : "FAILED", file, static_cast<int>(fixture.numWalls), static_cast<int>(numSteps)
+        , static_cast<int>(numCollisions), static_cast<int>(numMismatches), static_cast<int>(numTunnelling)
+        , static_cast<int>(numStuck), static_cast<int>(numLimits), numSteps > 0 ? 1e9 * elapsed / numSteps : 0.0
+        );
+  return isPassed;
+}
+
+
+int main(int argc, char** argv)
+{
+  Limits                      limits;
+  int                         numFixtures   = 0;
+  bool                        isPassed      = true;
+  for (int iArg = 1; iArg < argc; ++iArg) {
+    if (std::strcmp(argv[iArg], "--max-tunnelling") == 0 && iArg + 1 < argc)
+      limits.tunnelling       = std::strtoul(argv[++iArg], 0, 10);
+    else if (std::strcmp(argv[iArg], "--max-stuck") == 0 && iArg + 1 < argc)
+      limits.stuck            = std::strtoul(argv[++iArg], 0, 10);
+    else if (std::strcmp(argv[iArg], "--max-iteration-limits") == 0 && iArg + 1 < argc)
+      limits.iterationLimits  = std::strtoul(argv[++iArg], 0, 10);
+    else {
+      isPassed                = replay(argv[iArg], limits) && isPassed;
+      ++numFixtures;
+    }
+  }
+
+  if (numFixtures == 0) {
+    printf("Usage: testCollisionReplay [--max-tunnelling N] [--max-stuck N] [--max-iteration-limits N] fixture...\n");
+    return 2;
+  }
+  return isPassed ? 0 : 1;
+}
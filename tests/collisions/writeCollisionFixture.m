@@ -0,0 +1,22 @@
+function writeCollisionFixture(file, walls, dpResolution, steps)
+% writeCollisionFixture(file, walls, dpResolution, steps)
+%   Saves the walls of a world (vrWorld.walls) and a sequence of calls to
+%   virmenResolveCollisions for testCollisionReplay. steps is N x 7, one row per call with the
+%   position, the displacement, the resolved displacement and the collision flag:
+%   [x y dx dy outDx outDy collision]. To record them during an experiment, add to the runtime
+%   code (where vr.position has already been moved by the resolved vr.dp):
+%       vr.steps(end+1,:) = [vr.position(1:2) - vr.dp(1:2), vr.velocity(1:2)*vr.dt, vr.dp(1:2), vr.collision];
+%   and at termination:
+%       writeCollisionFixture('session.txt', vr.worlds{vr.currentWorld}.walls, vr.dpResolution, vr.steps);
+
+fid = fopen(file, 'w');
+if fid < 0
+    error('writeCollisionFixture:file', 'Could not open %s for writing.', file);
+end
+fprintf(fid, 'virmenCollisionFixture 1\n');
+fprintf(fid, 'walls %d\n', size(walls.endpoints,1));
+fprintf(fid, [repmat('%.17g ',1,13) '%.17g\n'], [walls.endpoints, walls.radius2, walls.angle, walls.border1, walls.border2]');
+fprintf(fid, 'dpResolution %.17g\n', dpResolution);
+fprintf(fid, 'steps %d\n', size(steps,1));
+fprintf(fid, [repmat('%.17g ',1,6) '%d\n'], steps');
+fclose(fid);